@@ -29,6 +29,7 @@
 #include "miner.h"
 #include "util.h"
 #include "driver-cpu.h" /* for algo_names[], TODO: re-factor dependency */
+#include "driver-opencl.h"
 
 #if defined(USE_BITFORCE) || defined(USE_ICARUS) || defined(USE_MODMINER) || defined(USE_X6500) || defined(USE_ZTEX)
 #define HAVE_AN_FPGA 1
@@ -134,7 +135,7 @@ static const char SEPARATOR = '|';
 #define SEPSTR "|"
 static const char GPUSEP = ',';
 
-static const char *APIVERSION = "1.24";
+static const char *APIVERSION = "1.25";
 static const char *DEAD = "Dead";
 static const char *SICK = "Sick";
 static const char *NOSTART = "NoStart";
@@ -145,8 +146,10 @@ static const char *ALIVE = "Alive";
 static const char *REJECTING = "Rejecting";
 static const char *UNKNOWN = "Unknown";
 #define _DYNAMIC "D"
+#define _THROUGHPUT "T"
 #ifdef HAVE_OPENCL
 static const char *DYNAMIC = _DYNAMIC;
+static const char *THROUGHPUT = _THROUGHPUT;
 #endif
 
 static const char *YES = "Y";
@@ -234,6 +237,8 @@ static const char *OSINFO =
 #define _MINECOIN	"COIN"
 #define _DEBUGSET	"DEBUG"
 #define _SETCONFIG	"SETCONFIG"
+#define _LATENCY	"LATENCY"
+#define _GPUPROFILE	"GPUPROFILE"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -275,6 +280,8 @@ static const char ISJSON = '{';
 #define JSON_MINECOIN	JSON1 _MINECOIN JSON2
 #define JSON_DEBUGSET	JSON1 _DEBUGSET JSON2
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
+#define JSON_LATENCY	JSON1 _LATENCY JSON2
+#define JSON_GPUPROFILE	JSON1 _GPUPROFILE JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 
@@ -394,6 +401,13 @@ static const char *JSON_PARAMETER = "parameter";
 #define MSG_ZERSUM 96
 #define MSG_ZERNOSUM 97
 
+#define MSG_LATENCY 98
+
+#ifdef HAVE_OPENCL
+#define MSG_GPUPROF 99
+#define MSG_GPUPROFOFF 100
+#endif
+
 enum code_severity {
 	SEVERITY_ERR,
 	SEVERITY_WARN,
@@ -506,7 +520,7 @@ struct CODES {
  { SEVERITY_ERR,   MSG_MISVAL,	PARAM_NONE,	"Missing comma after GPU number" },
  { SEVERITY_ERR,   MSG_NOADL,	PARAM_NONE,	"ADL is not available" },
  { SEVERITY_ERR,   MSG_NOGPUADL,PARAM_GPU,	"GPU %d does not have ADL" },
- { SEVERITY_ERR,   MSG_INVINT,	PARAM_STR,	"Invalid intensity (%s) - must be '" _DYNAMIC  "' or fixed number within range" },
+ { SEVERITY_ERR,   MSG_INVINT,	PARAM_STR,	"Invalid intensity (%s) - must be '" _DYNAMIC "', '" _THROUGHPUT "' or fixed number within range" },
  { SEVERITY_INFO,  MSG_GPUINT,	PARAM_BOTH,	"GPU %d set new intensity to %s" },
  { SEVERITY_SUCC,  MSG_MINECONFIG,PARAM_NONE,	"BFGMiner config" },
 #ifdef HAVE_OPENCL
@@ -568,6 +582,11 @@ struct CODES {
  { SEVERITY_ERR,   MSG_ZERINV,	PARAM_STR,	"Invalid zero parameter '%s'" },
  { SEVERITY_SUCC,  MSG_ZERSUM,	PARAM_STR,	"Zeroed %s stats with summary" },
  { SEVERITY_SUCC,  MSG_ZERNOSUM, PARAM_STR,	"Zeroed %s stats without summary" },
+ { SEVERITY_SUCC,  MSG_LATENCY,	PARAM_NONE,	"Latency stats" },
+#ifdef HAVE_OPENCL
+ { SEVERITY_SUCC,  MSG_GPUPROF,	PARAM_NONE,	"GPU profile" },
+ { SEVERITY_ERR,   MSG_GPUPROFOFF, PARAM_NONE,	"GPU profiling is off, start with --gpu-profile" },
+#endif
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -1913,6 +1932,8 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_diff(root, "Difficulty Accepted", &(pool->diff_accepted), false);
 		root = api_add_diff(root, "Difficulty Rejected", &(pool->diff_rejected), false);
 		root = api_add_diff(root, "Difficulty Stale", &(pool->diff_stale), false);
+		root = api_add_uint(root, "Filtered", &(pool->filtered_shares), false);
+		root = api_add_diff(root, "Difficulty Filtered", &(pool->diff_filtered), false);
 		root = api_add_diff(root, "Last Share Difficulty", &(pool->last_share_diff), false);
 		root = api_add_bool(root, "Has Stratum", &(pool->has_stratum), false);
 		root = api_add_bool(root, "Stratum Active", &(pool->stratum_active), false);
@@ -1921,6 +1942,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		else
 			root = api_add_const(root, "Stratum URL", BLANK, false);
 		root = api_add_uint64(root, "Best Share", &(pool->best_diff), true);
+		root = api_add_int(root, "In Flight", &(pool->shares_inflight), false);
 
 		root = print_data(root, buf, isjson, isjson && (i > 0));
 		io_add(io_data, buf);
@@ -2464,9 +2486,10 @@ static void gpuintensity(struct io_data *io_data, __maybe_unused SOCKETTYPE c,
     if(!splitgpuvalue(io_data, param, &id, &value, isjson))
       return;
 
-    if(!strncasecmp(value, DYNAMIC, 1)) {
+    if(!strncasecmp(value, DYNAMIC, 1) || !strncasecmp(value, THROUGHPUT, 1)) {
         gpus[id].dynamic = true;
-        strcpy(intensitystr, DYNAMIC);
+        gpus[id].dyn_throughput = !strncasecmp(value, THROUGHPUT, 1);
+        strcpy(intensitystr, gpus[id].dyn_throughput ? THROUGHPUT : DYNAMIC);
     } else {
         intensity = atoi(value);
 
@@ -2856,6 +2879,152 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		io_close(io_data);
 }
 
+static void latencystats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	struct latency_hist latency[LATENCY_MAX];
+	struct api_data *root;
+	char buf[TMPBUFSIZ];
+	char hist[LATENCY_BUCKETS * 21];
+	bool io_open = false;
+	int i, j, k, n = 0;
+
+	if (total_pools == 0) {
+		message(io_data, MSG_NOPOOL, 0, NULL, isjson);
+		return;
+	}
+
+	message(io_data, MSG_LATENCY, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_LATENCY);
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (pool->removed)
+			continue;
+
+		mutex_lock(&pool->pool_lock);
+		memcpy(latency, pool->latency, sizeof(latency));
+		mutex_unlock(&pool->pool_lock);
+
+		for (j = 0; j < LATENCY_MAX; j++) {
+			struct latency_hist *h = &latency[j];
+			double avg = h->samples ? h->total_us / 1000.0 / h->samples : 0;
+			double max = h->max_us / 1000.0;
+			double p50 = latency_pct(h, 50);
+			double p90 = latency_pct(h, 90);
+			double p99 = latency_pct(h, 99);
+			char *ptr = hist;
+
+			/* Bucket k counts samples under 2^(k+1) microseconds */
+			for (k = 0; k < LATENCY_BUCKETS; k++)
+				ptr += sprintf(ptr, "%s%"PRIu64, k ? "/" : "", h->buckets[k]);
+
+			root = NULL;
+			root = api_add_int(root, "LATENCY", &n, true);
+			root = api_add_int(root, "POOL", &i, false);
+			root = api_add_escape(root, "URL", pool->rpc_url, false);
+			root = api_add_const(root, "Stage", latency_names[j], false);
+			root = api_add_uint64(root, "Samples", &h->samples, false);
+			root = api_add_double(root, "Avg ms", &avg, true);
+			root = api_add_double(root, "P50 ms", &p50, true);
+			root = api_add_double(root, "P90 ms", &p90, true);
+			root = api_add_double(root, "P99 ms", &p99, true);
+			root = api_add_double(root, "Max ms", &max, true);
+			root = api_add_string(root, "Histogram", hist, true);
+
+			root = print_data(root, buf, isjson, isjson && (n > 0));
+			io_add(io_data, buf);
+			n++;
+		}
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+#ifdef HAVE_OPENCL
+static void gpuprofile(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	struct latency_hist prof[OCL_PROFILE_MAX];
+	struct api_data *root;
+	char buf[TMPBUFSIZ];
+	char hist[LATENCY_BUCKETS * 21];
+	bool io_open = false;
+	int id = -1, i, j, k, n = 0;
+
+	if (nDevs == 0) {
+		message(io_data, MSG_GPUNON, 0, NULL, isjson);
+		return;
+	}
+
+	if (!opt_opencl_profile) {
+		message(io_data, MSG_GPUPROFOFF, 0, NULL, isjson);
+		return;
+	}
+
+	if (param != NULL && *param != '\0') {
+		id = atoi(param);
+		if (id < 0 || id >= nDevs) {
+			message(io_data, MSG_INVGPU, id, NULL, isjson);
+			return;
+		}
+	}
+
+	message(io_data, MSG_GPUPROF, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_GPUPROFILE);
+
+	for (i = 0; i < mining_threads; i++) {
+		struct thr_info *thr = &thr_info[i];
+		struct cgpu_info *cgpu = thr->cgpu;
+
+		if (!cgpu || cgpu->api != &opencl_api)
+			continue;
+		if (id >= 0 && cgpu->device_id != id)
+			continue;
+
+		opencl_profile_get(thr->id, prof);
+
+		for (j = 0; j < OCL_PROFILE_MAX; j++) {
+			struct latency_hist *h = &prof[j];
+			double avg = h->samples ? h->total_us / 1000.0 / h->samples : 0;
+			double max = h->max_us / 1000.0;
+			double p50 = latency_pct(h, 50);
+			double p90 = latency_pct(h, 90);
+			double p99 = latency_pct(h, 99);
+			char *ptr = hist;
+
+			/* Bucket k counts samples under 2^(k+1) microseconds */
+			for (k = 0; k < LATENCY_BUCKETS; k++)
+				ptr += sprintf(ptr, "%s%"PRIu64, k ? "/" : "", h->buckets[k]);
+
+			root = NULL;
+			root = api_add_int(root, "PROFILE", &n, true);
+			root = api_add_int(root, "GPU", &cgpu->device_id, false);
+			root = api_add_int(root, "Thread", &thr->id, false);
+			root = api_add_const(root, "Phase", opencl_profile_names[j], false);
+			root = api_add_uint64(root, "Samples", &h->samples, false);
+			root = api_add_double(root, "Avg ms", &avg, true);
+			root = api_add_double(root, "P50 ms", &p50, true);
+			root = api_add_double(root, "P90 ms", &p90, true);
+			root = api_add_double(root, "P99 ms", &p99, true);
+			root = api_add_double(root, "Max ms", &max, true);
+			root = api_add_string(root, "Histogram", hist, true);
+
+			root = print_data(root, buf, isjson, isjson && (n > 0));
+			io_add(io_data, buf);
+			n++;
+		}
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+#endif
+
 static void failoveronly(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	if (param == NULL || *param == '\0') {
@@ -3187,6 +3356,7 @@ struct CMDS {
 	{ "gpuengine",		gpuengine,	true },
 	{ "gpufan",		gpufan,		true },
 	{ "gpuvddc",		gpuvddc,	true },
+	{ "gpuprofile",		gpuprofile,	false },
 #endif
 	{ "save",		dosave,		true },
 	{ "quit",		doquit,		true },
@@ -3204,6 +3374,7 @@ struct CMDS {
 	{ "pgaset",		pgaset,		true },
 #endif
 	{ "zero",		dozero,		true },
+	{ "latency",		latencystats,	false },
 	{ NULL,			NULL,		false }
 };
 
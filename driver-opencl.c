@@ -33,6 +33,8 @@
 #include <stdint.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #ifndef WIN32
 #include <sys/resource.h>
@@ -112,6 +114,9 @@ CL_API_ENTRY cl_mem CL_API_CALL
                void *       /* host_ptr */,
                cl_int *     /* errcode_ret */) CL_API_SUFFIX__VERSION_1_0;
 
+CL_API_ENTRY cl_int CL_API_CALL
+(*clReleaseMemObject)(cl_mem /* memobj */) CL_API_SUFFIX__VERSION_1_0;
+
 /* Program Object APIs  */
 CL_API_ENTRY cl_program CL_API_CALL
 (*clCreateProgramWithSource)(cl_context        /* context */,
@@ -170,7 +175,26 @@ CL_API_ENTRY cl_int CL_API_CALL
                size_t       /* arg_size */,
                const void * /* arg_value */) CL_API_SUFFIX__VERSION_1_0;
 
+/* Event Object APIs */
+CL_API_ENTRY cl_int CL_API_CALL
+(*clWaitForEvents)(cl_uint             /* num_events */,
+                const cl_event *    /* event_list */) CL_API_SUFFIX__VERSION_1_0;
+
+CL_API_ENTRY cl_int CL_API_CALL
+(*clReleaseEvent)(cl_event /* event */) CL_API_SUFFIX__VERSION_1_0;
+
+/* Profiling APIs */
+CL_API_ENTRY cl_int CL_API_CALL
+(*clGetEventProfilingInfo)(cl_event            /* event */,
+                        cl_profiling_info   /* param_name */,
+                        size_t              /* param_value_size */,
+                        void *              /* param_value */,
+                        size_t *            /* param_value_size_ret */) CL_API_SUFFIX__VERSION_1_0;
+
 /* Flush and Finish APIs */
+CL_API_ENTRY cl_int CL_API_CALL
+(*clFlush)(cl_command_queue /* command_queue */) CL_API_SUFFIX__VERSION_1_0;
+
 CL_API_ENTRY cl_int CL_API_CALL
 (*clFinish)(cl_command_queue /* command_queue */) CL_API_SUFFIX__VERSION_1_0;
 
@@ -197,6 +221,26 @@ CL_API_ENTRY cl_int CL_API_CALL
                      const cl_event *   /* event_wait_list */,
                      cl_event *         /* event */) CL_API_SUFFIX__VERSION_1_0;
 
+CL_API_ENTRY void * CL_API_CALL
+(*clEnqueueMapBuffer)(cl_command_queue /* command_queue */,
+                   cl_mem           /* buffer */,
+                   cl_bool          /* blocking_map */,
+                   cl_map_flags     /* map_flags */,
+                   size_t           /* offset */,
+                   size_t           /* size */,
+                   cl_uint          /* num_events_in_wait_list */,
+                   const cl_event * /* event_wait_list */,
+                   cl_event *       /* event */,
+                   cl_int *         /* errcode_ret */) CL_API_SUFFIX__VERSION_1_0;
+
+CL_API_ENTRY cl_int CL_API_CALL
+(*clEnqueueUnmapMemObject)(cl_command_queue /* command_queue */,
+                        cl_mem           /* memobj */,
+                        void *           /* mapped_ptr */,
+                        cl_uint          /* num_events_in_wait_list */,
+                        const cl_event * /* event_wait_list */,
+                        cl_event *       /* event */) CL_API_SUFFIX__VERSION_1_0;
+
 CL_API_ENTRY cl_int CL_API_CALL
 (*clEnqueueNDRangeKernel)(cl_command_queue /* command_queue */,
                        cl_kernel        /* kernel */,
@@ -245,6 +289,7 @@ load_opencl_symbols() {
 	LOAD_OCL_SYM(clCreateCommandQueue);
 	LOAD_OCL_SYM(clReleaseCommandQueue);
 	LOAD_OCL_SYM(clCreateBuffer);
+	LOAD_OCL_SYM(clReleaseMemObject);
 	LOAD_OCL_SYM(clCreateProgramWithSource);
 	LOAD_OCL_SYM(clCreateProgramWithBinary);
 	LOAD_OCL_SYM(clReleaseProgram);
@@ -254,9 +299,15 @@ load_opencl_symbols() {
 	LOAD_OCL_SYM(clCreateKernel);
 	LOAD_OCL_SYM(clReleaseKernel);
 	LOAD_OCL_SYM(clSetKernelArg);
+	LOAD_OCL_SYM(clWaitForEvents);
+	LOAD_OCL_SYM(clReleaseEvent);
+	LOAD_OCL_SYM(clGetEventProfilingInfo);
+	LOAD_OCL_SYM(clFlush);
 	LOAD_OCL_SYM(clFinish);
 	LOAD_OCL_SYM(clEnqueueReadBuffer);
 	LOAD_OCL_SYM(clEnqueueWriteBuffer);
+	LOAD_OCL_SYM(clEnqueueMapBuffer);
+	LOAD_OCL_SYM(clEnqueueUnmapMemObject);
 	LOAD_OCL_SYM(clEnqueueNDRangeKernel);
 	
 	return true;
@@ -789,8 +840,10 @@ char *set_intensity(char *arg) {
 #endif
     { }
 
-    if(!strncasecmp(nextptr, "d", 1)) {
+    gpus[device].intensity_set = true;
+    if(!strncasecmp(nextptr, "d", 1) || !strncasecmp(nextptr, "t", 1)) {
         gpus[device].dynamic = true;
+        gpus[device].dyn_throughput = !strncasecmp(nextptr, "t", 1);
     } else {
         gpus[device].dynamic = false;
         val = atoi(nextptr);
@@ -803,8 +856,10 @@ char *set_intensity(char *arg) {
     device++;
 
     while((nextptr = strtok(NULL, ",")) != NULL) {
-        if(!strncasecmp(nextptr, "d", 1)) {
+        gpus[device].intensity_set = true;
+        if(!strncasecmp(nextptr, "d", 1) || !strncasecmp(nextptr, "t", 1)) {
             gpus[device].dynamic = true;
+            gpus[device].dyn_throughput = !strncasecmp(nextptr, "t", 1);
         } else {
             gpus[device].dynamic = false;
             val = atoi(nextptr);
@@ -819,6 +874,8 @@ char *set_intensity(char *arg) {
     if(device == 1) {
         for(i = device; i < MAX_GPUDEVICES; i++) {
             gpus[i].dynamic = gpus[0].dynamic;
+            gpus[i].dyn_throughput = gpus[0].dyn_throughput;
+            gpus[i].intensity_set = true;
             gpus[i].intensity = gpus[0].intensity;
         }
     }
@@ -983,7 +1040,8 @@ retry:
 		wlog("Last initialised: %s\n", cgpu->init);
 		wlog("Intensity: ");
 		if (gpus[gpu].dynamic)
-			wlog("Dynamic (only one thread in use)\n");
+			wlog("Dynamic, %s (only one thread in use)\n",
+			     gpus[gpu].dyn_throughput ? "throughput" : "desktop");
 		else
 			wlog("%d\n", gpus[gpu].intensity);
 		for (i = 0; i < mining_threads; i++) {
@@ -1086,14 +1144,16 @@ retry:
 			goto retry;
 		}
 
-        intvar = curses_input("Set GPU scan intensity (d or fixed number)");
+        intvar = curses_input("Set GPU scan intensity (d, t or fixed number)");
 
 		if (!intvar) {
 			wlogprint("Invalid input\n");
 			goto retry;
 		}
-		if (!strncasecmp(intvar, "d", 1)) {
-			wlogprint("Dynamic mode enabled on gpu %d\n", selected);
+		if (!strncasecmp(intvar, "d", 1) || !strncasecmp(intvar, "t", 1)) {
+			gpus[selected].dyn_throughput = !strncasecmp(intvar, "t", 1);
+			wlogprint("Dynamic %s mode enabled on gpu %d\n",
+			          gpus[selected].dyn_throughput ? "throughput" : "desktop", selected);
 			gpus[selected].dynamic = true;
 			pause_dynamic_threads(selected);
 			free(intvar);
@@ -1393,6 +1453,29 @@ static cl_int queue_diablo_kernel(_clState *clState, dev_blk_ctx *blk, cl_uint t
 }
 #endif /* USE_SHA256D */
 
+#if defined(USE_NEOSCRYPT) || defined(USE_SCRYPT)
+/* The header and the kernel arguments derived from it only change with the
+ * work, so a batch on the same work as the last one just binds the output
+ * buffer of its pipeline slot (argument 1) and moves the nonce range */
+static bool header_current(_clState *clState, dev_blk_ctx *blk, cl_uint le_target) {
+
+    return(clState->hdr_valid && (clState->hdr_target == le_target) &&
+      !memcmp(clState->hdr, blk->work->data, 80));
+}
+
+/* Non-blocking. The source is the pipeline slot's private copy of the work,
+ * which isn't refreshed before the batch queued behind this write has been
+ * retired */
+static cl_int queue_header(_clState *clState, dev_blk_ctx *blk, cl_uint le_target) {
+
+    memcpy(clState->hdr, blk->work->data, 80);
+    clState->hdr_target = le_target;
+
+    return(clEnqueueWriteBuffer(clState->commandQueue, clState->CLbuffer0,
+      CL_FALSE, 0, 80, blk->work->data, 0, NULL, NULL));
+}
+#endif
+
 #ifdef USE_NEOSCRYPT
 static cl_int queue_neoscrypt_kernel(_clState *clState, dev_blk_ctx *blk,
   __maybe_unused cl_uint threads) {
@@ -1402,15 +1485,22 @@ static cl_int queue_neoscrypt_kernel(_clState *clState, dev_blk_ctx *blk,
     uint num = 0;
 
     le_target = (cl_uint)le32toh(((uint *) blk->work->target)[7]);
-    clState->cldata = blk->work->data;
-    status = clEnqueueWriteBuffer(clState->commandQueue, clState->CLbuffer0,
-      true, 0, 80, clState->cldata, 0, NULL, NULL);
+
+    if(header_current(clState, blk, le_target)) {
+        num = 1;
+        CL_SET_ARG(clState->outputBuffer);
+        return(status);
+    }
+
+    status = queue_header(clState, blk, le_target);
 
     CL_SET_ARG(clState->CLbuffer0);
     CL_SET_ARG(clState->outputBuffer);
     CL_SET_ARG(clState->padbuffer8);
     CL_SET_ARG(le_target);
 
+    clState->hdr_valid = (status == CL_SUCCESS);
+
     return(status);
 }
 #endif
@@ -1425,8 +1515,14 @@ static cl_int queue_scrypt_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
 	cl_int status = 0;
 
 	le_target = *(cl_uint *)(blk->work->target + 28);
-	clState->cldata = blk->work->data;
-	status = clEnqueueWriteBuffer(clState->commandQueue, clState->CLbuffer0, true, 0, 80, clState->cldata, 0, NULL,NULL);
+
+	if (header_current(clState, blk, le_target)) {
+		num = 1;
+		CL_SET_ARG(clState->outputBuffer);
+		return status;
+	}
+
+	status = queue_header(clState, blk, le_target);
 
 	CL_SET_ARG(clState->CLbuffer0);
 	CL_SET_ARG(clState->outputBuffer);
@@ -1435,6 +1531,8 @@ static cl_int queue_scrypt_kernel(_clState *clState, dev_blk_ctx *blk, __maybe_u
 	CL_SET_VARG(4, &midstate[16]);
 	CL_SET_ARG(le_target);
 
+	clState->hdr_valid = (status == CL_SUCCESS);
+
 	return status;
 }
 #endif
@@ -1566,8 +1664,101 @@ void *reinit_gpu(__maybe_unused void *userdata)
 #ifdef HAVE_OPENCL
 struct device_api opencl_api;
 
+/* Event profiling.
+ *
+ * With --gpu-profile the command queues are created with profiling enabled
+ * and each batch's kernel carries an event alongside the one on its result
+ * read. When the batch is retired, the device timestamps of both are split
+ * into the phases of enum opencl_profile_phase and added to log2 histograms
+ * kept per mining thread, which the API reports with gpuprofile and, summed
+ * over each GPU's threads, in stats */
+
+const char *opencl_profile_names[OCL_PROFILE_MAX] = {
+	"Queued to Submit",
+	"Submit to Start",
+	"Kernel",
+	"Read",
+	"Device Idle",
+};
+
+/* api_data doesn't copy names, so the stats keys have to be static */
+static char *profile_stat_names[OCL_PROFILE_MAX][2] = {
+	{ "Queued to Submit Avg ms", "Queued to Submit P99 ms" },
+	{ "Submit to Start Avg ms", "Submit to Start P99 ms" },
+	{ "Kernel Avg ms", "Kernel P99 ms" },
+	{ "Read Avg ms", "Read P99 ms" },
+	{ "Device Idle Avg ms", "Device Idle P99 ms" },
+};
+
+struct opencl_profile {
+	struct latency_hist hist[OCL_PROFILE_MAX];
+	/* Device time, in ns, the thread's previous kernel ended */
+	cl_ulong last_end;
+};
+
+/* Indexed by thread id like clStates */
+static struct opencl_profile profiles[MAX_GPUDEVICES];
+static pthread_mutex_t profile_lock;
+
+#define PROFILE_US(from, to) ((to) > (from) ? ((to) - (from)) / 1000 : 0)
+
+void opencl_profile_get(int thr_id, struct latency_hist *hist)
+{
+    mutex_lock(&profile_lock);
+    memcpy(hist, profiles[thr_id].hist, sizeof(profiles[thr_id].hist));
+    mutex_unlock(&profile_lock);
+}
+
+/* Cleared along with the other statistics; profile_lock only exists once a
+ * GPU has been set up */
+void opencl_profile_zero(void)
+{
+    if (!have_opencl)
+        return;
+
+    mutex_lock(&profile_lock);
+    memset(profiles, 0, sizeof(profiles));
+    mutex_unlock(&profile_lock);
+}
+
+static struct api_data *get_opencl_api_stats(struct cgpu_info *gpu)
+{
+    struct latency_hist hist[OCL_PROFILE_MAX], sum[OCL_PROFILE_MAX];
+    struct api_data *root = NULL;
+    int i, j, k;
+
+    if(!opt_opencl_profile)
+      return(NULL);
+
+    memset(sum, 0, sizeof(sum));
+    for(i = 0; i < gpu->threads; i++) {
+        opencl_profile_get(gpu->thr[i]->id, hist);
+        for(j = 0; j < OCL_PROFILE_MAX; j++) {
+            sum[j].samples += hist[j].samples;
+            sum[j].total_us += hist[j].total_us;
+            if(hist[j].max_us > sum[j].max_us)
+              sum[j].max_us = hist[j].max_us;
+            for(k = 0; k < LATENCY_BUCKETS; k++)
+              sum[j].buckets[k] += hist[j].buckets[k];
+        }
+    }
+
+    root = api_add_uint64(root, "Profile Samples", &sum[OCL_PROFILE_KERNEL].samples, true);
+    for(j = 0; j < OCL_PROFILE_MAX; j++) {
+        double avg = sum[j].samples ? sum[j].total_us / 1000.0 / sum[j].samples : 0;
+        double p99 = latency_pct(&sum[j], 99);
+
+        root = api_add_double(root, profile_stat_names[j][0], &avg, true);
+        root = api_add_double(root, profile_stat_names[j][1], &p99, true);
+    }
+
+    return(root);
+}
+
 static void opencl_detect()
 {
+	mutex_init(&profile_lock);
+
 #ifndef WIN32
 	if (!getenv("DISPLAY")) {
 		applog(LOG_DEBUG, "DISPLAY not set, setting :0 just in case");
@@ -1692,7 +1883,7 @@ get_opencl_api_extra_device_status(struct cgpu_info *gpu)
 
 	char intensity[20];
 	if (gpu->dynamic)
-		strcpy(intensity, "D");
+		strcpy(intensity, gpu->dyn_throughput ? "T" : "D");
 	else
 		sprintf(intensity, "%d", gpu->intensity);
 	root = api_add_string(root, "Intensity", intensity, true);
@@ -1700,11 +1891,476 @@ get_opencl_api_extra_device_status(struct cgpu_info *gpu)
 	return root;
 }
 
-struct opencl_thread_data {
-	cl_int (*queue_kernel_parameters)(_clState *, dev_blk_ctx *, cl_uint);
+/* One batch of kernel work in flight. The work is a private copy so that
+ * the header buffer source and the results stay valid after the miner
+ * thread has moved on to other work */
+struct opencl_slot {
+	/* The output buffer, mapped for the host once the kernel is done */
 	uint32_t *res;
+	cl_event ev;
+	/* Kernel event, only with --gpu-profile */
+	cl_event kev;
+	bool pending;
+	struct work work;
+	uint threads;
+	struct timeval tv_queued;
+};
+
+typedef cl_int (*queue_kernel_fn)(_clState *, dev_blk_ctx *, cl_uint);
+
+static queue_kernel_fn queue_kernel_for(enum cl_kernels kernel) {
+
+    switch(kernel) {
+#ifdef USE_NEOSCRYPT
+        case(KL_NEOSCRYPT):
+        case(KL_NEOSCRYPT_VLIW):
+        case(KL_NEOSCRYPT_VLIWP):
+            return(&queue_neoscrypt_kernel);
+#endif
+#ifdef USE_SCRYPT
+        case(KL_SCRYPT):
+            return(&queue_scrypt_kernel);
+#endif
+#ifdef USE_SHA256D
+        case(KL_DIABLO):
+            return(&queue_diablo_kernel);
+        case(KL_DIAKGCN):
+            return(&queue_diakgcn_kernel);
+        case(KL_PHATK):
+            return(&queue_phatk_kernel);
+        case(KL_POCLBM):
+            return(&queue_poclbm_kernel);
+#endif
+        default:
+        case(KL_VOID):
+            return(&queue_void_kernel);
+    }
+}
+
+struct opencl_thread_data {
+	queue_kernel_fn queue_kernel_parameters;
+	struct opencl_slot slots[OCL_PIPELINE_DEPTH];
+	uint cur;
+	/* When the last retired batch was seen to complete */
+	struct timeval tv_done;
+};
+
+/* Autotuning.
+ *
+ * With --autotune, the first thread of each GPU benchmarks a fixed work item
+ * over the candidate work sizes, intensities and, for scrypt, thread
+ * concurrencies and lookup gaps, before it initialises for real. Anything
+ * given on the command line is held fixed. The fastest combination whose
+ * kernel latency stays under AUTOTUNE_MAX_LATENCY_MS wins and is saved in
+ * ~/.nsgminer/autotune.json under a key naming the algorithm, kernel and
+ * device (see clDeviceIdent()); later starts without --autotune pick it up
+ * from there for settings the user hasn't given. */
+
+bool opt_autotune;
+
+#define AUTOTUNE_SAMPLE_US 500000
+#define AUTOTUNE_MAX_RUNS 64
+#define AUTOTUNE_MAX_LATENCY_MS 1000.0
+
+struct autotune_result {
+	int worksize;
+	int intensity;
+	int tc;
+	int lg;
+	double rate;
+	double latency;
+};
+
+static bool autotuned[MAX_GPUDEVICES];
+
+static const char *autotune_algo(void)
+{
+	if (opt_neoscrypt)
+		return "neoscrypt";
+	if (opt_scrypt)
+		return "scrypt";
+	return "sha256d";
+}
+
+static bool autotune_key(struct cgpu_info *cgpu, char *buf, size_t bufsz)
+{
+	char ident[512];
+
+	if (!clDeviceIdent(cgpu->virtual_gpu, ident, sizeof(ident)))
+		return false;
+	snprintf(buf, bufsz, "%s/%d/%s", autotune_algo(), (int)cgpu->kernel, ident);
+	return true;
+}
+
+static void autotune_file(char *path)
+{
+#if defined(unix) || defined(__APPLE__)
+	if (getenv("HOME") && *getenv("HOME")) {
+		strcpy(path, getenv("HOME"));
+		strcat(path, "/");
+	} else
+		strcpy(path, "");
+	strcat(path, ".nsgminer/");
+	mkdir(path, 0777);
+#else
+	strcpy(path, "");
+#endif
+	strcat(path, "autotune.json");
+}
+
+static json_t *autotune_load(void)
+{
+	char path[PATH_MAX];
+	json_error_t err;
+	json_t *root;
+
+	autotune_file(path);
+#if JANSSON_MAJOR_VERSION > 1
+	root = json_load_file(path, 0, &err);
+#else
+	root = json_load_file(path, &err);
+#endif
+	if (root && !json_is_object(root)) {
+		applog(LOG_WARNING, "Ignoring malformed %s", path);
+		json_decref(root);
+		root = NULL;
+	}
+	return root;
+}
+
+/* Devices are tuned concurrently, and each save rewrites the whole file */
+static pthread_mutex_t autotune_lock;
+
+static void autotune_save(const char *key, const struct autotune_result *res)
+{
+	char path[PATH_MAX], tmppath[PATH_MAX + 16];
+	json_t *root;
+
+	mutex_lock(&autotune_lock);
+	root = autotune_load();
+	if (!root)
+		root = json_object();
+	json_object_set_new(root, key, json_pack("{s:i,s:i,s:i,s:i,s:f,s:f}",
+		"worksize", res->worksize,
+		"intensity", res->intensity,
+		"thread-concurrency", res->tc,
+		"lookup-gap", res->lg,
+		"hashrate", res->rate,
+		"latency-ms", res->latency));
+
+	autotune_file(path);
+	snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, (int)getpid());
+	if (json_dump_file(root, tmppath, JSON_INDENT(2)) || rename(tmppath, path)) {
+		applog(LOG_WARNING, "Unable to save autotune results to %s", path);
+		unlink(tmppath);
+	}
+	mutex_unlock(&autotune_lock);
+	json_decref(root);
+}
+
+/* Applies saved results for settings not given on the command line */
+static void autotune_apply(struct cgpu_info *cgpu, const char *key)
+{
+	json_t *root = autotune_load(), *entry, *val;
+
+	if (!root)
+		return;
+	entry = json_object_get(root, key);
+	if (!json_is_object(entry))
+		goto out;
+
+	if (!cgpu->work_size && json_is_integer(val = json_object_get(entry, "worksize")))
+		cgpu->work_size = json_integer_value(val);
+	if (!cgpu->intensity_set &&
+	    json_is_integer(val = json_object_get(entry, "intensity"))) {
+		cgpu->dynamic = false;
+		cgpu->intensity = json_integer_value(val);
+	}
+#ifdef USE_SCRYPT
+	if (opt_scrypt) {
+		if (!cgpu->opt_tc && json_is_integer(val = json_object_get(entry, "thread-concurrency")))
+			cgpu->opt_tc = json_integer_value(val);
+		if (!cgpu->opt_lg && json_is_integer(val = json_object_get(entry, "lookup-gap")))
+			cgpu->opt_lg = json_integer_value(val);
+	}
+#endif
+	applog(LOG_INFO, "GPU %d: using autotuned worksize %d intensity %s%d",
+	       cgpu->device_id, (int)cgpu->work_size, cgpu->dynamic ? "d/" : "",
+	       cgpu->intensity);
+out:
+	json_decref(root);
+}
+
+/* Runs the kernel back to back on a fixed work item for about
+ * AUTOTUNE_SAMPLE_US and reports hashes per second and time per launch */
+static bool autotune_bench(_clState *clState, queue_kernel_fn queue,
+			   struct work *work, int intensity,
+			   double *rate, double *latency)
+{
+	size_t globalThreads[1], localThreads[1] = { clState->wsize };
+	size_t offset[1] = { 0 };
+	struct timeval tv_start, tv_end;
+	uint threads;
+	cl_int status;
+	double us = 0;
+	int runs = -1;
+
+	threads = 1U << (((opt_neoscrypt || opt_scrypt) ? 0 : 15) + intensity);
+	if (threads < clState->wsize)
+		threads = clState->wsize;
+	globalThreads[0] = threads;
+
+	clState->outputBuffer = clState->outputBuffers[0];
+	if (queue(clState, &work->blk, threads) != CL_SUCCESS)
+		return false;
+
+	/* The first launch is a warm-up and isn't counted */
+	do {
+		if (!runs)
+			gettimeofday(&tv_start, NULL);
+		status = clEnqueueNDRangeKernel(clState->commandQueue, clState->kernel, 1,
+						clState->goffset ? offset : NULL,
+						globalThreads, localThreads, 0, NULL, NULL);
+		if (status == CL_SUCCESS)
+			status = clFinish(clState->commandQueue);
+		if (status != CL_SUCCESS) {
+			applog(LOG_DEBUG, "Error %d benchmarking intensity %d", status, intensity);
+			return false;
+		}
+		if (++runs) {
+			gettimeofday(&tv_end, NULL);
+			us = us_tdiff(&tv_end, &tv_start);
+		}
+	} while (runs < 1 || (us < AUTOTUNE_SAMPLE_US && runs < AUTOTUNE_MAX_RUNS));
+
+	if (us <= 0)
+		us = 1;
+	*latency = us / runs / 1000;
+	*rate = (double)threads * clState->vwidth * runs * 1000000 / us;
+	return true;
+}
+
+static void opencl_autotune(struct cgpu_info *cgpu, const char *key)
+{
+	static const int worksizes[] = { 32, 64, 128, 256 };
+	const int gpu = cgpu->device_id;
+	const int saved_ws = cgpu->work_size, saved_int = cgpu->intensity;
+	const bool saved_dynamic = cgpu->dynamic;
+	int min_intensity = 0, max_intensity = 0;
+	int nws, w, l, q, in, lgs[3] = { 0 }, nlg = 1;
+	struct autotune_result best = { .rate = 0 }, cur;
+	struct work work;
+	char name[256];
+	_clState *clState;
+	queue_kernel_fn queue;
+#ifdef USE_SCRYPT
+	const int saved_tc = cgpu->opt_tc, saved_lg = cgpu->opt_lg;
+	int auto_tc = 0;
+#endif
+
+	memset(&work, 0, sizeof(work));
+	for (w = 0; w < 80; w++)
+		work.data[w] = w;
+	work.blk.work = &work;
+#ifdef USE_SHA256D
+	if (opt_sha256d)
+		precalc_hash(&work.blk, (uint32_t *)work.midstate, (uint32_t *)(work.data + 64));
+#endif
+
+#ifdef USE_NEOSCRYPT
+	if (opt_neoscrypt)
+		min_intensity = MIN_NEOSCRYPT_INTENSITY;
+	else
+#endif
+#ifdef USE_SCRYPT
+	if (opt_scrypt) {
+		min_intensity = MIN_SCRYPT_INTENSITY;
+		max_intensity = MAX_SCRYPT_INTENSITY;
+		if (saved_lg)
+			lgs[0] = saved_lg;
+		else {
+			lgs[0] = 1;
+			lgs[1] = 2;
+			lgs[2] = 4;
+			nlg = 3;
+		}
+	} else
+#endif
+#ifdef USE_SHA256D
+	if (opt_sha256d) {
+		min_intensity = MIN_SHA256D_INTENSITY;
+		max_intensity = MAX_SHA256D_INTENSITY;
+	} else
+#endif
+	{ }
+
+	if (!saved_dynamic)
+		min_intensity = max_intensity = saved_int;
+	nws = saved_ws ? 1 : (int)(sizeof(worksizes) / sizeof(worksizes[0]));
+
+	applog(LOG_WARNING, "GPU %d: autotuning, this takes a while", gpu);
+
+	for (w = 0; w < nws; w++)
+	for (l = 0; l < nlg; l++)
+	for (q = 4; q >= 2; q--) {
+		cur.worksize = saved_ws ? saved_ws : worksizes[w];
+		cur.lg = lgs[l];
+		cur.tc = 0;
+		cgpu->work_size = cur.worksize;
+		/* Dynamic makes initCl size buffers for the highest intensity */
+		cgpu->dynamic = true;
+#ifdef USE_SCRYPT
+		if (opt_scrypt) {
+			cgpu->opt_lg = cur.lg;
+			/* Full, 3/4 and 1/2 of the concurrency the memory allows */
+			if (q == 4) {
+				cgpu->opt_tc = saved_tc;
+				auto_tc = 0;
+			} else if (saved_tc || !auto_tc)
+				break;
+			else {
+				cgpu->opt_tc = auto_tc * q / 4;
+				cgpu->opt_tc -= cgpu->opt_tc % cur.worksize;
+			}
+		} else
+#endif
+		if (q != 4)
+			break;
+
+		clState = initCl(cgpu->virtual_gpu, name, sizeof(name));
+		if (!clState)
+			continue;
+		if ((int)clState->wsize != cur.worksize) {
+			/* Clamped to another candidate or the device maximum */
+			freeCl(clState);
+			continue;
+		}
+#ifdef USE_SCRYPT
+		if (opt_scrypt) {
+			cur.tc = cgpu->thread_concurrency;
+			if (q == 4)
+				auto_tc = cur.tc;
+		}
+#endif
+		queue = queue_kernel_for(clState->chosen_kernel);
+		if (opt_neoscrypt && saved_dynamic)
+			max_intensity = cgpu->max_intensity;
+
+		for (in = min_intensity; in <= max_intensity; in++) {
+			if (!autotune_bench(clState, queue, &work, in, &cur.rate, &cur.latency))
+				break;
+			cur.intensity = in;
+			applog(LOG_INFO, "GPU %d: worksize %d intensity %d tc %d lg %d: %.1f kH/s, %.1f ms",
+			       gpu, cur.worksize, in, cur.tc, cur.lg, cur.rate / 1000, cur.latency);
+			if (cur.latency > AUTOTUNE_MAX_LATENCY_MS)
+				break;
+			if (cur.rate > best.rate)
+				best = cur;
+		}
+		freeCl(clState);
+	}
+
+	cgpu->work_size = saved_ws;
+	cgpu->dynamic = saved_dynamic;
+	cgpu->intensity = saved_int;
+#ifdef USE_SCRYPT
+	cgpu->opt_tc = saved_tc;
+	cgpu->opt_lg = saved_lg;
+#endif
+
+	if (!best.rate) {
+		applog(LOG_WARNING, "GPU %d: autotune found no working settings, using defaults", gpu);
+		return;
+	}
+
+	if (opt_scrypt)
+		applog(LOG_WARNING, "GPU %d: autotuned worksize %d intensity %d thread concurrency %d lookup gap %d: %.1f kH/s, %.1f ms per launch",
+		       gpu, best.worksize, best.intensity, best.tc, best.lg,
+		       best.rate / 1000, best.latency);
+	else
+		applog(LOG_WARNING, "GPU %d: autotuned worksize %d intensity %d: %.1f kH/s, %.1f ms per launch",
+		       gpu, best.worksize, best.intensity, best.rate / 1000, best.latency);
+	autotune_save(key, &best);
+}
+
+/* Concurrent initialisation.
+ *
+ * A cold kernel build takes tens of seconds per device, so once the devices
+ * are known opencl_start_init() tunes each one and sets up the OpenCL state
+ * of all its threads on a thread of its own, while the miner goes on to
+ * probe the pools. opencl_thread_prepare() then collects the result. The
+ * devices build in parallel, except that identical ones wait for the first
+ * of them and share its binary (see kernel_binary_claim()) */
+
+struct opencl_init {
+	pthread_t pth;
+	bool started;
+	_clState **states;
+	char name[256];
 };
 
+static struct opencl_init gpu_inits[MAX_GPUDEVICES];
+
+static void opencl_init_device(struct cgpu_info *cgpu, struct opencl_init *init)
+{
+	const int gpu = cgpu->device_id;
+	char key[768];
+	int j;
+
+	/* Tuning is per device, so it is done once before any thread's setup */
+	if (!autotuned[gpu]) {
+		autotuned[gpu] = true;
+		if (autotune_key(cgpu, key, sizeof(key))) {
+			if (opt_autotune)
+				opencl_autotune(cgpu, key);
+			autotune_apply(cgpu, key);
+		}
+	}
+
+	for (j = 0; j < cgpu->threads; j++) {
+		applog(LOG_INFO, "Init GPU %i virtual GPU %i thread %i", gpu, cgpu->virtual_gpu, j);
+		init->states[j] = initCl(cgpu->virtual_gpu, init->name, sizeof(init->name));
+		if (!init->states[j])
+			break;
+	}
+}
+
+static void *opencl_init_thread(void *userdata)
+{
+	struct cgpu_info *cgpu = userdata;
+
+	RenameThread("gpu_init");
+	opencl_init_device(cgpu, &gpu_inits[cgpu->device_id]);
+
+	return NULL;
+}
+
+void opencl_start_init(void)
+{
+	int i;
+
+	mutex_init(&autotune_lock);
+
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = devices[i];
+		struct opencl_init *init;
+
+		if (cgpu->api != &opencl_api)
+			continue;
+
+		init = &gpu_inits[cgpu->device_id];
+		init->states = calloc(cgpu->threads, sizeof(*init->states));
+		if (unlikely(!init->states))
+			quit(1, "Failed to calloc in opencl_start_init");
+		if (unlikely(pthread_create(&init->pth, NULL, opencl_init_thread, cgpu))) {
+			applog(LOG_WARNING, "Failed to start GPU %d init thread, initialising it later",
+			       cgpu->device_id);
+			continue;
+		}
+		init->started = true;
+	}
+}
+
 static uint32_t *blank_res;
 
 static bool opencl_thread_prepare(struct thr_info *thr)
@@ -1712,8 +2368,8 @@ static bool opencl_thread_prepare(struct thr_info *thr)
 	char name[256];
 	struct timeval now;
 	struct cgpu_info *cgpu = thr->cgpu;
+	struct opencl_init *init = &gpu_inits[cgpu->device_id];
 	int gpu = cgpu->device_id;
-	int virtual_gpu = cgpu->virtual_gpu;
 	int i = thr->id;
 	static bool failmessage = false;
 
@@ -1725,9 +2381,23 @@ static bool opencl_thread_prepare(struct thr_info *thr)
         return(false);
     }
 
-	strcpy(name, "");
-	applog(LOG_INFO, "Init GPU thread %i GPU %i virtual GPU %i", i, gpu, virtual_gpu);
-	clStates[i] = initCl(virtual_gpu, name, sizeof(name));
+    postcalc_init();
+
+	/* The device is set up for all its threads at once, on the first */
+	if (cgpu->thr[0] == thr) {
+		if (init->started) {
+			pthread_join(init->pth, NULL);
+			init->started = false;
+		} else
+			opencl_init_device(cgpu, init);
+	}
+
+	strcpy(name, init->name);
+	clStates[i] = init->states[thr->device_thread];
+	if (thr->device_thread == cgpu->threads - 1) {
+		free(init->states);
+		init->states = NULL;
+	}
 	if (!clStates[i]) {
 #ifdef HAVE_CURSES
 		if (use_curses)
@@ -1810,6 +2480,7 @@ static bool opencl_thread_init(struct thr_info *thr)
 	struct opencl_thread_data *thrdata;
 	_clState *clState = clStates[thr_id];
 	cl_int status = 0;
+	int i;
 	thrdata = calloc(1, sizeof(*thrdata));
 	thr->cgpu_data = thrdata;
 
@@ -1818,48 +2489,11 @@ static bool opencl_thread_init(struct thr_info *thr)
 		return false;
 	}
 
-    switch(clState->chosen_kernel) {
-#ifdef USE_NEOSCRYPT
-        case(KL_NEOSCRYPT):
-        case(KL_NEOSCRYPT_VLIW):
-        case(KL_NEOSCRYPT_VLIWP):
-            thrdata->queue_kernel_parameters = &queue_neoscrypt_kernel;
-            break;
-#endif
-#ifdef USE_SCRYPT
-        case(KL_SCRYPT):
-            thrdata->queue_kernel_parameters = &queue_scrypt_kernel;
-            break;
-#endif
-#ifdef USE_SHA256D
-        case(KL_DIABLO):
-            thrdata->queue_kernel_parameters = &queue_diablo_kernel;
-            break;
-        case(KL_DIAKGCN):
-            thrdata->queue_kernel_parameters = &queue_diakgcn_kernel;
-            break;
-        case(KL_PHATK):
-            thrdata->queue_kernel_parameters = &queue_phatk_kernel;
-            break;
-        case(KL_POCLBM):
-            thrdata->queue_kernel_parameters = &queue_poclbm_kernel;
-            break;
-#endif
-        default:
-        case(KL_VOID):
-            thrdata->queue_kernel_parameters = &queue_void_kernel;
-    }
-
-    thrdata->res = calloc(BUFFERSIZE, 1);
+    thrdata->queue_kernel_parameters = queue_kernel_for(clState->chosen_kernel);
 
-    if(!thrdata->res) {
-        applog(LOG_ERR, "Allocation failed in opencl_thread_init()");
-        free(thrdata);
-	return(false);
-    }
-
-    status |= clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer,
-      CL_TRUE, 0, BUFFERSIZE, blank_res, 0, NULL, NULL);
+    for(i = 0; i < OCL_PIPELINE_DEPTH; i++)
+      status |= clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffers[i],
+        CL_TRUE, 0, BUFFERSIZE, blank_res, 0, NULL, NULL);
 
     if(status != CL_SUCCESS) {
         applog(LOG_ERR, "Error %d in clEnqueueWriteBuffer()", status);
@@ -1890,20 +2524,169 @@ static bool opencl_prepare_work(struct thr_info __maybe_unused *thr, struct work
 }
 
 extern int opt_dynamic_interval;
+extern int opt_throughput_interval;
+
+/* Dynamic intensity steers a linear global work size rather than the power
+ * of two intensity. Every DYN_SAMPLE_US of kernel time it takes the measured
+ * hash rate, works out the work size that would take exactly the target
+ * time (opt_dynamic_interval for desktop use, opt_throughput_interval for
+ * throughput) and moves part of the way there. Windows timer resolution is
+ * only 15.6ms, hence sampling over several kernels when the target is short */
+#define DYN_SAMPLE_US 78000
+#define DYN_SMOOTHING 0.5
+#define DYN_MAX_GROWTH 4.0
+
+static void opencl_dynamic_update(struct cgpu_info *gpu, uint threads, double kernel_us)
+{
+    const double target_us = 1000.0 * (gpu->dyn_throughput ?
+      opt_throughput_interval : opt_dynamic_interval);
+    double want;
+
+    gpu->dyn_sum_us += kernel_us;
+    gpu->dyn_sum_threads += threads;
+    if(gpu->dyn_sum_us < DYN_SAMPLE_US)
+      return;
+
+    want = gpu->dyn_sum_threads / gpu->dyn_sum_us * target_us;
+    /* Small batches understate what the device can do, so don't trust
+     * a single sample to grow the work size too far at once */
+    if(want > gpu->dyn_threads * DYN_MAX_GROWTH)
+      want = gpu->dyn_threads * DYN_MAX_GROWTH;
+    gpu->dyn_threads += (want - gpu->dyn_threads) * DYN_SMOOTHING;
+
+    gpu->dyn_sum_us = 0;
+    gpu->dyn_sum_threads = 0;
+}
+
+/* Adds the timestamps of a finished batch's events, in device nanoseconds,
+ * to its thread's profile */
+static void opencl_profile_slot(struct thr_info *thr, struct opencl_slot *slot)
+{
+    struct opencl_profile *prof = &profiles[thr->id];
+    cl_ulong queued, submit, start, end, rstart, rend;
+    cl_int status;
+
+    status = clGetEventProfilingInfo(slot->kev, CL_PROFILING_COMMAND_QUEUED,
+      sizeof(cl_ulong), &queued, NULL);
+    status |= clGetEventProfilingInfo(slot->kev, CL_PROFILING_COMMAND_SUBMIT,
+      sizeof(cl_ulong), &submit, NULL);
+    status |= clGetEventProfilingInfo(slot->kev, CL_PROFILING_COMMAND_START,
+      sizeof(cl_ulong), &start, NULL);
+    status |= clGetEventProfilingInfo(slot->kev, CL_PROFILING_COMMAND_END,
+      sizeof(cl_ulong), &end, NULL);
+    status |= clGetEventProfilingInfo(slot->ev, CL_PROFILING_COMMAND_START,
+      sizeof(cl_ulong), &rstart, NULL);
+    status |= clGetEventProfilingInfo(slot->ev, CL_PROFILING_COMMAND_END,
+      sizeof(cl_ulong), &rend, NULL);
+
+    if(status != CL_SUCCESS) {
+        applog(LOG_DEBUG, "Error %d in clGetEventProfilingInfo()", status);
+        return;
+    }
+
+    mutex_lock(&profile_lock);
+    latency_add_us(&prof->hist[OCL_PROFILE_QUEUED], PROFILE_US(queued, submit));
+    latency_add_us(&prof->hist[OCL_PROFILE_SUBMIT], PROFILE_US(submit, start));
+    latency_add_us(&prof->hist[OCL_PROFILE_KERNEL], PROFILE_US(start, end));
+    latency_add_us(&prof->hist[OCL_PROFILE_READ], PROFILE_US(rstart, rend));
+    if(prof->last_end)
+      latency_add_us(&prof->hist[OCL_PROFILE_IDLE], PROFILE_US(prof->last_end, start));
+    prof->last_end = end;
+    mutex_unlock(&profile_lock);
+}
+
+/* Waits for the batch in a pipeline slot to finish and hands anything it
+ * found over for verification.
+ *
+ * The kernels store each nonce they find at the index given by the FOUND
+ * entry and increment it, so that entry is all the host has to look at.
+ * The output buffers live in host memory (CL_MEM_ALLOC_HOST_PTR), where
+ * mapping them costs no copy, and the results are only copied out, and
+ * FOUND reset, when there is something there. The buffer can't stay mapped
+ * while kernels write to it, so it is unmapped again before the slot is
+ * reused */
+static bool opencl_retire_slot(struct thr_info *thr, struct opencl_slot *slot,
+  cl_mem output) {
+    _clState *clState = clStates[thr->id];
+    cl_int status;
+
+    struct opencl_thread_data *thrdata = thr->cgpu_data;
+    struct timeval now, *tv_start;
+    uint32_t found;
+
+    status = clWaitForEvents(1, &slot->ev);
+    if((status == CL_SUCCESS) && slot->kev)
+      opencl_profile_slot(thr, slot);
+    if(slot->kev) {
+        clReleaseEvent(slot->kev);
+        slot->kev = NULL;
+    }
+    clReleaseEvent(slot->ev);
+    slot->pending = false;
+
+    if(status != CL_SUCCESS) {
+        applog(LOG_ERR, "Error %d in clWaitForEvents()", status);
+        /* Don't leave the buffer mapped behind the failed batch */
+        clEnqueueUnmapMemObject(clState->commandQueue, output, slot->res,
+          0, NULL, NULL);
+        slot->res = NULL;
+        return(false);
+    }
+
+    /* The batch started when it was queued or when the one before it
+     * finished, whichever was later */
+    gettimeofday(&now, NULL);
+    tv_start = timercmp(&slot->tv_queued, &thrdata->tv_done, >) ?
+      &slot->tv_queued : &thrdata->tv_done;
+    if(thr->cgpu->dynamic)
+      opencl_dynamic_update(thr->cgpu, slot->threads, us_tdiff(&now, tv_start));
+    thrdata->tv_done = now;
+
+    found = slot->res[FOUND];
+    if(found) {
+        applog(LOG_DEBUG, "GPU%d found something?", thr->cgpu->device_id);
+        postcalc_hash_async(thr, &slot->work, slot->res);
+    }
+
+    status = clEnqueueUnmapMemObject(clState->commandQueue, output, slot->res,
+      0, NULL, NULL);
+    slot->res = NULL;
+
+    if(status != CL_SUCCESS) {
+        applog(LOG_ERR, "Error %d in clEnqueueUnmapMemObject()", status);
+        return(false);
+    }
+
+    /* Entries past FOUND are never looked at, so resetting the counter is
+     * enough. The queue is in order, so this completes before the next
+     * batch that uses the buffer */
+    if(found) {
+        status = clEnqueueWriteBuffer(clState->commandQueue, output, CL_FALSE,
+          FOUND * sizeof(uint32_t), sizeof(uint32_t), &blank_res[FOUND], 0, NULL, NULL);
+
+        if(status != CL_SUCCESS) {
+            applog(LOG_ERR, "Error %d in clEnqueueWriteBuffer()", status);
+            return(false);
+        }
+    }
+
+    return(true);
+}
 
 static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 				int64_t __maybe_unused max_nonce)
 {
 	const int thr_id = thr->id;
 	struct opencl_thread_data *thrdata = thr->cgpu_data;
+	struct opencl_slot *slot;
 	struct cgpu_info *gpu = thr->cgpu;
 	_clState *clState = clStates[thr_id];
 	const cl_kernel *kernel = &clState->kernel;
-	const int dynamic_us = opt_dynamic_interval * 1000;
 
 	cl_int status;
 	size_t globalThreads[1];
 	size_t localThreads[1] = { clState->wsize };
+	cl_event *kev = NULL;
 	int64_t hashes;
 
     int min_intensity = -127, max_intensity = 127;
@@ -1928,35 +2711,41 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 #endif
     { }
 
-    /* Windows timer resolution is only 15.6ms, so oversample 5x */
-    if(gpu->dynamic && (++gpu->intervals * dynamic_us) > 78000) {
-        struct timeval tv_gpuend;
-        double gpu_us;
+    const int shift = (opt_neoscrypt || opt_scrypt) ? 0 : 15;
+    uint threads = 0;
 
-        gettimeofday(&tv_gpuend, NULL);
-        gpu_us = us_tdiff(&tv_gpuend, &gpu->tv_gpustart) / gpu->intervals;
+    if(gpu->dynamic) {
+        const double min_threads = localThreads[0];
+        const double max_threads = (double)(1ULL << (shift +
+          (opt_neoscrypt ? (int)gpu->max_intensity : max_intensity)));
 
-        if(gpu_us > dynamic_us) {
-            if(gpu->intensity > min_intensity)
-              --gpu->intensity;
-        } else {
-            if(gpu_us < dynamic_us / 2) {
-                if(gpu->intensity < (opt_neoscrypt ? gpu->max_intensity : max_intensity))
-                  ++gpu->intensity;
-            }
+        if(gpu->dyn_threads < min_threads) {
+            /* Start small and let the controller grow it */
+            gpu->dyn_threads = (double)(1ULL << (shift + min_intensity));
+            if(gpu->dyn_threads < min_threads)
+              gpu->dyn_threads = min_threads;
         }
-        memcpy(&(gpu->tv_gpustart), &tv_gpuend, sizeof(struct timeval));
-        gpu->intervals = 0;
-    }
-
-    uint threads = 0;
-    while(threads < localThreads[0]) {
-        threads = 1 << (((opt_neoscrypt || opt_scrypt) ? 0 : 15) + gpu->intensity);
-        if(threads < localThreads[0]) {
-            if(gpu->intensity < (opt_neoscrypt ? gpu->max_intensity : max_intensity)) {
-                gpu->intensity++;
-            } else {
-                threads = localThreads[0];
+        if(gpu->dyn_threads > max_threads)
+          gpu->dyn_threads = max_threads;
+
+        /* The global size must be a multiple of the work group size */
+        threads = (uint)gpu->dyn_threads;
+        threads -= threads % localThreads[0];
+
+        /* Nearest intensity, for display only */
+        for(gpu->intensity = min_intensity;
+          (gpu->intensity < max_intensity) &&
+          ((1ULL << (shift + gpu->intensity + 1)) <= threads);
+          gpu->intensity++);
+    } else {
+        while(threads < localThreads[0]) {
+            threads = 1 << (shift + gpu->intensity);
+            if(threads < localThreads[0]) {
+                if(gpu->intensity < (opt_neoscrypt ? gpu->max_intensity : max_intensity)) {
+                    gpu->intensity++;
+                } else {
+                    threads = localThreads[0];
+                }
             }
         }
     }
@@ -1967,22 +2756,37 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
     if(hashes > gpu->max_hashes)
       gpu->max_hashes = hashes;
 
-    status = thrdata->queue_kernel_parameters(clState, &work->blk, globalThreads[0]);
+    /* Queue this batch on the next free slot, keeping the header it is
+     * computed from in the slot until its results have been checked */
+    slot = &thrdata->slots[thrdata->cur];
+    if(slot->pending && !opencl_retire_slot(thr, slot, clState->outputBuffers[thrdata->cur]))
+      return(-1);
+
+    if((slot->work.id != work->id) || memcmp(slot->work.data, work->data, 80))
+      __copy_work(&slot->work, work);
+    slot->work.blk = work->blk;
+    slot->work.blk.work = &slot->work;
+
+    clState->outputBuffer = clState->outputBuffers[thrdata->cur];
+    status = thrdata->queue_kernel_parameters(clState, &slot->work.blk, globalThreads[0]);
 
     if(status != CL_SUCCESS) {
         applog(LOG_ERR, "Error %d in clSetKernelArg()", status);
         return(-1);
     }
 
+    if(opt_opencl_profile)
+      kev = &slot->kev;
+
     if(clState->goffset) {
         size_t global_work_offset[1];
 
         global_work_offset[0] = work->blk.nonce;
         status = clEnqueueNDRangeKernel(clState->commandQueue, *kernel, 1,
-          global_work_offset, globalThreads, localThreads, 0,  NULL, NULL);
+          global_work_offset, globalThreads, localThreads, 0,  NULL, kev);
     } else {
         status = clEnqueueNDRangeKernel(clState->commandQueue, *kernel, 1,
-          NULL, globalThreads, localThreads, 0,  NULL, NULL);
+          NULL, globalThreads, localThreads, 0,  NULL, kev);
     }
 
     if(status != CL_SUCCESS) {
@@ -1990,41 +2794,34 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
         return(-1);
     }
 
-    status = clEnqueueReadBuffer(clState->commandQueue, clState->outputBuffer,
-      CL_FALSE, 0, BUFFERSIZE, thrdata->res, 0, NULL, NULL);
+    slot->res = clEnqueueMapBuffer(clState->commandQueue, clState->outputBuffer,
+      CL_FALSE, CL_MAP_READ, 0, BUFFERSIZE, 0, NULL, &slot->ev, &status);
 
     if(status != CL_SUCCESS) {
-        applog(LOG_ERR, "Error %d in clEnqueueReadBuffer()", status);
+        applog(LOG_ERR, "Error %d in clEnqueueMapBuffer()", status);
+        if(slot->kev) {
+            clReleaseEvent(slot->kev);
+            slot->kev = NULL;
+        }
         return(-1);
     }
+    slot->pending = true;
+    slot->threads = threads;
+    gettimeofday(&slot->tv_queued, NULL);
 
 	/* The amount of work scanned can fluctuate when intensity changes
 	 * and since we do this one cycle behind, we increment the work more
 	 * than enough to prevent repeating work */
 	work->blk.nonce += gpu->max_hashes;
 
-    /* Flush the read buffer set with CL_FALSE in clEnqueueReadBuffer */
-    clFinish(clState->commandQueue);
-
-    /* Algorithm dependent FOUND entry is used as a nonce counter */
-    if(thrdata->res[FOUND]) {
-
-        /* Clear the buffer again */
-        status = clEnqueueWriteBuffer(clState->commandQueue, clState->outputBuffer,
-          CL_FALSE, 0, BUFFERSIZE, blank_res, 0, NULL, NULL);
-
-        if(status != CL_SUCCESS) {
-            applog(LOG_ERR, "Error %d in clEnqueueWriteBuffer()", status);
-            return(-1);
-        }
-
-        applog(LOG_DEBUG, "GPU%d found something?", gpu->device_id);
-        postcalc_hash_async(thr, work, thrdata->res);
-        memset(thrdata->res, 0, BUFFERSIZE);
+    /* Submit without waiting, then collect the oldest batch while the
+     * device works on the one just queued */
+    clFlush(clState->commandQueue);
 
-        /* Flush the write buffer set with CL_FALSE in clEnqueueWriteBuffer */
-        clFinish(clState->commandQueue);
-    }
+    thrdata->cur = (thrdata->cur + 1) % OCL_PIPELINE_DEPTH;
+    slot = &thrdata->slots[thrdata->cur];
+    if(slot->pending && !opencl_retire_slot(thr, slot, clState->outputBuffers[thrdata->cur]))
+      return(-1);
 
     return(hashes);
 }
@@ -2032,7 +2829,28 @@ static int64_t opencl_scanhash(struct thr_info *thr, struct work *work,
 static void opencl_thread_shutdown(struct thr_info *thr)
 {
 	const int thr_id = thr->id;
+	struct opencl_thread_data *thrdata = thr->cgpu_data;
 	_clState *clState = clStates[thr_id];
+	int i;
+
+	clFinish(clState->commandQueue);
+	if (thrdata) {
+		for (i = 0; i < OCL_PIPELINE_DEPTH; i++) {
+			struct opencl_slot *slot = &thrdata->slots[i];
+
+			if (slot->pending) {
+				clEnqueueUnmapMemObject(clState->commandQueue,
+							clState->outputBuffers[i], slot->res, 0, NULL, NULL);
+				clReleaseEvent(slot->ev);
+			}
+			if (slot->kev)
+				clReleaseEvent(slot->kev);
+			slot->kev = NULL;
+			slot->pending = false;
+			clean_work(&slot->work);
+		}
+		clFinish(clState->commandQueue);
+	}
 
 	clReleaseCommandQueue(clState->commandQueue);
 	clReleaseKernel(clState->kernel);
@@ -2047,6 +2865,7 @@ struct device_api opencl_api = {
 	.reinit_device = reinit_opencl_device,
 	.get_statline_before = get_opencl_statline_before,
 	.get_api_extra_device_status = get_opencl_api_extra_device_status,
+	.get_api_stats = get_opencl_api_stats,
 	.thread_prepare = opencl_thread_prepare,
 	.thread_init = opencl_thread_init,
 	.prepare_work = opencl_prepare_work,
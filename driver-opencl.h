@@ -31,6 +31,26 @@ extern void pause_dynamic_threads(int gpu);
 
 extern bool have_opencl;
 extern int opt_platform_id;
+extern bool opt_opencl_cpu;
+extern char *opt_kernel_cache;
+extern bool opt_autotune;
+extern bool opt_opencl_profile;
+extern void init_ocl(void);
+extern void opencl_start_init(void);
+
+/* Phases of a kernel batch timed with --gpu-profile */
+enum opencl_profile_phase {
+	OCL_PROFILE_QUEUED,	/* Queued by the host to submitted to the device */
+	OCL_PROFILE_SUBMIT,	/* Submitted to the kernel starting */
+	OCL_PROFILE_KERNEL,	/* Kernel execution */
+	OCL_PROFILE_READ,	/* Result buffer read back */
+	OCL_PROFILE_IDLE,	/* Previous kernel of the thread ending to this one starting */
+	OCL_PROFILE_MAX,
+};
+
+extern const char *opencl_profile_names[OCL_PROFILE_MAX];
+extern void opencl_profile_get(int thr_id, struct latency_hist *hist);
+extern void opencl_profile_zero(void);
 
 extern struct device_api opencl_api;
 
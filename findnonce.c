@@ -16,6 +16,7 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "findnonce.h"
 #include "miner.h"
@@ -136,23 +137,29 @@ void precalc_hash(dev_blk_ctx *blk, uint32_t *state, uint32_t *data)
 
 #endif /* USE_SHA256D */
 
+/* Nonce verification is done by a fixed pool of workers fed through a
+ * bounded ring of result batches, so a burst of candidates at low share
+ * difficulty doesn't turn into a burst of thread creation */
+#define PC_MAX_WORKERS 8
+#define PC_QUEUE_PER_WORKER 4
+
 struct pc_data {
 	struct thr_info *thr;
 	struct work work;
 	uint32_t res[MAXBUFFERS];
-	pthread_t pth;
-	int found;
 };
 
-static void *postcalc_hash(void *userdata)
+static pthread_mutex_t pc_lock;
+static pthread_cond_t pc_cond, pc_space_cond;
+static struct pc_data *pc_queue;
+static int pc_queue_size, pc_head, pc_count;
+static int pc_workers;
+
+static void postcalc_hash(struct pc_data *pcd)
 {
-	struct pc_data *pcd = (struct pc_data *)userdata;
 	struct thr_info *thr = pcd->thr;
 	unsigned int entry = 0;
 
-	pthread_detach(pthread_self());
-	RenameThread("postcalchsh");
-
 	/* To prevent corrupt values in FOUND from trying to read beyond the
 	 * end of the res[] array */
 	if (unlikely(pcd->res[FOUND] & ~FOUND)) {
@@ -170,30 +177,101 @@ static void *postcalc_hash(void *userdata)
 
         submit_nonce(thr, &pcd->work, nonce);
     }
+}
 
-	clean_work(&pcd->work);
-	free(pcd);
+static void *postcalc_thread(void __maybe_unused *userdata)
+{
+	struct pc_data pcd;
+
+	pthread_detach(pthread_self());
+	RenameThread("postcalchsh");
+
+	while (true) {
+		mutex_lock(&pc_lock);
+		while (!pc_count)
+			pthread_cond_wait(&pc_cond, &pc_lock);
+
+		/* Take over the queued work, leaving the slot empty so that
+		 * the next __copy_work into it has nothing to release */
+		pcd = pc_queue[pc_head];
+		memset(&pc_queue[pc_head].work, 0, sizeof(struct work));
+		pc_head = (pc_head + 1) % pc_queue_size;
+		--pc_count;
+		pthread_cond_signal(&pc_space_cond);
+		mutex_unlock(&pc_lock);
+
+		postcalc_hash(&pcd);
+		clean_work(&pcd.work);
+	}
 
 	return NULL;
 }
 
-void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
+/* Starts the verification workers, one per CPU up to PC_MAX_WORKERS.
+ * Called from the main thread before any GPU thread runs */
+void postcalc_init(void)
 {
-	struct pc_data *pcd = malloc(sizeof(struct pc_data));
-	if (unlikely(!pcd)) {
-		applog(LOG_ERR, "Failed to malloc pc_data in postcalc_hash_async");
+	pthread_t pth;
+	int n = num_processors, i;
+
+	if (pc_queue)
 		return;
+
+#if !defined(WIN32) && defined(_SC_NPROCESSORS_ONLN)
+	if (n < 1)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n < 1)
+		n = 1;
+	if (n > PC_MAX_WORKERS)
+		n = PC_MAX_WORKERS;
+
+	pc_queue_size = n * PC_QUEUE_PER_WORKER;
+	pc_queue = calloc(pc_queue_size, sizeof(*pc_queue));
+	if (unlikely(!pc_queue))
+		quit(1, "Failed to calloc pc_queue in postcalc_init");
+	mutex_init(&pc_lock);
+	if (unlikely(pthread_cond_init(&pc_cond, NULL) ||
+		     pthread_cond_init(&pc_space_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init in postcalc_init");
+
+	for (i = 0; i < n; ++i) {
+		if (pthread_create(&pth, NULL, postcalc_thread, NULL)) {
+			applog(LOG_ERR, "Failed to create postcalc_hash thread");
+			break;
+		}
+		++pc_workers;
 	}
+	applog(LOG_DEBUG, "Started %d nonce verification threads", pc_workers);
+}
 
-	*pcd = (struct pc_data){
-		.thr = thr,
-	};
-	__copy_work(&pcd->work, work);
-	memcpy(&pcd->res, res, BUFFERSIZE);
+void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res)
+{
+	struct pc_data *pcd;
+
+	if (unlikely(!pc_workers)) {
+		struct pc_data local = {
+			.thr = thr,
+		};
 
-	if (pthread_create(&pcd->pth, NULL, postcalc_hash, (void *)pcd)) {
-		applog(LOG_ERR, "Failed to create postcalc_hash thread");
+		__copy_work(&local.work, work);
+		memcpy(&local.res, res, BUFFERSIZE);
+		postcalc_hash(&local);
+		clean_work(&local.work);
 		return;
 	}
+
+	/* The queue is bounded; if verification falls this far behind, hold
+	 * the GPU thread back rather than dropping results */
+	mutex_lock(&pc_lock);
+	while (pc_count == pc_queue_size)
+		pthread_cond_wait(&pc_space_cond, &pc_lock);
+	pcd = &pc_queue[(pc_head + pc_count) % pc_queue_size];
+	pcd->thr = thr;
+	__copy_work(&pcd->work, work);
+	memcpy(&pcd->res, res, BUFFERSIZE);
+	++pc_count;
+	pthread_cond_signal(&pc_cond);
+	mutex_unlock(&pc_lock);
 }
 #endif /* HAVE_OPENCL */
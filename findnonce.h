@@ -12,6 +12,7 @@
 #ifdef USE_SHA256D
 extern void precalc_hash(dev_blk_ctx *blk, uint32_t *state, uint32_t *data);
 #endif /* USE_SHA256D */
+extern void postcalc_init(void);
 extern void postcalc_hash_async(struct thr_info *thr, struct work *work, uint32_t *res);
 #endif /* HAVE_OPENCL */
 #endif /*__FINDNONCE_H__*/
@@ -55,6 +55,8 @@ void my_htole64(unsigned char *buf, uint64_t n) {
 
 
 bool (*blkmk_sha256_impl)(void *, const void *, size_t) = NULL;
+bool (*blkmk_sha256_midstate_impl)(void *, const void *, size_t) = NULL;
+bool (*blkmk_sha256_resume_impl)(void *, const void *, size_t, const void *, size_t) = NULL;
 
 bool _blkmk_dblsha256(void *hash, const void *data, size_t datasz) {
 	return blkmk_sha256_impl(hash, data, datasz) && blkmk_sha256_impl(hash, hash, 32);
@@ -379,15 +381,40 @@ bool blkmk_build_merkle_branches(blktemplate_t * const tmpl)
 	return true;
 }
 
+// The first cbfixedsz bytes of the coinbase are the same for every dataid, so
+// only their SHA256 midstate is kept, and the rest hashed on top of it
 static
-bool build_merkle_root(unsigned char *mrklroot_out, blktemplate_t *tmpl, unsigned char *cbtxndata, size_t cbtxndatasz) {
+bool blkmk_hash_coinbase(blktemplate_t * const tmpl, libblkmaker_hash_t * const out, const unsigned char * const cbtxndata, const size_t cbtxndatasz, const size_t cbfixedsz) {
+	const size_t midsz = cbfixedsz - (cbfixedsz % 64);
+	
+	if (!(midsz && blkmk_sha256_midstate_impl && blkmk_sha256_resume_impl))
+		return dblsha256(out, cbtxndata, cbtxndatasz);
+	
+	if (tmpl->_cbprefixsz != midsz || memcmp(tmpl->_cbprefix, cbtxndata, midsz)) {
+		unsigned char * const prefix = realloc(tmpl->_cbprefix, midsz);
+		if (!prefix)
+			return false;
+		tmpl->_cbprefix = prefix;
+		tmpl->_cbprefixsz = 0;
+		if (!blkmk_sha256_midstate_impl(&tmpl->_cbmidstate, cbtxndata, midsz))
+			return false;
+		memcpy(prefix, cbtxndata, midsz);
+		tmpl->_cbprefixsz = midsz;
+	}
+	
+	return blkmk_sha256_resume_impl(out, &tmpl->_cbmidstate, midsz, &cbtxndata[midsz], cbtxndatasz - midsz)
+	    && blkmk_sha256_impl(out, out, sizeof(*out));
+}
+
+static
+bool build_merkle_root(unsigned char *mrklroot_out, blktemplate_t *tmpl, unsigned char *cbtxndata, size_t cbtxndatasz, size_t cbfixedsz) {
 	int i;
 	libblkmaker_hash_t hashes[0x40];
 	
 	if (!blkmk_build_merkle_branches(tmpl))
 		return false;
 	
-	if (!dblsha256(&hashes[0], cbtxndata, cbtxndatasz))
+	if (!blkmk_hash_coinbase(tmpl, &hashes[0], cbtxndata, cbtxndatasz, cbfixedsz))
 		return false;
 	
 	for (i = 0; i < tmpl->_mrklbranchcount; ++i)
@@ -628,12 +655,20 @@ bool _blkmk_insert_witness_commitment(blktemplate_t * const tmpl, unsigned char
 		return true;
 	}
 
-	libblkmaker_hash_t merkle_with_nonce[2];
-	libblkmaker_hash_t commitment;
-	memcpy(&merkle_with_nonce[0], tmpl->_witnessmrklroot, sizeof(*tmpl->_witnessmrklroot));
-	memcpy(&merkle_with_nonce[1], &witness_nonce, sizeof(witness_nonce));
-	if(!dblsha256(&commitment, &merkle_with_nonce[0], sizeof(merkle_with_nonce)))
-		return false;
+	if (!tmpl->_witnesscommitment) {
+		libblkmaker_hash_t merkle_with_nonce[2];
+		libblkmaker_hash_t * const commitment = malloc(sizeof(*commitment));
+		if (!commitment)
+			return false;
+		memcpy(&merkle_with_nonce[0], tmpl->_witnessmrklroot, sizeof(*tmpl->_witnessmrklroot));
+		memcpy(&merkle_with_nonce[1], &witness_nonce, sizeof(witness_nonce));
+		if(!dblsha256(commitment, &merkle_with_nonce[0], sizeof(merkle_with_nonce))) {
+			free(commitment);
+			return false;
+		}
+		tmpl->_witnesscommitment = commitment;
+	}
+	const libblkmaker_hash_t * const commitment = tmpl->_witnesscommitment;
 	
 	if (cbScriptSigLen >= *gentxsize) {
 		return false;
@@ -655,7 +690,7 @@ bool _blkmk_insert_witness_commitment(blktemplate_t * const tmpl, unsigned char
 	memset(commitment_txout, 0, 8);  // value
 	commitment_txout[8] = commitment_spk_size;
 	memcpy(&commitment_txout[9], witness_magic, sizeof(witness_magic));
-	memcpy(&commitment_txout[9 + sizeof(witness_magic)], &commitment, sizeof(commitment));
+	memcpy(&commitment_txout[9 + sizeof(witness_magic)], commitment, sizeof(*commitment));
 	
 	const size_t offset_of_txout_data = (offset_of_txout_count + in_txout_count_size);
 	const size_t new_offset_of_preexisting_txout_data = (offset_of_txout_count + out_txout_count_size);
@@ -706,10 +741,12 @@ bool blkmk_sample_data_(blktemplate_t * const tmpl, uint8_t * const cbuf, const
 	size_t cbtxndatasz = 0;
 	if (!_blkmk_extranonce(tmpl, cbtxndata, dataid, &cbtxndatasz))
 		return false;
+	// The dataid is appended to the scriptSig, after which everything differs
+	const size_t cbfixedsz = dataid ? (cbScriptSigLen + 1 + cbtxndata[cbScriptSigLen] - sizeof(dataid)) : 0;
 	if (!_blkmk_insert_witness_commitment(tmpl, cbtxndata, &cbtxndatasz)) {
 		return false;
 	}
-	if (!build_merkle_root(&cbuf[36], tmpl, cbtxndata, cbtxndatasz))
+	if (!build_merkle_root(&cbuf[36], tmpl, cbtxndata, cbtxndatasz, cbfixedsz))
 		return false;
 	
 	my_htole32(&cbuf[0x44], tmpl->curtime);
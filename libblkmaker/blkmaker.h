@@ -19,6 +19,9 @@ extern const char *blkmk_supported_rules[];
 extern bool blkmk_supports_rule(const char *rulename);
 
 extern bool (*blkmk_sha256_impl)(void *hash_out, const void *data, size_t datasz);
+// Optional: if both are set, blkmk_get_data only hashes the start of the coinbase once
+extern bool (*blkmk_sha256_midstate_impl)(void *midstate_out, const void *data, size_t datasz);
+extern bool (*blkmk_sha256_resume_impl)(void *hash_out, const void *midstate, size_t midstatesz, const void *data, size_t datasz);
 
 extern uint64_t blkmk_init_generation(blktemplate_t *, void *script, size_t scriptsz);
 extern uint64_t blkmk_init_generation2(blktemplate_t *, void *script, size_t scriptsz, bool *out_newcb);
@@ -140,6 +140,8 @@ void blktmpl_free(blktemplate_t *tmpl) {
 	}
 	free(tmpl->_mrklbranch);
 	free(tmpl->_witnessmrklroot);
+	free(tmpl->_witnesscommitment);
+	free(tmpl->_cbprefix);
 	for (unsigned i = 0; i < tmpl->aux_count; ++i)
 		blkaux_clean(&tmpl->auxs[i]);
 	free(tmpl->auxs);
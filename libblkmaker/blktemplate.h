@@ -160,6 +160,11 @@ typedef struct {
 	int64_t txns_weight;
 	
 	bool has_cbvalue;
+	
+	libblkmaker_hash_t *_witnesscommitment;
+	unsigned char *_cbprefix;
+	size_t _cbprefixsz;
+	libblkmaker_hash_t _cbmidstate;
 } blktemplate_t;
 
 extern void blktxn_init(struct blktxn_t *);
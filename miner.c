@@ -26,6 +26,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <time.h>
@@ -41,8 +42,13 @@
 #ifndef WIN32
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <netdb.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #else
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #endif
 #include <ccan/opt/opt.h>
 #include <jansson.h>
@@ -138,6 +144,7 @@ unsigned long long global_hashrate;
 
 #ifdef HAVE_OPENCL
 int opt_dynamic_interval = 7;
+int opt_throughput_interval = 100;
 uint opencl_devnum;
 int nDevs;
 int opt_g_threads = 1;
@@ -170,6 +177,11 @@ static bool opt_submit_stale = true;
 static int opt_shares;
 static int opt_submit_threads = 0x40;
 bool opt_fail_only;
+static int opt_standby_pools;
+bool opt_extranonce_subscribe;
+static double opt_min_share_diff;
+static int opt_suggest_diff_rate;
+int opt_stratum_port;
 bool opt_autofan;
 bool opt_autoengine;
 
@@ -212,6 +224,7 @@ static int input_thr_id;
 #endif
 int gpur_thr_id;
 static int api_thr_id;
+static int stratumsrv_thr_id;
 static int total_threads;
 
 pthread_mutex_t hash_lock;
@@ -220,12 +233,10 @@ static pthread_mutex_t *stgd_lock;
 pthread_mutex_t console_lock;
 pthread_mutex_t ch_lock;
 static pthread_rwlock_t blk_lock;
-static pthread_mutex_t sshare_lock;
 
 pthread_rwlock_t netacc_lock;
 
 static pthread_mutex_t lp_lock;
-static pthread_cond_t lp_cond;
 
 pthread_mutex_t restart_lock;
 pthread_cond_t restart_cond;
@@ -245,13 +256,21 @@ static pthread_mutex_t submitting_lock;
 static int total_submitting;
 static struct list_head submit_waiting;
 notifier_t submit_waiting_notifier;
+static notifier_t stratum_notifier;
+
+static pthread_mutex_t getwork_lock;
+static struct getwork_state *getwork_waiting;
+static notifier_t getwork_notifier;
 
 int hw_errors;
 int total_accepted, total_rejected;
 int total_getworks, total_stale, total_discarded;
+static int total_filtered;
 uint64_t total_bytes_xfer;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
 static int staged_rollable;
+static int total_getwork_inflight;
+static unsigned long staged_popped;
 unsigned int new_blocks;
 unsigned int found_blocks;
 
@@ -298,17 +317,31 @@ static struct block *blocks = NULL;
 
 int swork_id;
 
-/* For creating a hash database of stratum shares submitted that have not had
- * a response yet */
+/* Stratum shares submitted that have not had a response yet. Each pool keeps
+ * a fixed table of these, indexed directly by the low bits of the submit id
+ * and only ever touched by the stratum reactor. Just enough of the work is
+ * kept to account for and log the pool's verdict */
+#define STRATUM_SHARE_SLOTS  512
+
 struct stratum_share {
-	UT_hash_handle hh;
+	unsigned int id;
+	bool used;
 	bool block;
-	struct work *work;
-	int id;
+	bool stale;
+	bool resumable;
+	bool resubmitted;
+	char job_id[64];
+	char nonce2[33];
+	char ntime[9];
+	int thr_id;
+	double work_difficulty;
+	unsigned char data[128];
+	unsigned char target[32];
+	unsigned char hash[32];
+	struct timeval tv_work_found;
+	struct timeval tv_submit;
 };
 
-static struct stratum_share *stratum_shares = NULL;
-
 char *opt_socks_proxy = NULL;
 
 static const char def_conf[] = "nsgminer.conf";
@@ -487,6 +520,7 @@ struct pool *add_pool(void)
 	pool->rpc_proxy = NULL;
 
 	pool->sock = INVSOCK;
+	pool->stratum_watched = INVSOCK;
 	pool->lp_socket = CURL_SOCKET_BAD;
 
 	pools = realloc(pools, sizeof(struct pool *) * (total_pools + 2));
@@ -546,11 +580,27 @@ static char *set_int_0_to_9999(const char *arg, int *i)
 	return set_int_range(arg, i, 0, 9999);
 }
 
+static char *set_min_share_diff(const char *arg, double *d)
+{
+	char *end;
+
+	*d = strtod(arg, &end);
+	if (end == arg || *end || *d < 0)
+		return "Invalid minimum share difficulty";
+
+	return NULL;
+}
+
 static char *set_int_1_to_65535(const char *arg, int *i)
 {
 	return set_int_range(arg, i, 1, 65535);
 }
 
+static char *set_int_0_to_65535(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 65535);
+}
+
 static char *set_int_0_to_10(const char *arg, int *i)
 {
 	return set_int_range(arg, i, 0, 10);
@@ -1134,6 +1184,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--auto-gpu",
 			opt_set_bool, &opt_autoengine,
 			"Automatically adjust all GPU engine clock speeds to maintain a target temperature"),
+#endif
+#ifdef HAVE_OPENCL
+	OPT_WITHOUT_ARG("--autotune",
+			opt_set_bool, &opt_autotune,
+			"Benchmark GPU work size, intensity, thread concurrency and lookup gap at startup and save the best per device"),
 #endif
 	OPT_WITHOUT_ARG("--balance",
 		     set_balance, &pool_strategy,
@@ -1210,6 +1265,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--expiry-lp",
 		     set_int_0_to_9999, opt_show_intval, &opt_expiry_lp,
 		     "Upper bound on how many seconds after getting work we consider a share from it stale (with longpoll active)"),
+	OPT_WITHOUT_ARG("--extranonce-subscribe",
+			opt_set_bool, &opt_extranonce_subscribe,
+			"Ask stratum pools to change extranonce with mining.set_extranonce rather than reconnecting"),
 	OPT_WITHOUT_ARG("--failover-only",
 			opt_set_bool, &opt_fail_only,
 			"Don't leak work to backup pools when primary pool is lagging"),
@@ -1222,9 +1280,15 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--gpu-dyninterval",
 		     set_int_1_to_65535, opt_show_intval, &opt_dynamic_interval,
 		     "Set the refresh interval in ms for GPUs using dynamic intensity"),
+	OPT_WITH_ARG("--gpu-tpinterval",
+		     set_int_1_to_65535, opt_show_intval, &opt_throughput_interval,
+		     "Set the kernel time in ms for GPUs using throughput intensity (t)"),
 	OPT_WITH_ARG("--gpu-platform",
 		     set_int_0_to_9999, opt_show_intval, &opt_platform_id,
 		     "Select OpenCL platform ID to use for GPU mining"),
+	OPT_WITHOUT_ARG("--gpu-profile",
+			opt_set_bool, &opt_opencl_profile,
+			"Time GPU kernels and result reads with OpenCL event profiling, for the API"),
 	OPT_WITH_ARG("--gpu-threads|-g",
 		     set_int_1_to_10, opt_show_intval, &opt_g_threads,
 		     "Number of threads per GPU (1 - 10)"),
@@ -1258,7 +1322,10 @@ static struct opt_table opt_config_table[] = {
 #endif
 	OPT_WITH_ARG("--intensity|-I",
 		     set_intensity, NULL, NULL,
-		     "Intensity of GPU scanning (d or fixed number within range; default: d to maintain desktop interactivity)"),
+		     "Intensity of GPU scanning (d, t or fixed number within range; default: d to maintain desktop interactivity, t for throughput)"),
+	OPT_WITH_ARG("--kernel-cache",
+		     opt_set_charp, NULL, &opt_kernel_cache,
+		     "Directory to cache compiled OpenCL kernels in (default: ~/.nsgminer/kernels)"),
 #endif
 #if defined(HAVE_OPENCL) || defined(USE_MODMINER) || defined(USE_X6500) || defined(USE_ZTEX)
 	OPT_WITH_ARG("--kernel-path|-K",
@@ -1302,6 +1369,9 @@ static struct opt_table opt_config_table[] = {
     OPT_WITHOUT_ARG("--log-show-date",
       opt_set_bool, &opt_log_show_date,
       "Show date on every log line in addition to time"),
+	OPT_WITH_ARG("--min-share-diff",
+		     set_min_share_diff, NULL, &opt_min_share_diff,
+		     "Do not submit shares below this difficulty, and ask stratum pools for at least this much"),
 #if defined(unix) || defined(__APPLE__)
 	OPT_WITH_ARG("--monitor|-m",
 		     opt_set_charp, NULL, &opt_stderr_cmd,
@@ -1348,6 +1418,11 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--no-submit-stale",
 			opt_set_invbool, &opt_submit_stale,
 		        "Don't submit shares if they are detected as stale"),
+#ifdef HAVE_OPENCL
+	OPT_WITHOUT_ARG("--opencl-cpu",
+			opt_set_bool, &opt_opencl_cpu,
+			"Use OpenCL CPU devices (e.g. POCL) instead of GPUs, for testing"),
+#endif
     OPT_WITH_ARG("--pass|-p",
       set_pass, NULL, NULL,
       "Password for a JSON-RPC server"),
@@ -1421,12 +1496,21 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks4 proxy (host:port)"),
+	OPT_WITH_ARG("--standby-pools",
+		     set_int_0_to_9999, opt_show_intval, &opt_standby_pools,
+		     "Number of backup stratum pools to keep connected and authorised for instant failover"),
+	OPT_WITH_ARG("--stratum-port",
+		     set_int_0_to_65535, opt_show_intval, &opt_stratum_port,
+		     "Port number to listen on for downstream stratum miners, which mine the current pool's jobs through us (0 = disabled)"),
 	OPT_WITHOUT_ARG("--submit-stale",
 			opt_set_bool, &opt_submit_stale,
 	                opt_hidden),
 	OPT_WITHOUT_ARG("--submit-threads",
 	                opt_set_intval, &opt_submit_threads,
 	                "Minimum number of concurrent share submissions (default: 64)"),
+	OPT_WITH_ARG("--suggest-diff-rate",
+		     set_int_0_to_9999, opt_show_intval, &opt_suggest_diff_rate,
+		     "Ask stratum pools for a share difficulty giving about this many shares per minute at the measured hashrate (0 = never)"),
 #ifdef HAVE_SYSLOG_H
 	OPT_WITHOUT_ARG("--syslog",
 			opt_set_bool, &use_syslog,
@@ -1806,6 +1890,154 @@ void have_block_height(uint32_t block_id, uint32_t blkheight)
 	mutex_unlock(&ch_lock);
 }
 
+/* Transaction hashes from recent GBT templates, keyed by the raw transaction
+ * so that a refreshed template only hashes what is new in it */
+struct txid_cache_ent {
+	unsigned char *data;
+	size_t datasz;
+	unsigned char hash[32];
+	unsigned int gen;
+	UT_hash_handle hh;
+};
+
+static struct txid_cache_ent *txid_cache;
+static unsigned int txid_cache_gen;
+static pthread_mutex_t txid_cache_lock;
+
+/* Below this many new transactions, hashing them here beats starting threads */
+#define TXHASH_THREAD_MIN 256
+#define TXHASH_MAX_THREADS 8
+
+struct txhash_job {
+	struct blktxn_t **txns;
+	unsigned long count;
+};
+
+static void *txhash_thread(void *userdata)
+{
+	struct txhash_job *job = userdata;
+	unsigned long i;
+
+	for (i = 0; i < job->count; i++) {
+		struct blktxn_t *txn = job->txns[i];
+		unsigned char *hash = (unsigned char *)txn->hash_;
+
+		sha2(txn->data, txn->datasz, hash);
+		sha2(hash, 32, hash);
+	}
+	return NULL;
+}
+
+/* Fill in the hashes libblkmaker would otherwise compute serially for
+ * transactions the pool sent without one: from the cache if they were in a
+ * recent template, else hashed across a few threads. */
+static bool gbt_hash_transactions(blktemplate_t *tmpl)
+{
+	struct txhash_job jobs[TXHASH_MAX_THREADS];
+	pthread_t pth[TXHASH_MAX_THREADS];
+	struct txid_cache_ent *ent, *tmp;
+	struct blktxn_t **missing;
+	unsigned long i, nmissing = 0, per;
+	int nthreads = 1, t;
+	unsigned int gen;
+
+	for (i = 0; i < tmpl->txncount; i++)
+		if (!tmpl->txns[i].hash_)
+			break;
+	if (i == tmpl->txncount)
+		return true;
+
+	missing = malloc(tmpl->txncount * sizeof(*missing));
+	if (unlikely(!missing))
+		return false;
+
+	mutex_lock(&txid_cache_lock);
+	gen = ++txid_cache_gen;
+	for (i = 0; i < tmpl->txncount; i++) {
+		struct blktxn_t *txn = &tmpl->txns[i];
+
+		if (txn->hash_)
+			continue;
+		txn->hash_ = malloc(sizeof(*txn->hash_));
+		if (unlikely(!txn->hash_))
+			break;
+		HASH_FIND(hh, txid_cache, txn->data, txn->datasz, ent);
+		if (ent) {
+			memcpy(*txn->hash_, ent->hash, 32);
+			ent->gen = gen;
+		} else
+			missing[nmissing++] = txn;
+	}
+	mutex_unlock(&txid_cache_lock);
+	if (unlikely(i < tmpl->txncount)) {
+		/* Leave the rest for libblkmaker */
+		for (i = 0; i < nmissing; i++) {
+			free(missing[i]->hash_);
+			missing[i]->hash_ = NULL;
+		}
+		free(missing);
+		return false;
+	}
+
+	if (nmissing >= TXHASH_THREAD_MIN && num_processors > 1)
+		nthreads = num_processors < TXHASH_MAX_THREADS ? num_processors : TXHASH_MAX_THREADS;
+	per = nmissing / nthreads;
+	for (t = 0; t < nthreads; t++) {
+		jobs[t].txns = &missing[per * t];
+		jobs[t].count = (t == nthreads - 1) ? nmissing - per * t : per;
+	}
+	for (t = 1; t < nthreads; t++) {
+		if (unlikely(pthread_create(&pth[t], NULL, txhash_thread, &jobs[t]))) {
+			/* Fold the rest into our own share */
+			jobs[0].count = nmissing - per * t;
+			jobs[0].txns = &missing[per * t];
+			txhash_thread(&jobs[0]);
+			jobs[0].count = per;
+			jobs[0].txns = missing;
+			nthreads = t;
+			break;
+		}
+	}
+	txhash_thread(&jobs[0]);
+	for (t = 1; t < nthreads; t++)
+		pthread_join(pth[t], NULL);
+
+	mutex_lock(&txid_cache_lock);
+	for (i = 0; i < nmissing; i++) {
+		struct blktxn_t *txn = missing[i];
+
+		HASH_FIND(hh, txid_cache, txn->data, txn->datasz, ent);
+		if (ent)
+			continue;
+		ent = malloc(sizeof(*ent));
+		if (unlikely(!ent))
+			break;
+		ent->data = malloc(txn->datasz);
+		if (unlikely(!ent->data)) {
+			free(ent);
+			break;
+		}
+		memcpy(ent->data, txn->data, txn->datasz);
+		ent->datasz = txn->datasz;
+		memcpy(ent->hash, *txn->hash_, 32);
+		ent->gen = gen;
+		HASH_ADD_KEYPTR(hh, txid_cache, ent->data, ent->datasz, ent);
+	}
+	/* Forget transactions that haven't been in any of the last few
+	 * templates; they have most likely been mined */
+	HASH_ITER(hh, txid_cache, ent, tmp) {
+		if (gen - ent->gen > 4) {
+			HASH_DEL(txid_cache, ent);
+			free(ent->data);
+			free(ent);
+		}
+	}
+	mutex_unlock(&txid_cache_lock);
+
+	free(missing);
+	return true;
+}
+
 static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 {
 	json_t *res_val = json_object_get(val, "result");
@@ -1821,6 +2053,8 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 			applog(LOG_ERR, "blktmpl error: %s", err);
 			return false;
 		}
+		if (unlikely(!gbt_hash_transactions(work->tmpl)))
+			applog(LOG_DEBUG, "Could not pre-hash template transactions on pool %u", pool->pool_no);
 		work->rolltime = blkmk_time_left(work->tmpl, time(NULL));
 #if BLKMAKER_VERSION > 1
 		if (opt_coinbase_script.sz)
@@ -2173,6 +2407,17 @@ static double utility_to_hashrate(double utility) {
     return(modifier * utility * 0x4444444);
 }
 
+static double hashrate_to_utility(double hashrate) {
+    double modifier;
+
+    if(opt_neoscrypt || opt_scrypt)
+      modifier = 0.000244140625;
+    else
+      modifier = 1.0;
+
+    return(hashrate / (modifier * 0x4444444));
+}
+
 static const char *_unitchar = "KMGTPEZY?";
 
 static void
@@ -2612,6 +2857,41 @@ static void reject_pool(struct pool *pool)
 
 static bool test_work_current(struct work *);
 
+static void pool_latency(struct pool *pool, enum pool_latency which, struct timeval *start, struct timeval *end)
+{
+	if (!start->tv_sec)
+		return;
+
+	mutex_lock(&pool->pool_lock);
+	latency_add(&pool->latency[which], start, end);
+	mutex_unlock(&pool->pool_lock);
+}
+
+/* Records how long a new job took to reach a device. For stratum only the
+ * first work item generated from each notify counts; getwork and benchmark
+ * work is measured from when it arrived, ignoring clones and rolls */
+static void pool_job_started(struct work *work, struct timeval *tv_start)
+{
+	struct pool *pool = work->pool;
+
+	if (work->clone || work->rolls)
+		return;
+
+	if (!work->stratum) {
+		pool_latency(pool, LATENCY_JOB_HASH, &work->tv_getwork_reply, tv_start);
+		return;
+	}
+
+	mutex_lock(&pool->pool_lock);
+	if (!pool->swork.hashed && work->tv_notify.tv_sec &&
+	    work->tv_notify.tv_sec == pool->swork.tv_notify.tv_sec &&
+	    work->tv_notify.tv_usec == pool->swork.tv_notify.tv_usec) {
+		pool->swork.hashed = true;
+		latency_add(&pool->latency[LATENCY_JOB_HASH], &work->tv_notify, tv_start);
+	}
+	mutex_unlock(&pool->pool_lock);
+}
+
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
  * same time is zero so there is no point adding extra locking */
@@ -2826,6 +3106,9 @@ static bool submit_upstream_work_completed(struct work *work, bool resubmit, str
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
 
+	pool_latency(pool, LATENCY_FOUND_SUBMIT, &work->tv_work_found, ptv_submit);
+	pool_latency(pool, LATENCY_SUBMIT_REPLY, ptv_submit, &tv_submit_reply);
+
 	res = json_object_get(val, "result");
 	err = json_object_get(val, "error");
 
@@ -3085,6 +3368,9 @@ static void get_benchmark_work(struct work *work)
 	size_t min_size = (work_size < bench_size ? work_size : bench_size);
 	memset(work, 0, sizeof(*work));
 	memcpy(work, &bench_block, min_size);
+	/* The block is an old struct work dump, so only its header and target
+	 * are meaningful */
+	work->rolls = 0;
 	work->mandatory = true;
 	work->pool = pools[0];
 	gettimeofday(&(work->tv_getwork), NULL);
@@ -3181,47 +3467,40 @@ static enum pool_protocol pool_protocol_fallback(enum pool_protocol proto)
 	}
 }
 
-static bool get_upstream_work(struct work *work, CURL *curl)
+/* Build the getwork/GBT request for @work, or NULL if none can be made */
+static char *get_upstream_work_request(struct work *work)
 {
 	struct pool *pool = work->pool;
-	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
-	struct timeval tv_elapsed;
-	json_t *val = NULL;
-	bool rc = false;
-	char *url;
-	enum pool_protocol proto;
-
 	char *rpc_req;
 
 	if (pool->proto == PLP_NONE)
 		pool->proto = PLP_GETBLOCKTEMPLATE;
 
-tryagain:
 	rpc_req = prepare_rpc_req(work, pool->proto, NULL);
 	work->pool = pool;
 	if (!rpc_req)
-		return false;
+		return NULL;
 
 	applog(LOG_DEBUG, "DBG: sending %s get RPC call: %s", pool->rpc_url, rpc_req);
 
-	url = pool->rpc_url;
-
 	gettimeofday(&(work->tv_getwork), NULL);
 
-	val = json_rpc_call(curl, url, pool->rpc_userpass, rpc_req, false,
-			    false, &work->rolltime, pool, false);
-	pool_stats->getwork_attempts++;
+	return rpc_req;
+}
 
-	free(rpc_req);
+/* Decode the reply to a getwork/GBT request and account for it. Consumes
+ * @val, which is NULL if the request failed */
+static bool get_upstream_work_completed(struct work *work, json_t *val)
+{
+	struct pool *pool = work->pool;
+	struct cgminer_pool_stats *pool_stats = &(pool->cgminer_pool_stats);
+	struct timeval tv_elapsed;
+	bool rc = false;
 
 	if (likely(val)) {
 		rc = work_decode(pool, work, val);
 		if (unlikely(!rc))
 			applog(LOG_DEBUG, "Failed to decode work in get_upstream_work");
-	} else if (PLP_NONE != (proto = pool_protocol_fallback(pool->proto))) {
-		applog(LOG_WARNING, "Pool %u failed getblocktemplate request; falling back to getwork protocol", pool->pool_no);
-		pool->proto = proto;
-		goto tryagain;
 	} else
 		applog(LOG_DEBUG, "Failed json_rpc_call in get_upstream_work");
 
@@ -3337,6 +3616,12 @@ static void __kill_work(void)
 	applog(LOG_DEBUG, "Killing off API thread");
 	thr = &thr_info[api_thr_id];
 	thr_info_cancel(thr);
+
+	if (opt_stratum_port) {
+		applog(LOG_DEBUG, "Killing off stratum server thread");
+		thr = &thr_info[stratumsrv_thr_id];
+		thr_info_cancel(thr);
+	}
 }
 
 /* This should be the common exit path */
@@ -3820,7 +4105,7 @@ static struct submit_work_state *begin_submission(struct work *work)
 		.work = work,
 	};
 
-	if (work->stratum && pool->sock == INVSOCK) {
+	if (work->stratum && pool->sock == INVSOCK && !pool->stratum_resume_until) {
 		applog(LOG_WARNING, "Share found for dead stratum pool %u, discarding", pool->pool_no);
 		submit_discard_share2("disconnect", work);
 		goto out;
@@ -3846,6 +4131,20 @@ static struct submit_work_state *begin_submission(struct work *work)
         applog(LOG_NOTICE, "Found block for pool %d!", work->pool->pool_no);
     }
 
+	/* Shares below the local floor are never sent, which saves the pool and
+	 * us the trouble, but they are still counted so that what was thrown
+	 * away shows up in the stats */
+	if (opt_min_share_diff > 0 && !work->block && share_diff(work) < opt_min_share_diff) {
+		applog(LOG_DEBUG, "Pool %d share below minimum difficulty, not submitting", pool->pool_no);
+		sharelog("filtered", work);
+		mutex_lock(&stats_lock);
+		++total_filtered;
+		++pool->filtered_shares;
+		pool->diff_filtered += work->work_difficulty;
+		mutex_unlock(&stats_lock);
+		goto out;
+	}
+
 	if (stale_work(work, true)) {
 		work->stale = true;
 		if (opt_submit_stale)
@@ -3860,32 +4159,8 @@ static struct submit_work_state *begin_submission(struct work *work)
 		sws->staleexpire = time(NULL) + 300;
 	}
 
-	if (work->stratum) {
-		struct stratum_share *sshare = calloc(sizeof(struct stratum_share), 1);
-		uint32_t nonce;
-		char *noncehex;
-		char *s;
-
-		sshare->work = copy_work(work);
-		mutex_lock(&sshare_lock);
-		/* Give the stratum share a unique id */
-		sshare->id = swork_id++;
-		HASH_ADD_INT(stratum_shares, id, sshare);
-		mutex_unlock(&sshare_lock);
-
-        if(opt_neoscrypt)
-          nonce = htobe32(*((uint32_t *)(work->data + 76)));
-        else
-          nonce = *((uint32_t *)(work->data + 76));
-
-		noncehex = bin2hex((const unsigned char *)&nonce, 4);
-		s = malloc(1024);
-		sprintf(s, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-			pool->rpc_user, work->job_id, work->nonce2, work->ntime, noncehex, sshare->id);
-		free(noncehex);
-
-		sws->s = s;
-	} else {
+	/* Stratum shares are formatted by the stratum reactor as they go out */
+	if (!work->stratum) {
 		/* submit solution to bitcoin via JSON-RPC */
 		sws->ce = pop_curl_entry2(pool, false);
 		if (sws->ce) {
@@ -3955,13 +4230,14 @@ static void free_sws(struct submit_work_state *sws)
 	free(sws);
 }
 
+static void stratum_queue_share(struct submit_work_state *sws);
+
 static void *submit_work_thread(__maybe_unused void *userdata)
 {
 	int wip = 0;
 	CURLM *curlm;
 	long curlm_timeout_ms = -1;
-	struct submit_work_state *sws, **swsp;
-	struct submit_work_state *write_sws = NULL;
+	struct submit_work_state *sws;
 	unsigned tsreduce = 0;
 
 	pthread_detach(pthread_self());
@@ -3991,12 +4267,14 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 			struct work *work = list_entry(submit_waiting.next, struct work, list);
 			list_del(&work->list);
 			if ( (sws = begin_submission(work)) ) {
+				if (work->stratum) {
+					/* Stratum shares are written out by
+					 * the stratum reactor */
+					stratum_queue_share(sws);
+					continue;
+				}
 				if (sws->ce)
 					curl_multi_add_handle(curlm, sws->ce->curl);
-				else if (sws->s) {
-					sws->next = write_sws;
-					write_sws = sws;
-				}
 				++wip;
 			}
 			else {
@@ -4019,29 +4297,6 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 		} else
 			timeoutp = NULL;
 		
-		for (swsp = &write_sws; (sws = *swsp); ) {
-			int fd = sws->work->pool->sock;
-			if (fd == INVSOCK) {
-				applog(LOG_WARNING, "Stratum pool %u died while share waiting to submit, discarding", sws->work->pool->pool_no);
-				submit_discard_share2("disconnect", sws->work);
-				--wip;
-				++tsreduce;
-				*swsp = sws->next;
-				free_sws(sws);
-				continue;
-			}
-			FD_SET(fd, &wfds);
-			if (fd > maxfd)
-				maxfd = fd;
-			swsp = &sws->next;
-		}
-		if (tsreduce) {
-			mutex_lock(&submitting_lock);
-			total_submitting -= tsreduce;
-			mutex_unlock(&submitting_lock);
-			tsreduce = 0;
-		}
-		
 		FD_SET(submit_waiting_notifier[0], &rfds);
 		if (submit_waiting_notifier[0] > maxfd)
 			maxfd = submit_waiting_notifier[0];
@@ -4051,36 +4306,6 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 			continue;
 		}
 		
-		for (swsp = &write_sws; (sws = *swsp); ) {
-			int fd = sws->work->pool->sock;
-			if (fd == -1 || !FD_ISSET(fd, &wfds)) {
-				swsp = &sws->next;
-				continue;
-			}
-			
-			struct pool *pool = sws->work->pool;
-			char *s = sws->s;
-
-			applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->stratum_url, s);
-
-			if (likely(stratum_send(pool, s, strlen(s)))) {
-				if (pool_tclear(pool, &pool->submit_fail))
-						applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
-				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
-			} else if (!pool_tset(pool, &pool->submit_fail)) {
-				applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
-				total_ro++;
-				pool->remotefail_occasions++;
-			}
-			
-			// Clear the fd from wfds, to avoid potentially blocking on other submissions to the same socket
-			FD_CLR(fd, &wfds);
-			// Delete sws for this submission, since we're done with it
-			*swsp = sws->next;
-			free_sws(sws);
-			--wip;
-		}
-		
 		curl_multi_perform(curlm, &n);
 		while( (cm = curl_multi_info_read(curlm, &n)) ) {
 			if (cm->msg == CURLMSG_DONE)
@@ -4113,7 +4338,6 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 			}
 		}
 	}
-	assert(!write_sws);
 	mutex_unlock(&submitting_lock);
 
 	curl_multi_cleanup(curlm);
@@ -4123,99 +4347,363 @@ static void *submit_work_thread(__maybe_unused void *userdata)
 	return NULL;
 }
 
-/* Find the pool that currently has the highest priority */
-static struct pool *priority_pool(int choice)
-{
-	struct pool *ret = NULL;
-	int i;
+/* Getwork and GBT requests are not made from main() directly, since a slow
+ * pool would then cap how much work can be staged to one item per round-trip.
+ * Instead the scheduler hands them to getwork_thread, which keeps as many as
+ * are needed in flight on a curl multi handle and stages the replies. */
+struct getwork_state {
+	struct work *work;
+	struct curl_ent *ce;
+	char *rpc_req;
+	bool clear_lagging;
+	struct getwork_state *next;
+};
 
-	for (i = 0; i < total_pools; i++) {
-		struct pool *pool = pools[i];
+static void pool_resus(struct pool *pool);
 
-		if (pool->prio == choice) {
-			ret = pool;
-			break;
-		}
-	}
+static void getwork_release(struct pool *pool)
+{
+	mutex_lock(stgd_lock);
+	pool->getwork_inflight--;
+	total_getwork_inflight--;
+	pthread_cond_signal(&gws_cond);
+	mutex_unlock(stgd_lock);
+}
 
-	if (unlikely(!ret)) {
-		applog(LOG_ERR, "WTF No pool %d found!", choice);
-		return pools[choice];
-	}
-	return ret;
+static void getwork_failed(struct getwork_state *gws)
+{
+	struct work *work = gws->work;
+	struct pool *pool = work->pool;
+
+	/* Make sure the pool just hasn't stopped serving requests but is up as
+	 * we'll keep hammering it; the scheduler fails over to another pool, or
+	 * retries this one once getwork_retry has passed */
+	applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work", pool->pool_no);
+	push_curl_entry(gws->ce, pool);
+	++pool->seq_getfails;
+	pool->getwork_retry = time(NULL) + 5;
+	pool_died(pool);
+	free_work(work);
+	free(gws->rpc_req);
+	free(gws);
+	getwork_release(pool);
 }
 
-int prioritize_pools(char *param, int *pid)
+static bool getwork_send(struct getwork_state *gws)
 {
-	char *ptr, *next;
-	int i, pr, prio = 0;
+	struct pool *pool = gws->work->pool;
 
-	if (total_pools == 0) {
-		return MSG_NOPOOL;
-	}
+	free(gws->rpc_req);
+	gws->rpc_req = get_upstream_work_request(gws->work);
+	if (!gws->rpc_req)
+		return false;
+	json_rpc_call_async(gws->ce->curl, pool->rpc_url, pool->rpc_userpass, gws->rpc_req, false, pool, false, gws);
+	return true;
+}
 
-	if (param == NULL || *param == '\0') {
-		return MSG_MISPID;
+/* Called by the scheduler with a slot already reserved for the pool */
+static void get_upstream_work_async(struct work *work, bool clear_lagging)
+{
+	struct getwork_state *gws = calloc(1, sizeof(*gws));
+
+	if (unlikely(!gws))
+		quit(1, "Failed to calloc gws in get_upstream_work_async");
+	gws->work = work;
+	gws->clear_lagging = clear_lagging;
+	gws->ce = pop_curl_entry3(work->pool, 2);
+	if (!getwork_send(gws)) {
+		getwork_failed(gws);
+		return;
 	}
 
-	bool pools_changed[total_pools];
-	int new_prio[total_pools];
-	for (i = 0; i < total_pools; ++i)
-		pools_changed[i] = false;
+	mutex_lock(&getwork_lock);
+	gws->next = getwork_waiting;
+	getwork_waiting = gws;
+	mutex_unlock(&getwork_lock);
+	notifier_wake(getwork_notifier);
+}
 
-	next = param;
-	while (next && *next) {
-		ptr = next;
-		next = strchr(ptr, ',');
-		if (next)
-			*(next++) = '\0';
+static void getwork_completed(CURLM *curlm, CURL *curl, int result)
+{
+	struct getwork_state *gws;
+	enum pool_protocol proto;
+	struct pool *pool;
+	struct work *work;
+	int rolltime = 0;
+	json_t *val;
 
-		i = atoi(ptr);
-		if (i < 0 || i >= total_pools) {
-			*pid = i;
-			return MSG_INVPID;
-		}
+	val = json_rpc_call_completed(curl, result, false, &rolltime, &gws);
+	curl_multi_remove_handle(curlm, curl);
+	if (unlikely(!gws))
+		return;
+	work = gws->work;
+	pool = work->pool;
+	pool->cgminer_pool_stats.getwork_attempts++;
 
-		if (pools_changed[i]) {
-			*pid = i;
-			return MSG_DUPPID;
+	if (!val && PLP_NONE != (proto = pool_protocol_fallback(pool->proto))) {
+		applog(LOG_WARNING, "Pool %u failed getblocktemplate request; falling back to getwork protocol", pool->pool_no);
+		pool->proto = proto;
+		if (getwork_send(gws)) {
+			curl_multi_add_handle(curlm, curl);
+			return;
 		}
-
-		pools_changed[i] = true;
-		new_prio[i] = prio++;
 	}
 
-	// Only change them if no errors
-	for (i = 0; i < total_pools; i++) {
-		if (pools_changed[i])
-			pools[i]->prio = new_prio[i];
+	if (val)
+		work->rolltime = rolltime;
+	if (!get_upstream_work_completed(work, val)) {
+		getwork_failed(gws);
+		return;
 	}
 
-	// In priority order, cycle through the unchanged pools and append them
-	for (pr = 0; pr < total_pools; pr++)
-		for (i = 0; i < total_pools; i++) {
-			if (!pools_changed[i] && pools[i]->prio == pr) {
-				pools[i]->prio = prio++;
-				pools_changed[i] = true;
-				break;
-			}
-		}
-
-	if (current_pool()->prio)
-		switch_pools(NULL);
+	if (gws->clear_lagging)
+		pool_tclear(pool, &pool->lagging);
+	if (pool_tclear(pool, &pool->idle))
+		pool_resus(pool);
 
-	return MSG_POOLPRIO;
+	applog(LOG_DEBUG, "Generated getwork work");
+	stage_work(work);
+	push_curl_entry(gws->ce, pool);
+	free(gws->rpc_req);
+	free(gws);
+	getwork_release(pool);
 }
 
-void validate_pool_priorities(void)
+static void *getwork_thread(__maybe_unused void *userdata)
 {
-	// TODO: this should probably do some sort of logging
-	int i, j;
-	bool used[total_pools];
-	bool valid[total_pools];
+	CURLM *curlm;
+	long curlm_timeout_ms = -1;
+	struct getwork_state *gws;
 
-	for (i = 0; i < total_pools; i++)
-		used[i] = valid[i] = false;
+	pthread_detach(pthread_self());
+
+	RenameThread("getwork");
+
+	curlm = curl_multi_init();
+	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, my_curl_timer_set);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, &curlm_timeout_ms);
+
+	fd_set rfds, wfds, efds;
+	int maxfd;
+	struct timeval timeout, *timeoutp;
+	int n;
+	CURLMsg *cm;
+	FD_ZERO(&rfds);
+	while (!shutting_down) {
+		if (FD_ISSET(getwork_notifier[0], &rfds))
+			notifier_read(getwork_notifier);
+
+		mutex_lock(&getwork_lock);
+		gws = getwork_waiting;
+		getwork_waiting = NULL;
+		mutex_unlock(&getwork_lock);
+		while (gws) {
+			struct getwork_state *next = gws->next;
+
+			curl_multi_add_handle(curlm, gws->ce->curl);
+			gws = next;
+		}
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		curl_multi_fdset(curlm, &rfds, &wfds, &efds, &maxfd);
+		if (curlm_timeout_ms >= 0) {
+			timeout.tv_sec = curlm_timeout_ms / 1000;
+			timeout.tv_usec = (curlm_timeout_ms % 1000) * 1000;
+			timeoutp = &timeout;
+		} else
+			timeoutp = NULL;
+
+		FD_SET(getwork_notifier[0], &rfds);
+		if (getwork_notifier[0] > maxfd)
+			maxfd = getwork_notifier[0];
+
+		if (select(maxfd+1, &rfds, &wfds, &efds, timeoutp) < 0) {
+			FD_ZERO(&rfds);
+			continue;
+		}
+
+		curl_multi_perform(curlm, &n);
+		while ( (cm = curl_multi_info_read(curlm, &n)) ) {
+			if (cm->msg == CURLMSG_DONE)
+				getwork_completed(curlm, cm->easy_handle, cm->data.result);
+		}
+	}
+
+	curl_multi_cleanup(curlm);
+
+	applog(LOG_DEBUG, "getwork thread exiting");
+
+	return NULL;
+}
+
+/* Rate at which mining threads take work off the staged queue, in work items
+ * per second. Only called from the scheduler. */
+static double work_consume_rate(void)
+{
+	static struct timeval tv_last;
+	static unsigned long last_popped;
+	static double rate;
+	struct timeval now;
+	unsigned long popped;
+	double secs;
+
+	gettimeofday(&now, NULL);
+	if (!tv_last.tv_sec) {
+		tv_last = now;
+		return rate;
+	}
+	secs = tdiff(&now, &tv_last);
+	if (secs < 1)
+		return rate;
+
+	mutex_lock(stgd_lock);
+	popped = staged_popped;
+	mutex_unlock(stgd_lock);
+
+	decay_time(&rate, (popped - last_popped) / secs);
+	last_popped = popped;
+	tv_last = now;
+	return rate;
+}
+
+/* How many getwork requests to keep in flight to @pool: enough to cover its
+ * measured round-trip at the current consumption rate. GBT templates are
+ * rolled locally, so one outstanding request is all they ever need. The
+ * scheduler separately stops issuing once the staged queue is covered. */
+static int getwork_depth(struct pool *pool)
+{
+	int limit = opt_delaynet ? 5 : mining_threads + opt_queue;
+	double latency = pool->cgminer_pool_stats.getwork_wait_rolling;
+	int depth;
+
+	if (pool->proto != PLP_GETWORK)
+		return 1;
+	depth = 1 + (int)ceil(latency * work_consume_rate());
+	if (depth > limit)
+		depth = limit;
+	return depth;
+}
+
+/* Reserve a request slot for @pool, or wait a little for one to free up */
+static bool getwork_reserve(struct pool *pool)
+{
+	int depth = getwork_depth(pool);
+	bool ret = false;
+
+	mutex_lock(stgd_lock);
+	if (pool->getwork_inflight < depth && time(NULL) >= pool->getwork_retry) {
+		pool->getwork_inflight++;
+		total_getwork_inflight++;
+		ret = true;
+	} else {
+		struct timespec abstime = {
+			.tv_sec = time(NULL) + 1,
+		};
+
+		pthread_cond_timedwait(&gws_cond, stgd_lock, &abstime);
+	}
+	mutex_unlock(stgd_lock);
+
+	return ret;
+}
+
+/* Find the pool that currently has the highest priority */
+static struct pool *priority_pool(int choice)
+{
+	struct pool *ret = NULL;
+	int i;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (pool->prio == choice) {
+			ret = pool;
+			break;
+		}
+	}
+
+	if (unlikely(!ret)) {
+		applog(LOG_ERR, "WTF No pool %d found!", choice);
+		return pools[choice];
+	}
+	return ret;
+}
+
+int prioritize_pools(char *param, int *pid)
+{
+	char *ptr, *next;
+	int i, pr, prio = 0;
+
+	if (total_pools == 0) {
+		return MSG_NOPOOL;
+	}
+
+	if (param == NULL || *param == '\0') {
+		return MSG_MISPID;
+	}
+
+	bool pools_changed[total_pools];
+	int new_prio[total_pools];
+	for (i = 0; i < total_pools; ++i)
+		pools_changed[i] = false;
+
+	next = param;
+	while (next && *next) {
+		ptr = next;
+		next = strchr(ptr, ',');
+		if (next)
+			*(next++) = '\0';
+
+		i = atoi(ptr);
+		if (i < 0 || i >= total_pools) {
+			*pid = i;
+			return MSG_INVPID;
+		}
+
+		if (pools_changed[i]) {
+			*pid = i;
+			return MSG_DUPPID;
+		}
+
+		pools_changed[i] = true;
+		new_prio[i] = prio++;
+	}
+
+	// Only change them if no errors
+	for (i = 0; i < total_pools; i++) {
+		if (pools_changed[i])
+			pools[i]->prio = new_prio[i];
+	}
+
+	// In priority order, cycle through the unchanged pools and append them
+	for (pr = 0; pr < total_pools; pr++)
+		for (i = 0; i < total_pools; i++) {
+			if (!pools_changed[i] && pools[i]->prio == pr) {
+				pools[i]->prio = prio++;
+				pools_changed[i] = true;
+				break;
+			}
+		}
+
+	if (current_pool()->prio)
+		switch_pools(NULL);
+	else
+		notifier_wake(stratum_notifier);
+
+	return MSG_POOLPRIO;
+}
+
+void validate_pool_priorities(void)
+{
+	// TODO: this should probably do some sort of logging
+	int i, j;
+	bool used[total_pools];
+	bool valid[total_pools];
+
+	for (i = 0; i < total_pools; i++)
+		used[i] = valid[i] = false;
 
 	for (i = 0; i < total_pools; i++) {
 		if (pools[i]->prio >=0 && pools[i]->prio < total_pools) {
@@ -4310,16 +4798,26 @@ void switch_pools(struct pool *selected)
 
 	if (pool != last_pool)
 	{
+		struct work *work;
+
 		pool->block_id = 0;
 		if (pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
 			applog(LOG_WARNING, "Switching to %s", pool->rpc_url);
 		}
-	}
 
-	mutex_lock(&lp_lock);
-	pthread_cond_broadcast(&lp_cond);
-	mutex_unlock(&lp_lock);
+		/* A hot standby pool has work ready to go immediately */
+		mutex_lock(&pool->pool_lock);
+		work = pool->standby_work;
+		pool->standby_work = NULL;
+		mutex_unlock(&pool->pool_lock);
+		if (work) {
+			applog(LOG_DEBUG, "Staging standby work from pool %d", pool->pool_no);
+			stage_work(work);
+		}
+	}
 
+	/* Let the stratum reactor bring up or drop connections as needed */
+	notifier_wake(stratum_notifier);
 }
 
 static void discard_work(struct work *work)
@@ -4878,7 +5376,7 @@ void write_config(FILE *fcfg)
 		/* Write GPU device values */
 		fputs(",\n\"intensity\" : \"", fcfg);
 		for(i = 0; i < nDevs; i++)
-			fprintf(fcfg, gpus[i].dynamic ? "%sd" : "%s%d", i > 0 ? "," : "", gpus[i].intensity);
+			fprintf(fcfg, gpus[i].dynamic ? (gpus[i].dyn_throughput ? "%st" : "%sd") : "%s%d", i > 0 ? "," : "", gpus[i].intensity);
 		fputs("\",\n\"vectors\" : \"", fcfg);
 		for(i = 0; i < nDevs; i++)
 			fprintf(fcfg, "%s%d", i > 0 ? "," : "",
@@ -4986,6 +5484,7 @@ void write_config(FILE *fcfg)
 			if (opt->type & OPT_HASARG &&
 			   ((void *)opt->cb_arg == (void *)set_int_0_to_9999 ||
 			   (void *)opt->cb_arg == (void *)set_int_1_to_65535 ||
+			   (void *)opt->cb_arg == (void *)set_int_0_to_65535 ||
 			   (void *)opt->cb_arg == (void *)set_int_0_to_10 ||
 			   (void *)opt->cb_arg == (void *)set_int_1_to_10) &&
 			   opt->desc != opt_hidden &&
@@ -5015,6 +5514,10 @@ void write_config(FILE *fcfg)
 		fprintf(fcfg, ",\n\"kernel-path\" : \"%s\"", json_escape(kpath));
 		free(kpath);
 	}
+#ifdef HAVE_OPENCL
+	if (opt_kernel_cache && *opt_kernel_cache)
+		fprintf(fcfg, ",\n\"kernel-cache\" : \"%s\"", json_escape(opt_kernel_cache));
+#endif
 	if (schedstart.enable)
 		fprintf(fcfg, ",\n\"sched-time\" : \"%d:%d\"", schedstart.tm.tm_hour, schedstart.tm.tm_min);
 	if (schedstop.enable)
@@ -5100,6 +5603,7 @@ void zero_stats(void)
 	total_rejected = 0;
 	hw_errors = 0;
 	total_stale = 0;
+	total_filtered = 0;
 	total_discarded = 0;
 	total_bytes_xfer = 0;
 	new_blocks = 0;
@@ -5121,6 +5625,9 @@ void zero_stats(void)
 		pool->solved = 0;
 		pool->getwork_requested = 0;
 		pool->stale_shares = 0;
+		pool->filtered_shares = 0;
+		pool->notifies = pool->gen_works = 0;
+		pool->notify_cpu = pool->gen_work_cpu = 0;
 		pool->discarded_work = 0;
 		pool->getfail_occasions = 0;
 		pool->remotefail_occasions = 0;
@@ -5128,6 +5635,7 @@ void zero_stats(void)
 		pool->diff_accepted = 0;
 		pool->diff_rejected = 0;
 		pool->diff_stale = 0;
+		pool->diff_filtered = 0;
 		pool->last_share_diff = 0;
 		pool->cgminer_stats.start_tv = total_tv_start;
 		pool->cgminer_stats.getwork_calls = 0;
@@ -5149,9 +5657,16 @@ void zero_stats(void)
 		pool->cgminer_pool_stats.times_received = 0;
 		pool->cgminer_pool_stats.bytes_received = 0;
 		pool->cgminer_pool_stats.net_bytes_received = 0;
+
+		mutex_lock(&pool->pool_lock);
+		memset(pool->latency, 0, sizeof(pool->latency));
+		mutex_unlock(&pool->pool_lock);
 	}
 
 	zero_bestshare();
+#ifdef HAVE_OPENCL
+	opencl_profile_zero();
+#endif
 
 	mutex_lock(&hash_lock);
 	for (i = 0; i < total_devices; ++i) {
@@ -5783,18 +6298,190 @@ out_unlock:
 	}
 }
 
+/* Rebuilds as much of a work item as share_result and sharelog look at */
+static void stratum_share_work(struct pool *pool, const struct stratum_share *sshare, struct work *work)
+{
+	memset(work, 0, sizeof(*work));
+	memcpy(work->data, sshare->data, sizeof(work->data));
+	memcpy(work->target, sshare->target, sizeof(work->target));
+	memcpy(work->hash, sshare->hash, sizeof(work->hash));
+	work->thr_id = sshare->thr_id;
+	work->pool = pool;
+	work->stratum = true;
+	work->stale = sshare->stale;
+	work->block = sshare->block;
+	work->work_difficulty = sshare->work_difficulty;
+	work->tv_work_found = sshare->tv_work_found;
+}
+
+/* Whether a reject says the pool has seen the share before */
+static bool stratum_duplicate(json_t *err_val)
+{
+	json_t *code, *reason;
+
+	if (!err_val || !json_is_array(err_val))
+		return false;
+	code = json_array_get(err_val, 0);
+	reason = json_array_get(err_val, 1);
+	if (json_is_integer(code) && json_integer_value(code) == 22)
+		return true;
+	return json_is_string(reason) && strstr(json_string_value(reason), "uplicate");
+}
+
 static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
-  struct stratum_share *sshare) {
-    struct work *work = sshare->work;
+  struct pool *pool, struct stratum_share *sshare) {
+    struct work work;
     char hashshow[100], outhash[20];
-    ullong hashdata = le64toh(((ullong *) work->hash)[3]);
+    ullong hashdata;
+
+    stratum_share_work(pool, sshare, &work);
+
+    /* The pool answered the first submit before the connection went; that
+     * answer was lost, so this one says nothing about the share */
+    if(sshare->resubmitted && !json_is_true(res_val) && stratum_duplicate(err_val)) {
+        applog(LOG_INFO, "Pool %d had already seen resubmitted share %u",
+          pool->pool_no, sshare->id);
+        sharelog("duplicate", &work);
+        return;
+    }
 
+    hashdata = le64toh(((ullong *) work.hash)[3]);
     _bin2hex((char *) &outhash[0], (uchar *) &hashdata, 8);
 
-    sprintf(hashshow, "%sx0 Diff %.3f/%.3f%s", outhash, share_diff(work),
-      work->work_difficulty, work->block ? " BLOCK!" : "");
+    sprintf(hashshow, "%sx0 Diff %.3f/%.3f%s", outhash, share_diff(&work),
+      work.work_difficulty, work.block ? " BLOCK!" : "");
+
+    share_result(val, res_val, err_val, &work, hashshow, sshare->resubmitted, "");
+}
+
+/* Writes off shares the pool is never going to answer as stale */
+static void stratum_shares_lost(struct pool *pool, int lost, double diff_lost)
+{
+	mutex_lock(&stats_lock);
+	pool->stale_shares += lost;
+	total_stale += lost;
+	total_diff_stale += diff_lost;
+	pool->diff_stale += diff_lost;
+	mutex_unlock(&stats_lock);
+
+	mutex_lock(&submitting_lock);
+	total_submitting -= lost;
+	mutex_unlock(&submitting_lock);
+}
+
+static void stratum_share_drop(struct pool *pool, struct stratum_share *sshare, const char *disposition)
+{
+	if (sharelog_file) {
+		struct work work;
+
+		stratum_share_work(pool, sshare, &work);
+		sharelog(disposition, &work);
+	}
+	sshare->used = false;
+	pool->shares_inflight--;
+}
+
+/* Records a share about to be submitted to the pool and returns the id to
+ * submit it with. A share still occupying the slot has gone unanswered for
+ * STRATUM_SHARE_SLOTS submits since, so it is written off to make room */
+static unsigned int stratum_share_add(struct pool *pool, struct work *work)
+{
+	struct stratum_share *sshare;
+	unsigned int id;
+
+	if (unlikely(!pool->sshares)) {
+		pool->sshares = calloc(STRATUM_SHARE_SLOTS, sizeof(*pool->sshares));
+		if (unlikely(!pool->sshares))
+			quit(1, "Failed to calloc pool sshares in stratum_share_add");
+	}
+
+	id = pool->sshare_id++;
+	sshare = &pool->sshares[id & (STRATUM_SHARE_SLOTS - 1)];
+	if (unlikely(sshare->used)) {
+		applog(LOG_INFO, "Pool %d never answered share %u, counting it as stale",
+		       pool->pool_no, sshare->id);
+		stratum_share_drop(pool, sshare, "timeout");
+		stratum_shares_lost(pool, 1, sshare->work_difficulty);
+	}
+
+	sshare->id = id;
+	sshare->used = true;
+	sshare->block = work->block;
+	sshare->stale = work->stale;
+	/* Enough to submit the share again should the session be resumed */
+	sshare->resubmitted = false;
+	sshare->resumable = strlen(work->job_id) < sizeof(sshare->job_id) &&
+			    strlen(work->nonce2) < sizeof(sshare->nonce2) &&
+			    strlen(work->ntime) < sizeof(sshare->ntime);
+	if (sshare->resumable) {
+		strcpy(sshare->job_id, work->job_id);
+		strcpy(sshare->nonce2, work->nonce2);
+		strcpy(sshare->ntime, work->ntime);
+	}
+	sshare->thr_id = work->thr_id;
+	sshare->work_difficulty = work->work_difficulty;
+	memcpy(sshare->data, work->data, sizeof(sshare->data));
+	memcpy(sshare->target, work->target, sizeof(sshare->target));
+	memcpy(sshare->hash, work->hash, sizeof(sshare->hash));
+	sshare->tv_work_found = work->tv_work_found;
+	gettimeofday(&sshare->tv_submit, NULL);
+	pool->shares_inflight++;
+
+	pool_latency(pool, LATENCY_FOUND_SUBMIT, &work->tv_work_found, &sshare->tv_submit);
+
+	return id;
+}
+
+/* Takes the share matching a submit id out of the pool's table. The slot
+ * stays valid until the next share is added */
+static struct stratum_share *stratum_share_take(struct pool *pool, json_int_t id)
+{
+	struct stratum_share *sshare;
+	struct timeval now;
+
+	if (!pool->sshares || id < 0 || id > UINT_MAX)
+		return NULL;
+	sshare = &pool->sshares[id & (STRATUM_SHARE_SLOTS - 1)];
+	if (!sshare->used || sshare->id != id)
+		return NULL;
+
+	sshare->used = false;
+	pool->shares_inflight--;
+
+	mutex_lock(&submitting_lock);
+	--total_submitting;
+	mutex_unlock(&submitting_lock);
+
+	gettimeofday(&now, NULL);
+	pool_latency(pool, LATENCY_SUBMIT_REPLY, &sshare->tv_submit, &now);
+
+	return sshare;
+}
+
+/* Handles the common {"id": n, "result": true, "error": null} share
+ * acceptance without building a json tree. Anything else, including
+ * rejects which carry a reason, is left to parse_stratum_response */
+static bool parse_stratum_response_fast(struct pool *pool, struct stratum_msg *msg)
+{
+	struct stratum_share *sshare;
+	char *end;
+	long id;
+
+	if (msg->method || !msg->id || !json_literal(msg->result, "true") ||
+	    (msg->error && !json_literal(msg->error, "null")))
+		return false;
+	id = strtol(msg->id, &end, 10);
+	if (end == msg->id || !json_literal(end, ""))
+		return false;
+
+	sshare = stratum_share_take(pool, id);
+	if (!sshare) {
+		applog(LOG_NOTICE, "Accepted untracked stratum share from pool %d", pool->pool_no);
+		return true;
+	}
+	stratum_share_result(NULL, json_true(), NULL, pool, sshare);
 
-    share_result(val, res_val, err_val, work, hashshow, false, "");
+	return true;
 }
 
 /* Parses stratum json responses and tries to find the id that the request
@@ -5805,7 +6492,7 @@ bool parse_stratum_response(struct pool *pool, char *s)
 	struct stratum_share *sshare;
 	json_error_t err;
 	bool ret = false;
-	int id;
+	json_int_t id;
 
 	val = JSON_LOADS(s, &err);
 	if (!val) {
@@ -5833,6 +6520,20 @@ bool parse_stratum_response(struct pool *pool, char *s)
 	}
 
 	if (!json_is_integer(id_val)) {
+		if (json_is_string(id_val) && !strcmp(json_string_value(id_val), "xnsub")) {
+			if (!json_is_true(res_val))
+				applog(LOG_INFO, "Pool %d does not support extranonce subscription", pool->pool_no);
+			ret = true;
+			goto out;
+		}
+		if (json_is_string(id_val) && !strcmp(json_string_value(id_val), "suggest")) {
+			/* Pools are free to ignore the suggestion; they will
+			 * send set_difficulty if they take it */
+			if (!json_is_true(res_val))
+				applog(LOG_DEBUG, "Pool %d did not take suggested difficulty", pool->pool_no);
+			ret = true;
+			goto out;
+		}
 		if (json_is_string(id_val)
 		 && !strncmp(json_string_value(id_val), "txlist", 6)
 		 && !strcmp(json_string_value(id_val) + 6, pool->swork.job_id)
@@ -5866,11 +6567,7 @@ fishy:
 	}
 
 	id = json_integer_value(id_val);
-	mutex_lock(&sshare_lock);
-	HASH_FIND_INT(stratum_shares, &id, sshare);
-	if (sshare)
-		HASH_DEL(stratum_shares, sshare);
-	mutex_unlock(&sshare_lock);
+	sshare = stratum_share_take(pool, id);
 	if (!sshare) {
 		if (json_is_true(res_val))
 			applog(LOG_NOTICE, "Accepted untracked stratum share from pool %d", pool->pool_no);
@@ -5878,14 +6575,7 @@ fishy:
 			applog(LOG_NOTICE, "Rejected untracked stratum share from pool %d", pool->pool_no);
 		goto out;
 	}
-	else {
-		mutex_lock(&submitting_lock);
-		--total_submitting;
-		mutex_unlock(&submitting_lock);
-	}
-	stratum_share_result(val, res_val, err_val, sshare);
-	free_work(sshare->work);
-	free(sshare);
+	stratum_share_result(val, res_val, err_val, pool, sshare);
 
 	ret = true;
 out:
@@ -5910,39 +6600,23 @@ static void shutdown_stratum(struct pool *pool)
 
 static void clear_stratum_shares(struct pool *pool)
 {
-	struct stratum_share *sshare, *tmpshare;
-	struct work *work;
+	struct stratum_share *sshare;
 	int cleared = 0;
 	double diff_stale = 0;
+	int i;
 
-	mutex_lock(&sshare_lock);
-	HASH_ITER(hh, stratum_shares, sshare, tmpshare) {
-		if (sshare->work->pool == pool) {
-			HASH_DEL(stratum_shares, sshare);
-			
-			work = sshare->work;
-			sharelog("disconnect", work);
-			diff_stale += work->work_difficulty;
-			
-			free_work(sshare->work);
-			free(sshare);
-			cleared++;
-		}
+	for (i = 0; pool->shares_inflight && i < STRATUM_SHARE_SLOTS; i++) {
+		sshare = &pool->sshares[i];
+		if (!sshare->used)
+			continue;
+		diff_stale += sshare->work_difficulty;
+		stratum_share_drop(pool, sshare, "disconnect");
+		cleared++;
 	}
-	mutex_unlock(&sshare_lock);
 
 	if (cleared) {
 		applog(LOG_WARNING, "Lost %d shares due to stratum disconnect on pool %d", cleared, pool->pool_no);
-		mutex_lock(&stats_lock);
-		pool->stale_shares += cleared;
-		total_stale += cleared;
-		total_diff_stale += diff_stale;
-		pool->diff_stale += diff_stale;
-		mutex_unlock(&stats_lock);
-
-		mutex_lock(&submitting_lock);
-		total_submitting -= cleared;
-		mutex_unlock(&submitting_lock);
+		stratum_shares_lost(pool, cleared, diff_stale);
 	}
 }
 
@@ -5962,6 +6636,33 @@ static void clear_pool_work(struct pool *pool)
 	mutex_unlock(stgd_lock);
 }
 
+/* The first opt_standby_pools usable backup stratum pools, in priority order,
+ * are kept subscribed and authorised with a current job so that failing over
+ * to one of them needs no handshake */
+static bool pool_standby(struct pool *pool)
+{
+	struct pool *cp = current_pool();
+	int i, standby = 0;
+
+	if (!opt_standby_pools || pool == cp || !pool->has_stratum)
+		return false;
+
+	for (i = 0; i < total_pools && standby < opt_standby_pools; i++) {
+		struct pool *other = priority_pool(i);
+
+		if (other == cp || !other->has_stratum || other->enabled != POOL_ENABLED)
+			continue;
+		if (other == pool)
+			return true;
+		/* Dead pools are reconnecting anyway and would be no use to
+		 * fail over to, so they do not take up a standby slot */
+		if (!other->idle)
+			standby++;
+	}
+
+	return false;
+}
+
 /* We only need to maintain a secondary pool connection when we need the
  * capacity to get work from the backup pools while still on the primary */
 static bool cnx_needed(struct pool *pool)
@@ -5986,6 +6687,9 @@ static bool cnx_needed(struct pool *pool)
 	if (!cp->has_stratum && (!opt_fail_only || !cp->hdr_path))
 		return true;
 
+	if (pool_standby(pool))
+		return true;
+
 	/* Keep stratum pools alive until at least a minute after their last
 	 * generated work, to ensure we have a channel for any submissions */
 	if (pool->has_stratum && difftime(time(NULL), pool->last_work_time) < 60)
@@ -5994,10 +6698,31 @@ static bool cnx_needed(struct pool *pool)
 	return false;
 }
 
-static void wait_lpcurrent(struct pool *pool);
 static void pool_resus(struct pool *pool);
 static void gen_stratum_work(struct pool *pool, struct work *work);
 
+/* Keeps one work item from a standby pool's latest job ready to be staged the
+ * moment we fail over to it, and drops it once the pool stops qualifying.
+ * Refreshed on each notify, and by the reactor when pool switches or priority
+ * changes move the pool in or out of the standby set */
+static void stratum_standby_work(struct pool *pool)
+{
+	struct work *work = NULL, *old;
+
+	if (pool->stratum_active && pool->stratum_notify && pool_standby(pool)) {
+		work = make_work();
+		gen_stratum_work(pool, work);
+	}
+
+	mutex_lock(&pool->pool_lock);
+	old = pool->standby_work;
+	pool->standby_work = work;
+	mutex_unlock(&pool->pool_lock);
+
+	if (old)
+		free_work(old);
+}
+
 static void stratum_resumed(struct pool *pool)
 {
 	if (!pool->stratum_notify)
@@ -6008,162 +6733,843 @@ static void stratum_resumed(struct pool *pool)
 	}
 }
 
-/* One stratum thread per pool that has stratum waits on the socket checking
- * for new messages and for the integrity of the socket connection. We reset
- * the connection based on the integrity of the receive side only as the send
- * side will eventually expire data it fails to send. */
-static void *stratum_thread(void *userdata)
+/* All stratum pools share a single network thread, the stratum reactor, which
+ * waits on every pool socket at once along with the timers of each
+ * connection. It brings connections up without blocking, runs the subscribe
+ * and authorise handshake, parses everything the pools send and writes the
+ * shares handed over by the submit_work thread. We reset a connection based
+ * on the integrity of the receive side only as the send side will eventually
+ * expire data it fails to send. */
+#define STRATUM_CONNECT_TIMEOUT 30
+#define STRATUM_HANDSHAKE_TIMEOUT 60
+#define STRATUM_IDLE_TIMEOUT 120
+#define STRATUM_MAX_BACKOFF 30
+#define STRATUM_SUGGEST_INTERVAL 60
+#define STRATUM_RESUME_WINDOW 30
+#define STRATUM_SHARE_TIMEOUT 120
+
+#define STRATUM_WANT_READ 1
+#define STRATUM_WANT_WRITE 2
+
+#ifdef HAVE_SYS_EPOLL_H
+static int stratum_epfd;
+#endif
+
+static void stratum_timer(struct pool *pool, struct timeval *now, int secs)
+{
+	pool->tv_stratum_timer.tv_sec = now->tv_sec + secs;
+	pool->tv_stratum_timer.tv_usec = now->tv_usec;
+}
+
+static bool stratum_timer_due(struct pool *pool, struct timeval *now)
+{
+	return pool->tv_stratum_timer.tv_sec && tdiff(&pool->tv_stratum_timer, now) <= 0;
+}
+
+/* Tells the poller which events we want to hear about on the pool socket */
+static void stratum_watch(struct pool *pool, int events)
+{
+	SOCKETTYPE sock = events ? pool->sock : INVSOCK;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev = {
+		.events = ((events & STRATUM_WANT_READ) ? EPOLLIN : 0) |
+			  ((events & STRATUM_WANT_WRITE) ? EPOLLOUT : 0),
+		.data.ptr = pool,
+	};
+
+	if (pool->stratum_watched != INVSOCK && pool->stratum_watched != sock)
+		epoll_ctl(stratum_epfd, EPOLL_CTL_DEL, pool->stratum_watched, &ev);
+	if (sock != INVSOCK) {
+		if (pool->stratum_watched != sock)
+			epoll_ctl(stratum_epfd, EPOLL_CTL_ADD, sock, &ev);
+		else if (pool->stratum_events != events &&
+			 epoll_ctl(stratum_epfd, EPOLL_CTL_MOD, sock, &ev) && errno == ENOENT)
+			epoll_ctl(stratum_epfd, EPOLL_CTL_ADD, sock, &ev);
+	}
+#endif
+	pool->stratum_watched = sock;
+	pool->stratum_events = events;
+}
+
+/* Hands a share over to the stratum reactor to be written to its pool */
+static void stratum_queue_share(struct submit_work_state *sws)
+{
+	struct pool *pool = sws->work->pool;
+
+	mutex_lock(&pool->stratum_lock);
+	sws->next = pool->sws_waiting_on_sock;
+	pool->sws_waiting_on_sock = sws;
+	mutex_unlock(&pool->stratum_lock);
+
+	notifier_wake(stratum_notifier);
+}
+
+/* Formats a mining.submit into the pool's outgoing buffer */
+static void stratum_queue_submit(struct pool *pool, const char *job_id, const char *nonce2,
+				 const char *ntime, const unsigned char *data, unsigned int id)
+{
+	char s[1024], noncehex[9];
+	uint32_t nonce;
+	int len;
+
+	if (opt_neoscrypt)
+		nonce = htobe32(*((uint32_t *)(data + 76)));
+	else
+		nonce = *((uint32_t *)(data + 76));
+	_bin2hex(noncehex, (const uchar *)&nonce, 4);
+	len = snprintf(s, sizeof(s), "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %u, \"method\": \"mining.submit\"}",
+		pool->rpc_user, job_id, nonce2, ntime, noncehex, id);
+	if (unlikely(len >= (int)sizeof(s)))
+		len = sizeof(s) - 1;
+
+	applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->stratum_url, s);
+
+	stratum_queue_line(pool, s, len);
+}
+
+/* Writes off shares the pool has left unanswered for too long. Shares are
+ * added in id order, so only the oldest one in flight needs looking at */
+static void stratum_expire_shares(struct pool *pool, struct timeval *now)
+{
+	struct stratum_share *sshare;
+
+	if (pool->sshare_id - pool->sshare_oldest > STRATUM_SHARE_SLOTS)
+		pool->sshare_oldest = pool->sshare_id - STRATUM_SHARE_SLOTS;
+	while (pool->shares_inflight && pool->sshare_oldest != pool->sshare_id) {
+		sshare = &pool->sshares[pool->sshare_oldest & (STRATUM_SHARE_SLOTS - 1)];
+		if (sshare->used && sshare->id == pool->sshare_oldest) {
+			if (tdiff(now, &sshare->tv_submit) < STRATUM_SHARE_TIMEOUT)
+				return;
+			applog(LOG_INFO, "Pool %d never answered share %u, counting it as stale",
+			       pool->pool_no, sshare->id);
+			stratum_share_drop(pool, sshare, "timeout");
+			stratum_shares_lost(pool, 1, sshare->work_difficulty);
+		}
+		pool->sshare_oldest++;
+	}
+	pool->sshare_oldest = pool->sshare_id;
+}
+
+/* Submits again, oldest first, every share whose answer was lost with the
+ * connection. The pool may well have seen some of them already and reject
+ * those as duplicates, which stratum_share_result does not count against it */
+static void stratum_resubmit_shares(struct pool *pool)
+{
+	struct stratum_share *sshare;
+	unsigned int id;
+	int resent = 0, i;
+
+	id = pool->sshare_id - STRATUM_SHARE_SLOTS;
+	for (i = 0; pool->shares_inflight && i < STRATUM_SHARE_SLOTS; i++, id++) {
+		sshare = &pool->sshares[id & (STRATUM_SHARE_SLOTS - 1)];
+		if (!sshare->used || sshare->id != id)
+			continue;
+		if (!sshare->resumable) {
+			stratum_share_drop(pool, sshare, "disconnect");
+			stratum_shares_lost(pool, 1, sshare->work_difficulty);
+			continue;
+		}
+		gettimeofday(&sshare->tv_submit, NULL);
+		sshare->resubmitted = true;
+		stratum_queue_submit(pool, sshare->job_id, sshare->nonce2, sshare->ntime, sshare->data, sshare->id);
+		resent++;
+	}
+	if (resent)
+		applog(LOG_INFO, "Resubmitting %d shares to pool %d", resent, pool->pool_no);
+}
+
+/* Throws away the shares waiting on a connection that is not coming back */
+static void stratum_discard_shares(struct pool *pool)
+{
+	struct submit_work_state *sws, *next;
+	unsigned tsreduce = 0;
+
+	mutex_lock(&pool->stratum_lock);
+	sws = pool->sws_waiting_on_sock;
+	pool->sws_waiting_on_sock = NULL;
+	mutex_unlock(&pool->stratum_lock);
+
+	for ( ; sws; sws = next) {
+		next = sws->next;
+		applog(LOG_WARNING, "Stratum pool %u died while share waiting to submit, discarding", pool->pool_no);
+		submit_discard_share2("disconnect", sws->work);
+		++tsreduce;
+		free_sws(sws);
+	}
+
+	if (tsreduce) {
+		mutex_lock(&submitting_lock);
+		total_submitting -= tsreduce;
+		mutex_unlock(&submitting_lock);
+	}
+}
+
+/* Formats every share waiting on the pool into its outgoing buffer and
+ * writes the lot out together, so a burst of shares costs one send rather
+ * than one per share */
+static void stratum_send_shares(struct pool *pool)
+{
+	struct submit_work_state *sws, *next, *queue = NULL;
+	int queued = 0;
+
+	if (pool->stratum_state != STRATUM_ACTIVE) {
+		stratum_discard_shares(pool);
+		return;
+	}
+
+	mutex_lock(&pool->stratum_lock);
+	sws = pool->sws_waiting_on_sock;
+	pool->sws_waiting_on_sock = NULL;
+	mutex_unlock(&pool->stratum_lock);
+
+	/* Shares are pushed on as they arrive, so turn the list around to
+	 * submit them in the order they were found */
+	for ( ; sws; sws = next) {
+		next = sws->next;
+		sws->next = queue;
+		queue = sws;
+	}
+
+	for (sws = queue; sws; sws = next) {
+		struct work *work = sws->work;
+		unsigned int id;
+
+		next = sws->next;
+		id = stratum_share_add(pool, work);
+		stratum_queue_submit(pool, work->job_id, work->nonce2, work->ntime, work->data, id);
+		++queued;
+		free_sws(sws);
+	}
+
+	if (pool->sendbuf_len) {
+		if (likely(stratum_flush(pool))) {
+			if (queued && pool_tclear(pool, &pool->submit_fail))
+				applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
+		} else if (!pool_tset(pool, &pool->submit_fail)) {
+			applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
+			total_ro++;
+			pool->remotefail_occasions++;
+		}
+	}
+}
+
+static void *stratum_proxy_thread(void *userdata)
 {
 	struct pool *pool = (struct pool *)userdata;
+	int ret;
 
 	pthread_detach(pthread_self());
+	RenameThread("stratum_proxy");
 
-	char threadname[20];
-	snprintf(threadname, 20, "stratum%u", pool->pool_no);
-	RenameThread(threadname);
+	ret = connect_stratum_curl(pool) ? 1 : -1;
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_proxied = ret;
+	mutex_unlock(&pool->stratum_lock);
+
+	notifier_wake(stratum_notifier);
+	return NULL;
+}
 
-	srand(time(NULL) + (intptr_t)userdata);
+static void *stratum_resolve_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	struct addrinfo *res;
 
-	while (42) {
-		struct timeval timeout;
-		fd_set rd;
-		char *s;
-		int sock;
+	pthread_detach(pthread_self());
+	RenameThread("stratum_resolve");
 
-		if (unlikely(!pool->has_stratum))
-			break;
+	res = resolve_stratum(pool);
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_addr = res;
+	pool->stratum_resolved = res ? 1 : -1;
+	mutex_unlock(&pool->stratum_lock);
 
-		sock = pool->sock;
-		
-		/* Check to see whether we need to maintain this connection
-		 * indefinitely or just bring it up when we switch to this
-		 * pool */
-		if (sock == INVSOCK || (!sock_full(pool) && !cnx_needed(pool))) {
-			suspend_stratum(pool);
-			clear_stratum_shares(pool);
-			clear_pool_work(pool);
-
-			wait_lpcurrent(pool);
-			if (!initiate_stratum(pool) || !auth_stratum(pool)) {
-				pool_died(pool);
-				while (!initiate_stratum(pool) || !auth_stratum(pool)) {
-					if (pool->removed)
-						goto out;
-					sleep(30);
-				}
+	notifier_wake(stratum_notifier);
+	return NULL;
+}
+
+/* Closes whatever connection the pool has, leaving it down */
+static void stratum_drop(struct pool *pool)
+{
+	stratum_watch(pool, 0);
+	if (pool->sock != INVSOCK || pool->stratum_curl)
+		suspend_stratum(pool);
+	pool->stratum_state = STRATUM_DOWN;
+	pool->tv_stratum_timer.tv_sec = 0;
+	pool->suggested_diff = 0;
+	pool->suggest_time = 0;
+	stratum_standby_work(pool);
+}
+
+/* A connection attempt failed, so try again after backing off */
+static void stratum_failed(struct pool *pool, struct timeval *now)
+{
+	stratum_drop(pool);
+	pool_died(pool);
+
+	if (pool->stratum_backoff < 1)
+		pool->stratum_backoff = 1;
+	else if ((pool->stratum_backoff *= 2) > STRATUM_MAX_BACKOFF)
+		pool->stratum_backoff = STRATUM_MAX_BACKOFF;
+	applog(LOG_DEBUG, "Retrying stratum connection to pool %d in %d seconds",
+	       pool->pool_no, pool->stratum_backoff);
+	stratum_timer(pool, now, pool->stratum_backoff);
+}
+
+/* The connection is gone for good, and with it all tracked submitted
+ * shares and any work based on the old session */
+static void stratum_session_lost(struct pool *pool)
+{
+	pool->stratum_resume_until = 0;
+	pool->submit_old = false;
+	++pool->work_restart_id;
+
+	stratum_discard_shares(pool);
+	clear_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
+}
+
+/* Picks up where an interrupted connection left off once the new one is
+ * authorised, provided the pool resumed the session */
+static void stratum_resume(struct pool *pool)
+{
+	if (!pool->session_resumed) {
+		applog(LOG_INFO, "Pool %d did not resume the stratum session", pool->pool_no);
+		stratum_session_lost(pool);
+		return;
+	}
+
+	applog(LOG_NOTICE, "Resumed stratum session on pool %d", pool->pool_no);
+	pool->stratum_resume_until = 0;
+	stratum_resubmit_shares(pool);
+}
+
+/* An established connection went away, so make any pending work and shares
+ * stale and reconnect straight away */
+static void stratum_interrupted(struct pool *pool, struct timeval *now)
+{
+	applog(LOG_INFO, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
+
+	mutex_lock(&pool->stratum_lock);
+	pool->stratum_active = pool->stratum_notify = false;
+	mutex_unlock(&pool->stratum_lock);
+	stratum_drop(pool);
+
+	/* With a session to resume, hold on to the shares awaiting an answer
+	 * and the work we have for a little while, since the pool may let us
+	 * carry on as if nothing happened */
+	if (pool->sessionid)
+		pool->stratum_resume_until = now->tv_sec + STRATUM_RESUME_WINDOW;
+	else
+		stratum_session_lost(pool);
+
+	pool->tv_stratum_timer = *now;
+}
+
+static void stratum_connect(struct pool *pool, struct timeval *now)
+{
+	pthread_t pth;
+
+	pool->stratum_reconnect = false;
+
+	if (pool->rpc_proxy || opt_socks_proxy) {
+		/* curl knows how to talk to proxies but only blocking, so
+		 * this one connection is made by a short lived helper */
+		pool->stratum_proxied = 0;
+		pool->stratum_state = STRATUM_PROXYING;
+		pool->tv_stratum_timer.tv_sec = 0;
+		if (unlikely(pthread_create(&pth, NULL, stratum_proxy_thread, (void *)pool)))
+			quit(1, "Failed to create stratum proxy thread");
+		return;
+	}
+
+	/* Name lookups block, and a slow one must not hold up the other
+	 * pools, so the address is looked up by a short lived helper too and
+	 * only the connect is done here, see stratum_resolved() */
+	pool->stratum_resolved = 0;
+	pool->stratum_state = STRATUM_RESOLVING;
+	pool->tv_stratum_timer.tv_sec = 0;
+	if (unlikely(pthread_create(&pth, NULL, stratum_resolve_thread, (void *)pool)))
+		quit(1, "Failed to create stratum resolver thread");
+}
+
+/* Starts connecting once the helper has looked up the pool's address.
+ * Returns false while the lookup is still going */
+static bool stratum_resolved(struct pool *pool, struct timeval *now)
+{
+	struct addrinfo *res;
+	int resolved;
+
+	mutex_lock(&pool->stratum_lock);
+	resolved = pool->stratum_resolved;
+	res = pool->stratum_addr;
+	pool->stratum_addr = NULL;
+	mutex_unlock(&pool->stratum_lock);
+	if (!resolved)
+		return false;
+
+	if (resolved > 0 && connect_stratum_start(pool, res)) {
+		pool->stratum_state = STRATUM_CONNECTING;
+		stratum_timer(pool, now, STRATUM_CONNECT_TIMEOUT);
+	} else
+		stratum_failed(pool, now);
+	if (res)
+		freeaddrinfo(res);
+	return true;
+}
+
+static void stratum_subscribe(struct pool *pool, struct timeval *now)
+{
+	if (!send_subscribe(pool)) {
+		applog(LOG_DEBUG, "Failed to send mining.subscribe to pool %d", pool->pool_no);
+		stratum_failed(pool, now);
+		return;
+	}
+	pool->stratum_state = STRATUM_SUBSCRIBING;
+	stratum_timer(pool, now, STRATUM_HANDSHAKE_TIMEOUT);
+}
+
+static void stratum_handle_line(struct pool *pool, char *s)
+{
+	int getworks = pool->getwork_requested;
+	double cpu = thread_cputime();
+	struct stratum_msg msg;
+
+	/* Check this pool hasn't died while being a backup pool and
+	 * has not had its idle flag cleared */
+	stratum_resumed(pool);
+
+	/* Notifies, difficulty changes and accepted shares are handled from a
+	 * single scan of the line; everything else goes through jansson */
+	if (!(stratum_scan(s, &msg) &&
+	      (parse_method_fast(pool, &msg) || parse_stratum_response_fast(pool, &msg))) &&
+	    !parse_method(pool, s) && !parse_stratum_response(pool, s))
+		applog(LOG_INFO, "Unknown stratum msg: %s", s);
+	if (pool->swork.clean) {
+		struct work *work = make_work();
+
+		/* Generate a single work item to update the current
+		 * block database */
+		pool->swork.clean = false;
+		gen_stratum_work(pool, work);
+
+		/* Try to extract block height from coinbase scriptSig */
+		unsigned char *cb_height = &pool->swork.coinbase1[4 /*version*/ + 1 /*txin count*/ + 36 /*prevout*/ + 1 /*scriptSig len*/ + 1 /*push opcode*/];
+		if (pool->swork.cb1_len >= 46 && cb_height[-1] == 3) {
+
+                    uint block_id;
+                    if(opt_neoscrypt)
+                      block_id = le32toh(((uint *) work->data)[1]);
+                    else
+                      block_id = be32toh(((uint *) work->data)[1]);
+
+			uint32_t height = 0;
+			memcpy(&height, cb_height, 3);
+			height = le32toh(height);
+			have_block_height(block_id, height);
+		}
+
+		++pool->work_restart_id;
+		if (test_work_current(work)) {
+			/* Only accept a work restart if this stratum
+			 * connection is from the current pool */
+			if (pool == current_pool()) {
+				restart_threads();
+				applog(LOG_NOTICE, "Stratum from pool %d requested work restart", pool->pool_no);
 			}
+		} else
+			applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
+		free_work(work);
+	}
+
+	/* Every notify counts as a getwork */
+	if (pool->getwork_requested != getworks) {
+		stratum_standby_work(pool);
+		stratumsrv_update();
+
+		cpu = thread_cputime() - cpu;
+		mutex_lock(&pool->pool_lock);
+		pool->notifies++;
+		pool->notify_cpu += cpu;
+		mutex_unlock(&pool->pool_lock);
+	}
+}
+
+/* Works out the share difficulty to ask stratum pools for: about
+ * --suggest-diff-rate shares a minute at the hashrate measured across all
+ * devices, but never less than --min-share-diff. Returns 0 until there is
+ * something worth asking for */
+static double suggest_share_diff(void)
+{
+	double diff = 0;
+
+	if (opt_suggest_diff_rate) {
+		double hashrate = 0;
+		int i;
+
+		for (i = 0; i < total_devices; i++)
+			hashrate += devices[i]->rolling;
+		if (hashrate <= 0)
+			return 0;
+		diff = hashrate_to_utility(hashrate * 1e6) / opt_suggest_diff_rate;
+	}
+	if (diff < opt_min_share_diff)
+		diff = opt_min_share_diff;
+
+	return diff;
+}
+
+/* Sends mining.suggest_difficulty on a new connection and again whenever
+ * the difficulty we want moves by more than a fifth */
+static void stratum_suggest(struct pool *pool, struct timeval *now)
+{
+	double diff;
+
+	if (now->tv_sec < pool->suggest_time)
+		return;
+
+	diff = suggest_share_diff();
+	if (diff <= 0) {
+		/* No hashrate measured yet */
+		pool->suggest_time = now->tv_sec + 5;
+		return;
+	}
+	pool->suggest_time = now->tv_sec + STRATUM_SUGGEST_INTERVAL;
+	if (pool->suggested_diff > 0 && fabs(diff - pool->suggested_diff) < pool->suggested_diff / 5)
+		return;
+
+	applog(LOG_INFO, "Suggesting share difficulty %g to pool %d", diff, pool->pool_no);
+	if (stratum_suggest_diff(pool, diff))
+		pool->suggested_diff = diff;
+}
+
+/* Works through whatever complete lines the pool has sent so far */
+static void stratum_drain(struct pool *pool, struct timeval *now)
+{
+	char *s;
+
+	while (pool->stratum_state >= STRATUM_SUBSCRIBING && (s = next_line(pool))) {
+		switch (pool->stratum_state) {
+			case STRATUM_SUBSCRIBING:
+				if (!stratum_subscribed(pool, s) || !send_auth(pool)) {
+					stratum_failed(pool, now);
+					return;
+				}
+				pool->stratum_state = STRATUM_AUTHORISING;
+				stratum_timer(pool, now, STRATUM_HANDSHAKE_TIMEOUT);
+				break;
+			case STRATUM_AUTHORISING:
+				/* Parse all data in the queue and anything left
+				 * should be auth */
+				if (parse_method(pool, s))
+					break;
+				if (!stratum_authorised(pool, s)) {
+					stratum_failed(pool, now);
+					return;
+				}
+				pool->stratum_backoff = 0;
+				pool->stratum_state = STRATUM_ACTIVE;
+				stratum_timer(pool, now, STRATUM_IDLE_TIMEOUT);
+				if (pool->stratum_resume_until)
+					stratum_resume(pool);
+				break;
+			default:
+				/* If we fail to receive any notify messages
+				 * for 2 minutes we assume the connection has
+				 * been dropped and treat this pool as dead */
+				stratum_timer(pool, now, STRATUM_IDLE_TIMEOUT);
+				stratum_handle_line(pool, s);
+				break;
 		}
+	}
+}
 
-		FD_ZERO(&rd);
-		FD_SET(sock, &rd);
-		timeout.tv_sec = 120;
-		timeout.tv_usec = 0;
+static void stratum_event(struct pool *pool, bool readable, bool writable, struct timeval *now)
+{
+	switch (pool->stratum_state) {
+		case STRATUM_CONNECTING:
+			if (connect_stratum_done(pool))
+				stratum_subscribe(pool, now);
+			else
+				stratum_failed(pool, now);
+			return;
+		case STRATUM_SUBSCRIBING:
+		case STRATUM_AUTHORISING:
+		case STRATUM_ACTIVE:
+			break;
+		default:
+			return;
+	}
 
-		/* If we fail to receive any notify messages for 2 minutes we
-		 * assume the connection has been dropped and treat this pool
-		 * as dead */
-		if (!sock_full(pool) && select(sock + 1, &rd, NULL, NULL, &timeout) < 1)
-			s = NULL;
+	if (writable)
+		stratum_send_shares(pool);
+	if (!readable)
+		return;
+	if (!sock_fill(pool)) {
+		if (pool->stratum_state == STRATUM_ACTIVE)
+			stratum_interrupted(pool, now);
 		else
-			s = recv_line(pool);
-		if (!s) {
-			if (!pool->has_stratum)
-				break;
+			stratum_failed(pool, now);
+		return;
+	}
+	stratum_drain(pool, now);
+}
 
-			applog(LOG_INFO, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
+/* Moves the pool's connection along on timers and changed circumstances and
+ * works out what to wait for next */
+static void stratum_service(struct pool *pool, struct timeval *now, int *timeout_ms)
+{
+	int events = 0;
 
-			// Make any pending work/shares stale
-			mutex_lock(&pool->stratum_lock);
-			pool->stratum_active = pool->stratum_notify = false;
-			pool->sock = INVSOCK;
-			mutex_unlock(&pool->stratum_lock);
-			pool->submit_old = false;
-			++pool->work_restart_id;
+	if (pool->stratum_state == STRATUM_PROXYING) {
+		int proxied;
 
-			/* If the socket to our stratum pool disconnects, all
-			 * tracked submitted shares are lost and we will leak
-			 * the memory if we don't discard their records. */
-			clear_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
+		mutex_lock(&pool->stratum_lock);
+		proxied = pool->stratum_proxied;
+		mutex_unlock(&pool->stratum_lock);
+		if (!proxied)
+			return;
+		if (proxied > 0)
+			stratum_subscribe(pool, now);
+		else
+			stratum_failed(pool, now);
+	}
 
-			if (initiate_stratum(pool) && auth_stratum(pool))
-				continue;
+	if (pool->stratum_state == STRATUM_RESOLVING && !stratum_resolved(pool, now))
+		return;
 
-			shutdown_stratum(pool);
-			pool_died(pool);
+	if (unlikely(!pool->has_stratum || pool->removed)) {
+		stratum_drop(pool);
+		if (pool->stratum_resume_until)
+			stratum_session_lost(pool);
+		stratum_send_shares(pool);
+		pool->stratum_state = STRATUM_NONE;
+		return;
+	}
+
+	if (pool->stratum_resume_until && pool->stratum_state != STRATUM_ACTIVE &&
+	    now->tv_sec >= pool->stratum_resume_until) {
+		applog(LOG_INFO, "Gave up resuming stratum session on pool %d", pool->pool_no);
+		stratum_session_lost(pool);
+	}
+
+	switch (pool->stratum_state) {
+		case STRATUM_DOWN:
+			/* Check to see whether we need to maintain this
+			 * connection indefinitely or just bring it up when we
+			 * switch to this pool */
+			if (pool->tv_stratum_timer.tv_sec ? stratum_timer_due(pool, now) : cnx_needed(pool))
+				stratum_connect(pool, now);
 			break;
-		}
+		case STRATUM_ACTIVE:
+			stratum_drain(pool, now);
+			if (pool->stratum_state != STRATUM_ACTIVE)
+				break;
+			stratum_expire_shares(pool, now);
+			if (stratum_timer_due(pool, now)) {
+				stratum_interrupted(pool, now);
+				break;
+			}
+			if (pool->stratum_reconnect) {
+				stratum_drop(pool);
+				stratum_connect(pool, now);
+				break;
+			}
+			if (!cnx_needed(pool)) {
+				stratum_drop(pool);
+				clear_stratum_shares(pool);
+				clear_pool_work(pool);
+				free(pool->sessionid);
+				pool->sessionid = NULL;
+				break;
+			}
+			if (opt_suggest_diff_rate || opt_min_share_diff > 0)
+				stratum_suggest(pool, now);
+			if (pool->stratum_notify) {
+				bool standby;
 
-		/* Check this pool hasn't died while being a backup pool and
-		 * has not had its idle flag cleared */
-		stratum_resumed(pool);
+				mutex_lock(&pool->pool_lock);
+				standby = pool->standby_work != NULL;
+				mutex_unlock(&pool->pool_lock);
+				if (standby != pool_standby(pool))
+					stratum_standby_work(pool);
+			}
+			if (pool->swork.transparency_time != (time_t)-1 && difftime(time(NULL), pool->swork.transparency_time) > 21.09375) {
+				// More than 4 timmills past since requested transactions
+				pool->swork.transparency_time = (time_t)-1;
+				pool->swork.opaque = true;
+				applog(LOG_WARNING, "Pool %u is hiding block contents from us",
+				       pool->pool_no);
+			}
+			break;
+		default:
+			if (stratum_timer_due(pool, now)) {
+				applog(LOG_INFO, "Timed out connecting to stratum pool %d", pool->pool_no);
+				stratum_failed(pool, now);
+			}
+			break;
+	}
 
-		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
-			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		free(s);
-		if (pool->swork.clean) {
-			struct work *work = make_work();
+	switch (pool->stratum_state) {
+		case STRATUM_CONNECTING:
+			events = STRATUM_WANT_WRITE;
+			break;
+		case STRATUM_SUBSCRIBING:
+		case STRATUM_AUTHORISING:
+			events = STRATUM_WANT_READ;
+			break;
+		case STRATUM_ACTIVE:
+			events = STRATUM_WANT_READ;
+			/* Write out whatever has been found since the last
+			 * wakeup, and only wait on the socket for what it
+			 * would not take straight away */
+			if (pool->sws_waiting_on_sock)
+				stratum_send_shares(pool);
+			if (pool->sendbuf_len)
+				events |= STRATUM_WANT_WRITE;
+			break;
+		default:
+			/* Nobody is going to write these shares out, unless
+			 * the session is resumed */
+			if (pool->sws_waiting_on_sock && !pool->stratum_resume_until)
+				stratum_send_shares(pool);
+			break;
+	}
+	stratum_watch(pool, events);
 
-			/* Generate a single work item to update the current
-			 * block database */
-			pool->swork.clean = false;
-			gen_stratum_work(pool, work);
+	if (pool->tv_stratum_timer.tv_sec) {
+		int ms = tdiff(&pool->tv_stratum_timer, now) * 1000;
+
+		if (ms < 0)
+			ms = 0;
+		if (ms < *timeout_ms)
+			*timeout_ms = ms;
+	}
+}
+
+static void *stratum_reactor_thread(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+
+	RenameThread("stratum");
+
+	srand(time(NULL));
+
+	while (42) {
+		struct timeval now;
+		int i, timeout_ms = 1000;
+#ifdef HAVE_SYS_EPOLL_H
+		struct epoll_event evs[16];
+		int n;
+#else
+		fd_set rd, wd;
+		struct timeval timeout;
+		int maxfd = stratum_notifier[0];
+#endif
+
+		gettimeofday(&now, NULL);
+		for (i = 0; i < total_pools; i++) {
+			struct pool *pool = pools[i];
 
-			/* Try to extract block height from coinbase scriptSig */
-			char *hex_height = &pool->swork.coinbase1[8 /*version*/ + 2 /*txin count*/ + 72 /*prevout*/ + 2 /*scriptSig len*/ + 2 /*push opcode*/];
-			unsigned char cb_height_sz;
-			hex2bin(&cb_height_sz, &hex_height[-2], 1);
-			if (cb_height_sz == 3) {
+			if (pool->stratum_state != STRATUM_NONE)
+				stratum_service(pool, &now, &timeout_ms);
+		}
 
-                    uint block_id;
-                    if(opt_neoscrypt)
-                      block_id = le32toh(((uint *) work->data)[1]);
-                    else
-                      block_id = be32toh(((uint *) work->data)[1]);
+#ifdef HAVE_SYS_EPOLL_H
+		n = epoll_wait(stratum_epfd, evs, sizeof(evs) / sizeof(evs[0]), timeout_ms);
+		gettimeofday(&now, NULL);
+		for (i = 0; i < n; i++) {
+			struct pool *pool = evs[i].data.ptr;
+			bool err = evs[i].events & (EPOLLERR | EPOLLHUP);
 
-				uint32_t height = 0;
-				hex2bin((unsigned char*)&height, hex_height, 3);
-				height = le32toh(height);
-				have_block_height(block_id, height);
+			if (!pool) {
+				notifier_read(stratum_notifier);
+				continue;
 			}
+			stratum_event(pool, err || (evs[i].events & EPOLLIN),
+				      err || (evs[i].events & EPOLLOUT), &now);
+		}
+#else
+		FD_ZERO(&rd);
+		FD_ZERO(&wd);
+		FD_SET(stratum_notifier[0], &rd);
+		for (i = 0; i < total_pools; i++) {
+			struct pool *pool = pools[i];
+			SOCKETTYPE sock = pool->stratum_watched;
 
-			++pool->work_restart_id;
-			if (test_work_current(work)) {
-				/* Only accept a work restart if this stratum
-				 * connection is from the current pool */
-				if (pool == current_pool()) {
-					restart_threads();
-					applog(LOG_NOTICE, "Stratum from pool %d requested work restart", pool->pool_no);
-				}
-			} else
-				applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
-			free_work(work);
+			if (sock == INVSOCK)
+				continue;
+			if (pool->stratum_events & STRATUM_WANT_READ)
+				FD_SET(sock, &rd);
+			if (pool->stratum_events & STRATUM_WANT_WRITE)
+				FD_SET(sock, &wd);
+			if ((int)sock > maxfd)
+				maxfd = sock;
 		}
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_usec = (timeout_ms % 1000) * 1000;
+		if (select(maxfd + 1, &rd, &wd, NULL, &timeout) < 1)
+			continue;
+		gettimeofday(&now, NULL);
+		if (FD_ISSET(stratum_notifier[0], &rd))
+			notifier_read(stratum_notifier);
+		for (i = 0; i < total_pools; i++) {
+			struct pool *pool = pools[i];
+			SOCKETTYPE sock = pool->stratum_watched;
 
-		if (pool->swork.transparency_time != (time_t)-1 && difftime(time(NULL), pool->swork.transparency_time) > 21.09375) {
-			// More than 4 timmills past since requested transactions
-			pool->swork.transparency_time = (time_t)-1;
-			pool->swork.opaque = true;
-			applog(LOG_WARNING, "Pool %u is hiding block contents from us",
-			       pool->pool_no);
+			if (sock == INVSOCK)
+				continue;
+			if (FD_ISSET(sock, &rd) || FD_ISSET(sock, &wd))
+				stratum_event(pool, FD_ISSET(sock, &rd), FD_ISSET(sock, &wd), &now);
 		}
+#endif
 	}
 
-out:
 	return NULL;
 }
 
-static void init_stratum_thread(struct pool *pool)
+static void init_stratum_reactor(void)
+{
+	pthread_t pth;
+
+	notifier_init(stratum_notifier);
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+
+	stratum_epfd = epoll_create(16);
+	if (unlikely(stratum_epfd < 0))
+		quit(1, "Failed to epoll_create in init_stratum_reactor");
+	if (unlikely(epoll_ctl(stratum_epfd, EPOLL_CTL_ADD, stratum_notifier[0], &ev)))
+		quit(1, "Failed to epoll_ctl in init_stratum_reactor");
+#endif
+	if (unlikely(pthread_create(&pth, NULL, stratum_reactor_thread, NULL)))
+		quit(1, "Failed to create stratum reactor thread");
+}
+
+/* Hands a freshly authorised stratum connection over to the reactor, which
+ * looks after it from then on */
+static void stratum_reactor_add(struct pool *pool)
 {
-	if (unlikely(pthread_create(&pool->stratum_thread, NULL, stratum_thread, (void *)pool)))
-		quit(1, "Failed to create stratum thread");
+	struct timeval now;
+
+	if (pool->stratum_state != STRATUM_NONE)
+		return;
+
+	gettimeofday(&now, NULL);
+	stratum_timer(pool, &now, STRATUM_IDLE_TIMEOUT);
+	pool->stratum_backoff = 0;
+	pool->stratum_state = STRATUM_ACTIVE;
+	notifier_wake(stratum_notifier);
 }
 
-static void *longpoll_thread(void *userdata);
+static void longpoll_add(struct pool *pool);
 
 static bool stratum_works(struct pool *pool)
 {
@@ -6265,17 +7671,16 @@ tryagain:
 retry_stratum:
 		curl_easy_cleanup(curl);
 		
-		/* We create the stratum thread for each pool just after
-		 * successful authorisation. Once the auth flag has been set
-		 * we never unset it and the stratum thread is responsible for
-		 * setting/unsetting the active flag */
-		if (pool->stratum_auth)
+		/* We hand each pool over to the stratum reactor just after
+		 * successful authorisation. From then on the reactor is
+		 * responsible for setting/unsetting the active flag */
+		if (pool->stratum_auth || pool->stratum_state != STRATUM_NONE)
 			return pool->stratum_active;
 		if (!pool->stratum_active && !initiate_stratum(pool))
 			return false;
 		if (!auth_stratum(pool))
 			return false;
-		init_stratum_thread(pool);
+		stratum_reactor_add(pool);
 		return true;
 	}
 	else if (pool->has_stratum)
@@ -6355,11 +7760,8 @@ badwork:
 		} else
 			pool->lp_url = NULL;
 
-		if (want_longpoll && !pool->lp_started) {
-			pool->lp_started = true;
-			if (unlikely(pthread_create(&pool->longpoll_thread, NULL, longpoll_thread, (void *)pool)))
-				quit(1, "Failed to create pool longpoll thread");
-		}
+		if (want_longpoll && !pool->lp_started)
+			longpoll_add(pool);
 	} else if (PLP_NONE != (proto = pool_protocol_fallback(proto))) {
 		pool->proto = proto;
 		goto tryagain;
@@ -6432,6 +7834,7 @@ retry:
 	HASH_DEL(staged_work, work);
 	if (work_rollable(work))
 		staged_rollable--;
+	staged_popped++;
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
@@ -6514,78 +7917,108 @@ static void set_work_target(struct work *work, double diff) {
 
 }
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work) {
-    uchar merkle_root[64], temp_bin[32];
+static void *memdup(const void *p, size_t len)
+{
+	void *ret = malloc(len ? len : 1);
+
+	if (unlikely(!ret))
+		quit(1, "Failed to malloc in memdup");
+	memcpy(ret, p, len);
+	return ret;
+}
+
+/* Takes a private copy of a stratum job, for building work from after the
+ * pool has moved on. Called with pool_lock held */
+void stratum_work_cpy(struct stratum_work *dst, const struct stratum_work *src)
+{
+	*dst = *src;
+	dst->job_id = strdup(src->job_id);
+	dst->ntime = strdup(src->ntime);
+	dst->coinbase1 = memdup(src->coinbase1, src->cb1_len);
+	dst->coinbase2 = memdup(src->coinbase2, src->cb2_len);
+	dst->merkle = src->merkles ? memdup(src->merkle, src->merkles * 32) : NULL;
+}
+
+void stratum_work_clean(struct stratum_work *swork)
+{
+	free(swork->job_id);
+	free(swork->ntime);
+	free(swork->coinbase1);
+	free(swork->coinbase2);
+	free(swork->merkle);
+	memset(swork, 0, sizeof(*swork));
+}
+
+/* Builds the block header of a stratum job for the given extranonces into
+ * work, along with what a share from it is submitted with. The job must be
+ * held still, by pool_lock for a pool's current job */
+static void stratum_work_header(struct work *work, const struct stratum_work *swork,
+				const char *nonce1, size_t n1_len, const uchar *nonce2, int n2size,
+				uchar *merkle_root)
+{
+    uchar temp_bin[32];
     uint *data = (uint *) work->data;
     uchar *coinbase;
-    size_t alloc_len;
+    size_t alloc_len, cb_len;
     uint i, t;
 
-	clean_work(work);
-
-	mutex_lock(&pool->pool_lock);
-
 	/* Generate coinbase */
-	work->nonce2 = bin2hex((const unsigned char *)&pool->nonce2, pool->n2size);
-	pool->nonce2++;
-	alloc_len = pool->swork.cb_len;
+	cb_len = swork->cb1_len + n1_len + n2size + swork->cb2_len;
+	alloc_len = cb_len;
 	align_len(&alloc_len);
 	coinbase = calloc(alloc_len, 1);
 	if (unlikely(!coinbase))
-		quit(1, "Failed to calloc coinbase in gen_stratum_work");
-	hex2bin(coinbase, pool->swork.coinbase1, pool->swork.cb1_len);
-	hex2bin(coinbase + pool->swork.cb1_len, pool->nonce1, pool->n1_len);
-	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len, work->nonce2, pool->n2size);
-	hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len + pool->n2size, pool->swork.coinbase2, pool->swork.cb2_len);
+		quit(1, "Failed to calloc coinbase in stratum_work_header");
+	memcpy(coinbase, swork->coinbase1, swork->cb1_len);
+	hex2bin(coinbase + swork->cb1_len, nonce1, n1_len);
+	memcpy(coinbase + swork->cb1_len + n1_len, nonce2, n2size);
+	work->nonce2 = bin2hex(nonce2, n2size);
+	memcpy(coinbase + swork->cb1_len + n1_len + n2size, swork->coinbase2, swork->cb2_len);
 
     /* Generate merkle root */
-    gen_hash(coinbase, merkle_root, pool->swork.cb_len);
+    gen_hash(coinbase, merkle_root, cb_len);
     free(coinbase);
-    for(i = 0; i < pool->swork.merkles; i++) {
-        hex2bin((uchar *) temp_bin, (char *) pool->swork.merkle[i], 32);
-        memcpy(&merkle_root[32], &temp_bin[0], 32);
+    for(i = 0; i < swork->merkles; i++) {
+        memcpy(&merkle_root[32], swork->merkle + i * 32, 32);
         gen_hash(merkle_root, merkle_root, 64);
     }
 
     /* Assemble the block header */
     if(opt_neoscrypt) {
         /* Version */
-        hex2bin((uchar *) &t, (char *) pool->swork.bbversion, 4);
+        memcpy(&t, swork->bbversion, 4);
         data[0] = be32toh(t);
         /* Previous block hash */
-        hex2bin((uchar *) temp_bin, (char *) pool->swork.prev_hash, 32);
+        memcpy(temp_bin, swork->prev_hash, 32);
         for(i = 0; i < 8; i++)
           data[i + 1] = be32toh(((uint *) temp_bin)[i]);
         /* Merkle root */
         for(i = 0; i < 8; i++)
           data[i + 9] = le32toh(((uint *) merkle_root)[i]);
         /* Time */
-        hex2bin((uchar *) &t, (char *) pool->swork.ntime, 4);
+        memcpy(&t, swork->ntime_bin, 4);
         data[17] = be32toh(t);
         /* Difficulty */
-        hex2bin((uchar *) &t, (char *) pool->swork.nbit, 4);
+        memcpy(&t, swork->nbit, 4);
         data[18] = be32toh(t);
         /* Erase the remaining part */
         memset(&data[19], 0x00, 52);
     } else {
         /* Version */
-        hex2bin((uchar *) &t, (char *) pool->swork.bbversion, 4);
+        memcpy(&t, swork->bbversion, 4);
         data[0] = le32toh(t);
         /* Previous block hash */
-        hex2bin((uchar *) temp_bin, (char *) pool->swork.prev_hash, 32);
+        memcpy(temp_bin, swork->prev_hash, 32);
         for(i = 0; i < 8; i++)
           data[i + 1] = le32toh(((uint *) temp_bin)[i]);
         /* Merkle root */
         for(i = 0; i < 8; i++)
           data[i + 9] = be32toh(((uint *) merkle_root)[i]);
         /* Time */
-        hex2bin((uchar *) &t, (char *) pool->swork.ntime, 4);
+        memcpy(&t, swork->ntime_bin, 4);
         data[17] = le32toh(t);
         /* Difficulty */
-        hex2bin((uchar *) &t, (char *) pool->swork.nbit, 4);
+        memcpy(&t, swork->nbit, 4);
         data[18] = le32toh(t);
         /* Erase the remaining part */
         memset(&data[19], 0x00, 52);
@@ -6596,19 +8029,22 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
 
 	/* Store the stratum work diff to check it still matches the pool's
 	 * stratum diff when submitting shares */
-	work->sdiff = pool->swork.diff;
+	work->sdiff = swork->diff;
+	work->tv_notify = swork->tv_notify;
 
 	/* Copy parameters required for share submission */
-	work->job_id = strdup(pool->swork.job_id);
-	work->ntime = strdup(pool->swork.ntime);
-
-	mutex_unlock(&pool->pool_lock);
+	work->job_id = strdup(swork->job_id);
+	work->ntime = strdup(swork->ntime);
+}
 
+/* The rest of making a stratum work item, once the job is let go of */
+static void stratum_work_finish(struct pool *pool, struct work *work, const uchar *merkle_root)
+{
     if(opt_debug) {
         char *merkle_hash, *header;
         merkle_hash = bin2hex((const uchar *) merkle_root, 32);
         applog(LOG_DEBUG, "Generated Stratum merkle root %s", merkle_hash);
-        header = bin2hex((const uchar *) data, opt_neoscrypt ? 80 : 128);
+        header = bin2hex((const uchar *) work->data, opt_neoscrypt ? 80 : 128);
         applog(LOG_DEBUG, "Generated Stratum block header %s", header);
         applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id, work->nonce2, work->ntime);
         free(merkle_hash);
@@ -6621,7 +8057,6 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
 
 	set_work_target(work, work->sdiff);
 
-	local_work++;
 	work->pool = pool;
 	work->stratum = true;
 	work->blk.nonce = 0;
@@ -6634,6 +8069,75 @@ static void gen_stratum_work(struct pool *pool, struct work *work) {
 	gettimeofday(&work->tv_staged, NULL);
 }
 
+/* Generates stratum based work based on the most recent notify information
+ * from the pool. This will keep generating work while a pool is down so we use
+ * other means to detect when the pool has died in the stratum reactor */
+static void gen_stratum_work(struct pool *pool, struct work *work) {
+	uchar merkle_root[64], *nonce2;
+	double cpu = thread_cputime();
+	int reserved;
+
+	clean_work(work);
+
+	mutex_lock(&pool->pool_lock);
+
+	/* Our own nonce2 counter goes after any part of the extranonce2
+	 * space handed out to downstream miners, which stays zero */
+	nonce2 = calloc(pool->n2size, 1);
+	if (unlikely(!nonce2))
+		quit(1, "Failed to calloc nonce2 in gen_stratum_work");
+	reserved = stratumsrv_n2_reserved(pool);
+	memcpy(nonce2 + reserved, &pool->nonce2,
+	       pool->n2size - reserved < (int)sizeof(pool->nonce2) ? pool->n2size - reserved : (int)sizeof(pool->nonce2));
+	pool->nonce2++;
+	stratum_work_header(work, &pool->swork, pool->nonce1, pool->n1_len, nonce2, pool->n2size, merkle_root);
+
+	pool->gen_works++;
+	pool->gen_work_cpu += thread_cputime() - cpu;
+	mutex_unlock(&pool->pool_lock);
+	free(nonce2);
+
+	local_work++;
+	stratum_work_finish(pool, work, merkle_root);
+}
+
+/* Rebuilds the work a downstream miner found a share in, from a copy of
+ * the job it was given and its extranonces, ntime and nonce, all already
+ * checked for length */
+struct work *stratumsrv_work(struct pool *pool, const struct stratum_work *swork,
+			     const char *nonce1, const char *nonce2, const char *ntime,
+			     const char *nonce)
+{
+	struct work *work = make_work();
+	uchar merkle_root[64], n2[32], bin[4];
+	size_t n2size = strlen(nonce2) / 2;
+	uint32_t t;
+
+	if (n2size > sizeof(n2) || !hex2bin(n2, nonce2, n2size))
+		goto err;
+	stratum_work_header(work, swork, nonce1, strlen(nonce1) / 2, n2, n2size, merkle_root);
+
+	if (!hex2bin(bin, ntime, 4))
+		goto err;
+	memcpy(&t, bin, 4);
+	((uint *) work->data)[17] = opt_neoscrypt ? be32toh(t) : le32toh(t);
+	free(work->ntime);
+	work->ntime = strdup(ntime);
+
+	/* Submits write the nonce out the other way round for NeoScrypt */
+	if (!hex2bin(bin, nonce, 4))
+		goto err;
+	memcpy(&t, bin, 4);
+	((uint *) work->data)[19] = opt_neoscrypt ? be32toh(t) : t;
+
+	stratum_work_finish(pool, work, merkle_root);
+	return work;
+
+err:
+	free_work(work);
+	return NULL;
+}
+
 static struct work *get_work(struct thr_info *thr, const int thr_id)
 {
 	struct work *work = NULL;
@@ -6665,6 +8169,8 @@ void submit_work_async(struct work *work_in, struct timeval *tv_work_found)
 
 	if (tv_work_found)
 		memcpy(&(work->tv_work_found), tv_work_found, sizeof(struct timeval));
+	else
+		gettimeofday(&work->tv_work_found, NULL);
 	applog(LOG_DEBUG, "Pushing submit work to work thread");
 
 	mutex_lock(&submitting_lock);
@@ -6867,6 +8373,7 @@ void *miner_thread(void *userdata)
 				"mining thread %d", thr_id);
 			break;
 		}
+		pool_job_started(work, &tv_workstart);
 
 		do {
 			gettimeofday(&tv_start, NULL);
@@ -7012,7 +8519,7 @@ enum {
 };
 
 /* Stage another work item from the work returned in a longpoll */
-static void convert_to_work(json_t *val, int rolltime, struct pool *pool, struct work *work, struct timeval *tv_lp, struct timeval *tv_lp_reply)
+static void convert_to_work(json_t *val, int rolltime, struct pool *pool, struct work *work, struct timeval *tv_lp, struct timeval *tv_lp_reply, bool watch_only)
 {
 	bool rc;
 
@@ -7044,11 +8551,12 @@ static void convert_to_work(json_t *val, int rolltime, struct pool *pool, struct
 	 * allows testwork to know whether LP discovered the block or not. */
 	test_work_current(work);
 
-	/* Don't use backup LPs as work if we have failover-only enabled. Use
-	 * the longpoll work from a pool that has been rejecting shares as a
-	 * way to detect when the pool has recovered.
+	/* Don't use backup LPs as work if we have failover-only enabled, or if
+	 * the longpoll was only kept open to watch for block changes. Use the
+	 * longpoll work from a pool that has been rejecting shares as a way to
+	 * detect when the pool has recovered.
 	 */
-	if (pool != current_pool() && opt_fail_only && pool->enabled != POOL_REJECTING) {
+	if (pool != current_pool() && (opt_fail_only || watch_only) && pool->enabled != POOL_REJECTING) {
 		free_work(work);
 		return;
 	}
@@ -7079,21 +8587,6 @@ static struct pool *select_longpoll_pool(struct pool *cp)
 	return NULL;
 }
 
-/* This will make the longpoll thread wait till it's the current pool, or it
- * has been flagged as rejecting, before attempting to open any connections.
- */
-static void wait_lpcurrent(struct pool *pool)
-{
-	if (cnx_needed(pool))
-		return;
-
-	while (pool != current_pool() && pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
-		mutex_lock(&lp_lock);
-		pthread_cond_wait(&lp_cond, &lp_lock);
-		mutex_unlock(&lp_lock);
-	}
-}
-
 static curl_socket_t save_curl_socket(void *vpool, __maybe_unused curlsocktype purpose, struct curl_sockaddr *addr) {
 	struct pool *pool = vpool;
 	curl_socket_t sock = socket(addr->family, addr->socktype, addr->protocol);
@@ -7101,132 +8594,251 @@ static curl_socket_t save_curl_socket(void *vpool, __maybe_unused curlsocktype p
 	return sock;
 }
 
-static void *longpoll_thread(void *userdata)
-{
-	struct pool *cp = (struct pool *)userdata;
-	/* This *pool is the source of the actual longpoll, not the pool we've
-	 * tied it to */
-	struct pool *pool = NULL;
-	struct timeval start, reply, end;
-	CURL *curl = NULL;
-	int failures = 0;
-	char *lp_url;
-	int rolltime;
+/* All longpolls are multiplexed onto a single curl multi loop in
+ * longpoll_thread, one session per pool with lp_started set. Since an idle
+ * longpoll now only costs a socket, backup pools keep theirs open too; their
+ * replies are used to detect block changes but are only staged as work when
+ * the pool would be mined on anyway. */
+struct longpoll_state {
+	/* The pool the longpoll is for, and the pool actually providing it */
+	struct pool *cp;
+	struct pool *pool;
+	CURL *curl;
+	struct work *work;
+	char *lpreq;
+	struct timeval tv_start;
+	time_t retry;
+	int failures;
+	bool busy;
+	bool done;
+	struct longpoll_state *next;
+};
 
-	RenameThread("longpoll");
+static bool longpoll_running;
+static notifier_t longpoll_notifier;
 
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
-		applog(LOG_ERR, "CURL initialisation failed");
-		return NULL;
-	}
+static void longpoll_send(CURLM *curlm, struct longpoll_state *lps)
+{
+	struct pool *cp = lps->cp;
+	struct pool *pool;
 
-retry_pool:
 	pool = select_longpoll_pool(cp);
 	if (!pool) {
-		applog(LOG_WARNING, "No suitable long-poll found for %s", cp->rpc_url);
-		while (!pool) {
-			sleep(60);
-			pool = select_longpoll_pool(cp);
-		}
+		if (!lps->failures++)
+			applog(LOG_WARNING, "No suitable long-poll found for %s", cp->rpc_url);
+		lps->retry = time(NULL) + 60;
+		return;
 	}
 
 	if (pool->has_stratum) {
 		applog(LOG_WARNING, "Block change for %s detection via %s stratum",
 		       cp->rpc_url, pool->rpc_url);
-		goto out;
+		lps->done = true;
+		return;
 	}
 
 	/* Any longpoll from any pool is enough for this to be true */
 	have_longpoll = true;
 
-	wait_lpcurrent(cp);
-
-	{
-		lp_url = pool->lp_url;
+	if (pool != lps->pool) {
 		if (cp == pool)
-			applog(LOG_WARNING, "Long-polling activated for %s (%s)", lp_url, pool_protocol_name(pool->lp_proto));
+			applog(LOG_WARNING, "Long-polling activated for %s (%s)", pool->lp_url, pool_protocol_name(pool->lp_proto));
 		else
-			applog(LOG_WARNING, "Long-polling activated for %s via %s (%s)", cp->rpc_url, lp_url, pool_protocol_name(pool->lp_proto));
+			applog(LOG_WARNING, "Long-polling activated for %s via %s (%s)", cp->rpc_url, pool->lp_url, pool_protocol_name(pool->lp_proto));
+		lps->pool = pool;
+		lps->failures = 0;
+	}
+
+	lps->work = make_work();
+	lps->lpreq = prepare_rpc_req(lps->work, pool->lp_proto, pool->lp_id);
+	lps->work->pool = pool;
+	if (!lps->lpreq) {
+		free_work(lps->work);
+		lps->work = NULL;
+		lps->retry = time(NULL) + 30;
+		return;
 	}
 
-	while (42) {
-		json_t *val, *soval;
+	gettimeofday(&lps->tv_start, NULL);
 
-		struct work *work = make_work();
-		char *lpreq;
-		lpreq = prepare_rpc_req(work, pool->lp_proto, pool->lp_id);
-		work->pool = pool;
-		if (!lpreq)
-		{
-			free_work(work);
-			goto lpfail;
+	/* Longpoll connections can be persistent for a very long time and any
+	 * number of issues could have come up in the meantime so always
+	 * establish a fresh connection instead of relying on a persistent
+	 * one. */
+	curl_easy_setopt(lps->curl, CURLOPT_FRESH_CONNECT, 1);
+	curl_easy_setopt(lps->curl, CURLOPT_OPENSOCKETFUNCTION, save_curl_socket);
+	curl_easy_setopt(lps->curl, CURLOPT_OPENSOCKETDATA, pool);
+	json_rpc_call_async(lps->curl, pool->lp_url, pool->rpc_userpass, lps->lpreq, true, pool, false, lps);
+	curl_multi_add_handle(curlm, lps->curl);
+	lps->busy = true;
+}
+
+static void longpoll_completed(CURLM *curlm, CURL *curl, int result)
+{
+	struct longpoll_state *lps;
+	struct timeval reply;
+	struct pool *pool;
+	json_t *val, *soval;
+	int rolltime = 0;
+
+	val = json_rpc_call_completed(curl, result, false, &rolltime, &lps);
+	curl_multi_remove_handle(curlm, curl);
+	if (unlikely(!lps))
+		return;
+	pool = lps->pool;
+	pool->lp_socket = CURL_SOCKET_BAD;
+	lps->busy = false;
+
+	gettimeofday(&reply, NULL);
+
+	free(lps->lpreq);
+	lps->lpreq = NULL;
+
+	if (likely(val)) {
+		soval = json_object_get(json_object_get(val, "result"), "submitold");
+		if (soval)
+			pool->submit_old = json_is_true(soval);
+		else
+			pool->submit_old = false;
+		convert_to_work(val, rolltime, pool, lps->work, &lps->tv_start, &reply, !cnx_needed(lps->cp));
+		lps->failures = 0;
+		json_decref(val);
+	} else {
+		free_work(lps->work);
+		/* Some pools regularly drop the longpoll request so only see
+		 * this as longpoll failure if it happens immediately and just
+		 * restart it the rest of the time. */
+		if (reply.tv_sec - lps->tv_start.tv_sec <= 30) {
+			if (!lps->failures++)
+				applog(LOG_WARNING, "longpoll failed for %s, retrying every 30s", pool->lp_url);
+			lps->retry = reply.tv_sec + 30;
 		}
+	}
+	lps->work = NULL;
+
+	if (unlikely(pool->removed))
+		lps->done = true;
+}
 
-		wait_lpcurrent(cp);
+static void *longpoll_thread(__maybe_unused void *userdata)
+{
+	struct longpoll_state *sessions = NULL, *lps, **lpsp;
+	CURLM *curlm;
+	long curlm_timeout_ms = -1;
 
-		gettimeofday(&start, NULL);
+	pthread_detach(pthread_self());
 
-		/* Longpoll connections can be persistent for a very long time
-		 * and any number of issues could have come up in the meantime
-		 * so always establish a fresh connection instead of relying on
-		 * a persistent one. */
-		curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
-		curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, save_curl_socket);
-		curl_easy_setopt(curl, CURLOPT_OPENSOCKETDATA, pool);
-		val = json_rpc_call(curl, lp_url, pool->rpc_userpass,
-				    lpreq, false, true, &rolltime, pool, false);
-		pool->lp_socket = CURL_SOCKET_BAD;
+	RenameThread("longpoll");
 
-		gettimeofday(&reply, NULL);
+	curlm = curl_multi_init();
+	curl_multi_setopt(curlm, CURLMOPT_TIMERFUNCTION, my_curl_timer_set);
+	curl_multi_setopt(curlm, CURLMOPT_TIMERDATA, &curlm_timeout_ms);
 
-		free(lpreq);
+	fd_set rfds, wfds, efds;
+	int maxfd, i, n;
+	struct timeval timeout;
+	CURLMsg *cm;
+	time_t now;
+	FD_ZERO(&rfds);
+	while (42) {
+		if (FD_ISSET(longpoll_notifier[0], &rfds))
+			notifier_read(longpoll_notifier);
 
-		if (likely(val)) {
-			soval = json_object_get(json_object_get(val, "result"), "submitold");
-			if (soval)
-				pool->submit_old = json_is_true(soval);
-			else
-				pool->submit_old = false;
-			convert_to_work(val, rolltime, pool, work, &start, &reply);
-			failures = 0;
-			json_decref(val);
-		} else {
-			/* Some pools regularly drop the longpoll request so
-			 * only see this as longpoll failure if it happens
-			 * immediately and just restart it the rest of the
-			 * time. */
-			gettimeofday(&end, NULL);
-			free_work(work);
-			if (end.tv_sec - start.tv_sec > 30)
+		/* Pick up pools that have just had longpoll enabled */
+		for (i = 0; i < total_pools; i++) {
+			struct pool *cp = pools[i];
+
+			if (!cp->lp_started || cp->removed)
+				continue;
+			for (lps = sessions; lps; lps = lps->next)
+				if (lps->cp == cp)
+					break;
+			if (lps)
 				continue;
-			if (failures == 1)
-				applog(LOG_WARNING, "longpoll failed for %s, retrying every 30s", lp_url);
-lpfail:
-			sleep(30);
+			lps = calloc(1, sizeof(*lps));
+			if (unlikely(!lps))
+				quit(1, "Failed to calloc lps in longpoll_thread");
+			lps->curl = curl_easy_init();
+			if (unlikely(!lps->curl))
+				quit(1, "CURL initialisation failed");
+			lps->cp = cp;
+			lps->next = sessions;
+			sessions = lps;
 		}
 
-		if (pool != cp) {
-			pool = select_longpoll_pool(cp);
-			if (pool->has_stratum) {
-				applog(LOG_WARNING, "Block change for %s detection via %s stratum",
-				       cp->rpc_url, pool->rpc_url);
-				break;
+		now = time(NULL);
+		lpsp = &sessions;
+		while ( (lps = *lpsp) ) {
+			if (!lps->cp->lp_started || lps->cp->removed) {
+				/* Longpoll was disabled, or the pool removed */
+				if (lps->busy) {
+					curl_multi_remove_handle(curlm, lps->curl);
+					json_rpc_call_completed(lps->curl, CURLE_ABORTED_BY_CALLBACK, false, NULL, NULL);
+					lps->pool->lp_socket = CURL_SOCKET_BAD;
+					free_work(lps->work);
+					free(lps->lpreq);
+				}
+				curl_easy_cleanup(lps->curl);
+				*lpsp = lps->next;
+				free(lps);
+				continue;
 			}
-			if (unlikely(!pool))
-				goto retry_pool;
+			if (!lps->busy && !lps->done && now >= lps->retry)
+				longpoll_send(curlm, lps);
+			lpsp = &lps->next;
 		}
 
-		if (unlikely(pool->removed))
-			break;
-	}
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_ZERO(&efds);
+		curl_multi_fdset(curlm, &rfds, &wfds, &efds, &maxfd);
 
-out:
-	curl_easy_cleanup(curl);
+		/* Wake at least once a second for retries */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		if (curlm_timeout_ms >= 0 && curlm_timeout_ms < 1000) {
+			timeout.tv_sec = 0;
+			timeout.tv_usec = curlm_timeout_ms * 1000;
+		}
+
+		FD_SET(longpoll_notifier[0], &rfds);
+		if (longpoll_notifier[0] > maxfd)
+			maxfd = longpoll_notifier[0];
+
+		if (select(maxfd+1, &rfds, &wfds, &efds, &timeout) < 0) {
+			FD_ZERO(&rfds);
+			continue;
+		}
+
+		curl_multi_perform(curlm, &n);
+		while ( (cm = curl_multi_info_read(curlm, &n)) ) {
+			if (cm->msg == CURLMSG_DONE)
+				longpoll_completed(curlm, cm->easy_handle, cm->data.result);
+		}
+	}
 
 	return NULL;
 }
 
+/* Give @pool a longpoll session, starting the longpoll thread if needed */
+static void longpoll_add(struct pool *pool)
+{
+	pool->lp_started = true;
+
+	mutex_lock(&lp_lock);
+	if (!longpoll_running) {
+		pthread_t thr;
+
+		notifier_init(longpoll_notifier);
+		if (unlikely(pthread_create(&thr, NULL, longpoll_thread, NULL)))
+			quit(1, "Failed to create longpoll thread");
+		longpoll_running = true;
+	}
+	mutex_unlock(&lp_lock);
+
+	notifier_wake(longpoll_notifier);
+}
+
 static void stop_longpoll(void)
 {
 	int i;
@@ -7236,13 +8848,12 @@ static void stop_longpoll(void)
 	{
 		struct pool *pool = pools[i];
 		
-		if (unlikely(!pool->lp_started))
-			continue;
-		
 		pool->lp_started = false;
-		pthread_cancel(pool->longpoll_thread);
 	}
 	have_longpoll = false;
+
+	if (longpoll_running)
+		notifier_wake(longpoll_notifier);
 }
 
 static void start_longpoll(void)
@@ -7257,9 +8868,7 @@ static void start_longpoll(void)
 		if (unlikely(pool->removed || pool->lp_started || !pool->lp_url))
 			continue;
 		
-		pool->lp_started = true;
-		if (unlikely(pthread_create(&pool->longpoll_thread, NULL, longpoll_thread, (void *)pool)))
-			quit(1, "Failed to create pool longpoll thread");
+		longpoll_add(pool);
 	}
 }
 
@@ -7587,6 +9196,53 @@ static void log_print_status(struct cgpu_info *cgpu)
 	applog(LOG_WARNING, "%s", logline);
 }
 
+static void log_pool_latency(struct pool *pool, const char *indent)
+{
+	struct latency_hist latency[LATENCY_MAX];
+	int i;
+
+	mutex_lock(&pool->pool_lock);
+	memcpy(latency, pool->latency, sizeof(latency));
+	mutex_unlock(&pool->pool_lock);
+
+	for (i = 0; i < LATENCY_MAX; i++) {
+		struct latency_hist *hist = &latency[i];
+
+		if (!hist->samples)
+			continue;
+		applog(LOG_WARNING, "%s%s latency: %"PRIu64" samples, avg %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms",
+		       indent, latency_names[i], hist->samples,
+		       hist->total_us / 1000.0 / hist->samples,
+		       latency_pct(hist, 50), latency_pct(hist, 90), latency_pct(hist, 99),
+		       hist->max_us / 1000.0);
+	}
+}
+
+static void log_pool_stratum_cost(struct pool *pool, const char *indent)
+{
+	unsigned int notifies, gen_works;
+	double notify_cpu, gen_work_cpu;
+	int shares;
+
+	mutex_lock(&pool->pool_lock);
+	notifies = pool->notifies;
+	notify_cpu = pool->notify_cpu;
+	gen_works = pool->gen_works;
+	gen_work_cpu = pool->gen_work_cpu;
+	mutex_unlock(&pool->pool_lock);
+
+	if (!notifies && !gen_works)
+		return;
+	if (notifies)
+		applog(LOG_WARNING, "%sStratum notifies: %u, avg %.1f us CPU each", indent, notifies, notify_cpu / notifies);
+	if (gen_works)
+		applog(LOG_WARNING, "%sStratum work items generated: %u, avg %.1f us CPU each", indent, gen_works, gen_work_cpu / gen_works);
+	shares = pool->accepted + pool->rejected + pool->stale_shares;
+	if (shares)
+		applog(LOG_WARNING, "%sStale and rejected shares: %.2f%% (%d stale, %d rejected of %d)", indent,
+		       (double)(pool->stale_shares + pool->rejected) * 100 / shares, pool->stale_shares, pool->rejected, shares);
+}
+
 void print_summary(void)
 {
 	struct timeval diff;
@@ -7630,10 +9286,16 @@ void print_summary(void)
 
 	applog(LOG_WARNING, "Discarded work due to new blocks: %d", total_discarded);
 	applog(LOG_WARNING, "Stale submissions discarded due to new blocks: %d", total_stale);
+	if (opt_min_share_diff > 0)
+		applog(LOG_WARNING, "Shares below minimum difficulty not submitted: %d", total_filtered);
 	applog(LOG_WARNING, "Unable to get work from server occasions: %d", total_go);
 	applog(LOG_WARNING, "Work items generated locally: %d", local_work);
 	applog(LOG_WARNING, "Submitting work remotely delay occasions: %d", total_ro);
 	applog(LOG_WARNING, "New blocks detected on network: %d\n", new_blocks);
+	if (total_pools == 1) {
+		log_pool_latency(pools[0], "");
+		log_pool_stratum_cost(pools[0], "");
+	}
 
 	if (total_pools > 1) {
 		for (i = 0; i < total_pools; i++) {
@@ -7656,7 +9318,11 @@ void print_summary(void)
 
 			applog(LOG_WARNING, " Discarded work due to new blocks: %d", pool->discarded_work);
 			applog(LOG_WARNING, " Stale submissions discarded due to new blocks: %d", pool->stale_shares);
+			if (opt_min_share_diff > 0)
+				applog(LOG_WARNING, " Shares below minimum difficulty not submitted: %d", pool->filtered_shares);
 			applog(LOG_WARNING, " Unable to get work from server occasions: %d", pool->getfail_occasions);
+			log_pool_latency(pool, " ");
+			log_pool_stratum_cost(pool, " ");
 			applog(LOG_WARNING, " Submitting work remotely delay occasions: %d\n", pool->remotefail_occasions);
 		}
 	}
@@ -8016,6 +9682,30 @@ static bool my_blkmaker_sha256_callback(void *digest, const void *buffer, size_t
 	return true;
 }
 
+/* Let libblkmaker keep the midstate of the part of the GBT coinbase that
+ * doesn't change between work items. Only whole blocks are ever passed. */
+static bool my_blkmaker_sha256_midstate_callback(void *midstate, const void *buffer, size_t length)
+{
+	sha2_context ctx;
+
+	sha2_starts(&ctx);
+	sha2_update(&ctx, buffer, length);
+	memcpy(midstate, ctx.state, sizeof(ctx.state));
+	return true;
+}
+
+static bool my_blkmaker_sha256_resume_callback(void *digest, const void *midstate, size_t midstatesz, const void *buffer, size_t length)
+{
+	sha2_context ctx;
+
+	sha2_starts(&ctx);
+	memcpy(ctx.state, midstate, sizeof(ctx.state));
+	ctx.total[0] = midstatesz;
+	sha2_update(&ctx, buffer, length);
+	sha2_finish(&ctx, digest);
+	return true;
+}
+
 int main(int argc, char *argv[])
 {
 	bool pools_active = false;
@@ -8031,6 +9721,8 @@ int main(int argc, char *argv[])
 #endif
 
 	blkmk_sha256_impl = my_blkmaker_sha256_callback;
+	blkmk_sha256_midstate_impl = my_blkmaker_sha256_midstate_callback;
+	blkmk_sha256_resume_impl = my_blkmaker_sha256_resume_callback;
 
 	/* This dangerous functions tramples random dynamically allocated
 	 * variables so do it before anything at all */
@@ -8049,13 +9741,10 @@ int main(int argc, char *argv[])
 	mutex_init(&stats_lock);
 	mutex_init(&sharelog_lock);
 	mutex_init(&ch_lock);
-	mutex_init(&sshare_lock);
 	rwlock_init(&blk_lock);
 	rwlock_init(&netacc_lock);
 
 	mutex_init(&lp_lock);
-	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
-		quit(1, "Failed to pthread_cond_init lp_cond");
 
 	mutex_init(&restart_lock);
 	if (unlikely(pthread_cond_init(&restart_cond, NULL)))
@@ -8065,6 +9754,14 @@ int main(int argc, char *argv[])
 		quit(1, "Failed to pthread_cond_init gws_cond");
 
 	notifier_init(submit_waiting_notifier);
+	init_stratum_reactor();
+
+	mutex_init(&getwork_lock);
+	mutex_init(&txid_cache_lock);
+#ifdef HAVE_OPENCL
+	init_ocl();
+#endif
+	notifier_init(getwork_notifier);
 
 	sprintf(packagename, "%s %s", PACKAGE, VERSION);
 
@@ -8386,7 +10083,7 @@ int main(int argc, char *argv[])
 			fork_monitor();
 	#endif // defined(unix)
 
-	total_threads = mining_threads + 7;
+	total_threads = mining_threads + 8;
 	thr_info = calloc(total_threads, sizeof(*thr));
 	if (!thr_info)
 		quit(1, "Failed to calloc thr_info");
@@ -8409,6 +10106,11 @@ int main(int argc, char *argv[])
 	/* We use the getq mutex as the staged lock */
 	stgd_lock = &getq->mutex;
 
+#ifdef HAVE_OPENCL
+	/* Build the GPU kernels while the pools are probed */
+	opencl_start_init();
+#endif
+
 	if (opt_benchmark)
 		goto begin_bench;
 
@@ -8565,6 +10267,12 @@ begin_bench:
 			quit(1, "submit_work thread create failed");
 	}
 
+	{
+		pthread_t getwork_thr;
+		if (unlikely(pthread_create(&getwork_thr, NULL, getwork_thread, NULL)))
+			quit(1, "getwork thread create failed");
+	}
+
 	watchpool_thr_id = mining_threads + 2;
 	thr = &thr_info[watchpool_thr_id];
 	/* start watchpool thread */
@@ -8596,6 +10304,16 @@ begin_bench:
 	if (thr_info_create(thr, NULL, api_thread, thr))
 		quit(1, "API thread create failed");
 
+	if (opt_stratum_port) {
+		/* Create the downstream stratum server thread */
+		stratumsrv_thr_id = mining_threads + 7;
+		thr = &thr_info[stratumsrv_thr_id];
+		thr->id = stratumsrv_thr_id;
+		if (thr_info_create(thr, NULL, stratumsrv_thread, thr))
+			quit(1, "stratum server thread create failed");
+		pthread_detach(thr->pth);
+	}
+
 #ifdef HAVE_CURSES
 	/* Create curses input thread for keyboard input. Create this last so
 	 * that we know all threads are created since this can call kill_work
@@ -8609,10 +10327,9 @@ begin_bench:
 
 	/* Once everything is set up, main() becomes the getwork scheduler */
 	while (42) {
-		int ts, max_staged = opt_queue;
+		int ts, inflight, max_staged = opt_queue;
 		struct pool *pool, *cp;
 		bool lagging = false;
-		struct curl_ent *ce;
 		struct work *work;
 
 		cp = current_pool();
@@ -8628,14 +10345,19 @@ begin_bench:
 		if (!cp->has_stratum && cp->proto != PLP_GETBLOCKTEMPLATE && !ts && !opt_fail_only)
 			lagging = true;
 
+		/* Requests still in flight will be staged shortly, so count them
+		 * unless the work is coming from stratum anyway */
+		inflight = cp->has_stratum ? 0 : total_getwork_inflight;
+
 		/* Wait until hash_pop tells us we need to create more work */
-		if (ts > max_staged) {
+		if (ts + inflight > max_staged) {
 			pthread_cond_wait(&gws_cond, stgd_lock);
 			ts = __total_staged();
+			inflight = cp->has_stratum ? 0 : total_getwork_inflight;
 		}
 		mutex_unlock(stgd_lock);
 
-		if (ts > max_staged)
+		if (ts + inflight > max_staged)
 			continue;
 
 		work = make_work();
@@ -8699,35 +10421,13 @@ retry:
 			continue;
 		}
 
-		work->pool = pool;
-		ce = pop_curl_entry3(pool, 2);
 		/* obtain new work from bitcoin via JSON-RPC */
-		if (!get_upstream_work(work, ce->curl)) {
-			struct pool *next_pool;
-
-			/* Make sure the pool just hasn't stopped serving
-			 * requests but is up as we'll keep hammering it */
-			push_curl_entry(ce, pool);
-			++pool->seq_getfails;
-			pool_died(pool);
-			next_pool = select_pool(!opt_fail_only);
-			if (pool == next_pool) {
-				applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, retrying in 5s", pool->pool_no);
-				sleep(5);
-			} else {
-				applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get work, failover activated", pool->pool_no);
-				pool = next_pool;
-			}
-			goto retry;
+		if (!getwork_reserve(pool)) {
+			free_work(work);
+			continue;
 		}
-		if (ts >= max_staged)
-			pool_tclear(pool, &pool->lagging);
-		if (pool_tclear(pool, &pool->idle))
-			pool_resus(pool);
-
-		applog(LOG_DEBUG, "Generated getwork work");
-		stage_work(work);
-		push_curl_entry(ce, pool);
+		work->pool = pool;
+		get_upstream_work_async(work, ts >= max_staged);
 	}
 
 	return 0;
@@ -476,6 +476,11 @@ struct cgpu_info {
     uint virtual_adl;
 	int intensity;
 	bool dynamic;
+	/* Dynamic intensity aims for opt_throughput_interval instead of
+	 * opt_dynamic_interval */
+	bool dyn_throughput;
+	/* Given with --intensity, so autotuning leaves it alone */
+	bool intensity_set;
 
 	cl_uint vwidth;
 	size_t work_size;
@@ -492,8 +497,11 @@ struct cgpu_info {
 	size_t opt_tc, thread_concurrency;
 	size_t shaders;
 #endif
-	struct timeval tv_gpustart;
-	int intervals;
+	/* Dynamic intensity controller: the global work size it is steering
+	 * and kernel time and work accumulated since its last update */
+	double dyn_threads;
+	double dyn_sum_us;
+	double dyn_sum_threads;
 #endif
 
 	bool new_work;
@@ -584,6 +592,30 @@ extern void thr_info_freeze(struct thr_info *thr);
 extern void nmsleep(unsigned int msecs);
 extern double us_tdiff(struct timeval *end, struct timeval *start);
 extern double tdiff(struct timeval *end, struct timeval *start);
+extern double thread_cputime(void);
+
+#define LATENCY_BUCKETS 24
+
+/* Log2 histogram of latencies: bucket i counts samples of 2^i up to 2^(i+1)
+ * microseconds, with the last bucket taking everything slower */
+struct latency_hist {
+	uint64_t samples;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[LATENCY_BUCKETS];
+};
+
+enum pool_latency {
+	LATENCY_JOB_HASH,	/* New job (stratum notify or getwork) to first hash */
+	LATENCY_FOUND_SUBMIT,	/* Nonce found to share sent */
+	LATENCY_SUBMIT_REPLY,	/* Share sent to the pool's answer */
+	LATENCY_MAX,
+};
+
+extern const char *latency_names[LATENCY_MAX];
+extern void latency_add(struct latency_hist *, struct timeval *start, struct timeval *end);
+extern void latency_add_us(struct latency_hist *, uint64_t us);
+extern double latency_pct(struct latency_hist *, double pct);
 
 struct string_elist {
 	char *string;
@@ -739,6 +771,7 @@ extern bool opt_protocol;
 extern char *opt_coinbase_sig;
 extern bool have_longpoll;
 extern int opt_skip_checks;
+extern bool opt_extranonce_subscribe;
 extern char *opt_kernel_path;
 extern char *opt_socks_proxy;
 extern char *cgminer_path;
@@ -936,22 +969,26 @@ enum pool_protocol {
 	PLP_GETBLOCKTEMPLATE,
 };
 
+/* The current stratum job, kept decoded so that work generation never has to
+ * touch hex. Only job_id and ntime are kept as strings for share submission */
 struct stratum_work {
 	char *job_id;
-	char *prev_hash;
-	char *coinbase1;
-	char *coinbase2;
-	char **merkle;
-	char *bbversion;
-	char *nbit;
 	char *ntime;
+	unsigned char *coinbase1;
+	unsigned char *coinbase2;
+	unsigned char *merkle;
+	unsigned char prev_hash[32];
+	unsigned char bbversion[4];
+	unsigned char nbit[4];
+	unsigned char ntime_bin[4];
 	bool clean;
 
+	struct timeval tv_notify;
+	bool hashed;
+
 	size_t cb1_len;
 	size_t cb2_len;
-	size_t cb_len;
 
-	size_t header_len;
 	int merkles;
 	double diff;
 
@@ -963,6 +1000,19 @@ struct stratum_work {
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
+/* Where a pool's stratum connection is at as far as the stratum reactor is
+ * concerned */
+enum stratum_state {
+	STRATUM_NONE,
+	STRATUM_DOWN,
+	STRATUM_RESOLVING,
+	STRATUM_CONNECTING,
+	STRATUM_PROXYING,
+	STRATUM_SUBSCRIBING,
+	STRATUM_AUTHORISING,
+	STRATUM_ACTIVE,
+};
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -976,6 +1026,7 @@ struct pool {
 	double diff_accepted;
 	double diff_rejected;
 	double diff_stale;
+	double diff_filtered;
 
 	bool submit_fail;
 	bool idle;
@@ -997,7 +1048,11 @@ struct pool {
 	curl_socket_t lp_socket;
 
 	unsigned int getwork_requested;
+	/* Asynchronous getwork/GBT requests in flight, protected by stgd_lock */
+	int getwork_inflight;
+	time_t getwork_retry;
 	unsigned int stale_shares;
+	unsigned int filtered_shares;
 	unsigned int discarded_work;
 	unsigned int getfail_occasions;
 	unsigned int remotefail_occasions;
@@ -1016,7 +1071,6 @@ double last_shares, shares;
 	struct thread_q *submit_q;
 	struct thread_q *getwork_q;
 
-	pthread_t longpoll_thread;
 	pthread_t submit_thread;
 	pthread_t getwork_thread;
 
@@ -1039,24 +1093,82 @@ double last_shares, shares;
 	SOCKETTYPE sock;
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_head, sockbuf_tail, sockbuf_scan;
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *nonce1;
 	size_t n1_len;
 	uint32_t nonce2;
 	int n2size;
+	char *nonce1_next; /* from mining.set_extranonce, until the next notify */
+	int n2size_next;
+	char *sessionid;
+	bool session_resumed;
 	bool has_stratum;
 	bool stratum_active;
 	time_t last_work_time;  /* only set for Stratum right now */
 	bool stratum_auth;
 	bool stratum_notify;
 	struct stratum_work swork;
-	pthread_t stratum_thread;
 	pthread_mutex_t stratum_lock;
 
+	/* Stratum reactor variables */
+	enum stratum_state stratum_state;
+	bool stratum_reconnect;
+	int stratum_proxied;
+	/* Handed over by the resolver helper: 1 with the address, -1 if the
+	 * lookup failed */
+	int stratum_resolved;
+	struct addrinfo *stratum_addr;
+	int stratum_backoff;
+	struct timeval tv_stratum_timer;
+	time_t stratum_resume_until;
+	SOCKETTYPE stratum_watched;
+	int stratum_events;
+	struct submit_work_state *sws_waiting_on_sock;
+	char *sendbuf;
+	size_t sendbuf_size, sendbuf_len;
+	struct stratum_share *sshares;
+	unsigned int sshare_id;
+	/* No share older than this is still in flight */
+	unsigned int sshare_oldest;
+	int shares_inflight;
+	double suggested_diff;
+	time_t suggest_time;
+	struct work *standby_work;
+
+	/* Pipeline latency, protected by pool_lock */
+	struct latency_hist latency[LATENCY_MAX];
+
+	/* Stratum CPU cost in microseconds, protected by pool_lock */
+	unsigned int notifies, gen_works;
+	double notify_cpu, gen_work_cpu;
+
 	pthread_mutex_t last_work_lock;
 	struct work *last_work_copy;
 };
 
+/* Bytes at the start of a pool's extranonce2 that the stratum server hands
+ * out to downstream miners, as a prefix of their extranonce1 */
+#define STRATUMSRV_N2_RESERVED 2
+
+extern int opt_stratum_port;
+
+/* None unless the server is on and each side keeps two bytes to roll */
+static inline int stratumsrv_n2_reserved(const struct pool *pool)
+{
+	if (opt_stratum_port && pool->n2size >= STRATUMSRV_N2_RESERVED + 2)
+		return STRATUMSRV_N2_RESERVED;
+	return 0;
+}
+
+extern void stratum_work_cpy(struct stratum_work *dst, const struct stratum_work *src);
+extern void stratum_work_clean(struct stratum_work *swork);
+extern struct work *stratumsrv_work(struct pool *pool, const struct stratum_work *swork,
+				    const char *nonce1, const char *nonce2, const char *ntime,
+				    const char *nonce);
+extern void *stratumsrv_thread(void *userdata);
+extern void stratumsrv_update(void);
+
 #define GETWORK_MODE_TESTPOOL 'T'
 #define GETWORK_MODE_POOL 'P'
 #define GETWORK_MODE_LP 'L'
@@ -1111,6 +1223,7 @@ struct work {
 	struct timeval	tv_getwork_reply;
 	struct timeval	tv_cloned;
 	struct timeval	tv_work_start;
+	struct timeval	tv_notify;
 	struct timeval	tv_work_found;
 	char		getwork_mode;
 
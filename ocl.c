@@ -17,6 +17,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <sys/types.h>
 
 #ifdef WIN32
@@ -37,6 +38,7 @@
 
 #include "findnonce.h"
 #include "ocl.h"
+#include "sha2.h"
 
 extern uint opencl_devnum;
 
@@ -117,6 +119,10 @@ CL_API_ENTRY cl_mem CL_API_CALL
                void *       /* host_ptr */,
                cl_int *     /* errcode_ret */) CL_API_SUFFIX__VERSION_1_0;
 
+extern
+CL_API_ENTRY cl_int CL_API_CALL
+(*clReleaseMemObject)(cl_mem /* memobj */) CL_API_SUFFIX__VERSION_1_0;
+
 /* Program Object APIs  */
 extern
 CL_API_ENTRY cl_program CL_API_CALL
@@ -227,6 +233,12 @@ CL_API_ENTRY cl_int CL_API_CALL
                        cl_event *       /* event */) CL_API_SUFFIX__VERSION_1_0;
 
 int opt_platform_id = -1;
+bool opt_opencl_cpu;
+bool opt_opencl_profile;
+char *opt_kernel_cache;
+
+/* CPU devices are only useful for testing the OpenCL code paths */
+#define OCL_DEVICE_TYPE (opt_opencl_cpu ? CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_GPU)
 
 char *file_contents(const char *filename, int *length)
 {
@@ -314,7 +326,7 @@ int clDevicesNum(void) {
 		status = clGetPlatformInfo(platform, CL_PLATFORM_VERSION, sizeof(pbuff), pbuff, NULL);
 		if (status == CL_SUCCESS)
         applog(LOG_INFO, "OpenCL platform %d version: %s", i, pbuff);
-		status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, NULL, &numDevices);
+		status = clGetDeviceIDs(platform, OCL_DEVICE_TYPE, 0, NULL, &numDevices);
 		if (status != CL_SUCCESS) {
 			applog(LOG_ERR, "Error %d: Getting Device IDs (num)", status);
 			if ((int)i != opt_platform_id)
@@ -333,7 +345,7 @@ int clDevicesNum(void) {
 			char pbuff[256];
 			cl_device_id *devices = (cl_device_id *)malloc(numDevices*sizeof(cl_device_id));
 
-			clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, numDevices, devices, NULL);
+			clGetDeviceIDs(platform, OCL_DEVICE_TYPE, numDevices, devices, NULL);
 			for (j = 0; j < numDevices; j++) {
 				clGetDeviceInfo(devices[j], CL_DEVICE_NAME, sizeof(pbuff), pbuff, NULL);
                 applog(LOG_INFO, "\t%i\t%s%s", j, pbuff, (j + 1 == numDevices) ? "\n" : "");
@@ -407,10 +419,301 @@ void patch_opcodes(char *w, unsigned remaining)
 	applog(LOG_DEBUG, "Patched a total of %i BFI_INT instructions", patched);
 }
 
+/* Kernel binary cache.
+ *
+ * Binaries live in a cache directory as <kernel>-<key>.bin, where the key is
+ * a SHA-256 over the kernel source, the compiler options and the identity of
+ * the device, its driver and the platform. Any change to one of those lands
+ * on a different file, so a stale binary is never picked up after an
+ * upgrade or a settings change. Files are written to a temporary name and
+ * renamed into place so that a concurrent or interrupted writer can't leave
+ * a truncated binary behind.
+ *
+ * Within one process, each key is built at most once and the result is kept
+ * in memory for any other device with identical settings. */
+
+#define SHA256_HEX_LEN 64
+
+struct kernel_binary {
+	char key[SHA256_HEX_LEN + 1];
+	unsigned char *data;
+	size_t size;
+	bool building;
+	struct kernel_binary *next;
+};
+
+static pthread_mutex_t kernel_cache_lock;
+static pthread_cond_t kernel_cache_cond;
+static struct kernel_binary *kernel_binaries;
+
+/* initCl() runs for several devices at once, and the first of them to find
+ * an AMD or NVIDIA platform brings up the management library */
+static pthread_mutex_t mgmt_lock;
+
+void init_ocl(void)
+{
+	mutex_init(&kernel_cache_lock);
+	if (unlikely(pthread_cond_init(&kernel_cache_cond, NULL)))
+		quit(1, "Failed to pthread_cond_init kernel_cache_cond");
+	mutex_init(&mgmt_lock);
+}
+
+static void kernel_cache_key(char *key, const char *source, int sourcelen,
+			     const char *options, cl_device_id device,
+			     const char *devname, const char *platver)
+{
+	char buf[256] = "";
+	unsigned char hash[32];
+	sha2_context ctx;
+	const int lsize = sizeof(long);
+
+	sha2_starts(&ctx);
+	sha2_update(&ctx, (const unsigned char *)source, sourcelen);
+	/* The NULs keep adjacent fields from running into each other */
+	sha2_update(&ctx, (const unsigned char *)options, strlen(options) + 1);
+	sha2_update(&ctx, (const unsigned char *)devname, strlen(devname) + 1);
+	clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(buf) - 1, buf, NULL);
+	sha2_update(&ctx, (const unsigned char *)buf, strlen(buf) + 1);
+	buf[0] = '\0';
+	clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(buf) - 1, buf, NULL);
+	sha2_update(&ctx, (const unsigned char *)buf, strlen(buf) + 1);
+	sha2_update(&ctx, (const unsigned char *)platver, strlen(platver) + 1);
+	sha2_update(&ctx, (const unsigned char *)&lsize, sizeof(lsize));
+	sha2_finish(&ctx, hash);
+
+	_bin2hex(key, hash, sizeof(hash));
+}
+
+static bool kernel_cache_mkdir(const char *dir)
+{
+#ifdef WIN32
+	if (mkdir(dir) && errno != EEXIST)
+#else
+	if (mkdir(dir, 0777) && errno != EEXIST)
+#endif
+	{
+		applog(LOG_DEBUG, "Unable to create kernel cache directory %s: %s",
+		       dir, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* Fills in the cache file name for a kernel, creating the cache directory
+ * if needed. Defaults to ~/.nsgminer/kernels/ alongside the config file */
+static bool kernel_cache_path(char *path, size_t pathsz, const char *kname,
+			      const char *key)
+{
+	char dir[PATH_MAX];
+	int len;
+
+	if (opt_kernel_cache && *opt_kernel_cache) {
+		snprintf(dir, sizeof(dir), "%s", opt_kernel_cache);
+		len = strlen(dir);
+		while (len > 1 && (dir[len - 1] == '/' || dir[len - 1] == '\\'))
+			dir[--len] = '\0';
+	} else {
+#if defined(unix) || defined(__APPLE__)
+		if (getenv("HOME") && *getenv("HOME"))
+			snprintf(dir, sizeof(dir), "%s/.nsgminer", getenv("HOME"));
+		else
+			strcpy(dir, ".nsgminer");
+		if (!kernel_cache_mkdir(dir))
+			return false;
+		strcat(dir, "/kernels");
+#else
+		strcpy(dir, "kernels");
+#endif
+	}
+	if (!kernel_cache_mkdir(dir))
+		return false;
+
+	len = snprintf(path, pathsz, "%s/%s-%s.bin", dir, kname, key);
+	return len > 0 && (size_t)len < pathsz;
+}
+
+static char *kernel_cache_read(const char *path, size_t *size)
+{
+	struct stat binary_stat;
+	char *data;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+
+	if (unlikely(fstat(fileno(f), &binary_stat)) || !binary_stat.st_size) {
+		applog(LOG_DEBUG, "Unable to stat binary, generating from source");
+		fclose(f);
+		return NULL;
+	}
+
+	*size = binary_stat.st_size;
+	data = malloc(*size);
+	if (unlikely(!data)) {
+		applog(LOG_ERR, "Unable to malloc binary");
+		fclose(f);
+		return NULL;
+	}
+
+	if (fread(data, 1, *size, f) != *size) {
+		applog(LOG_ERR, "Unable to fread binary %s", path);
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+
+	return data;
+}
+
+static void kernel_cache_write(const char *path, const unsigned char *data, size_t size)
+{
+	char tmppath[PATH_MAX];
+	FILE *f;
+
+	snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, (int)getpid());
+	f = fopen(tmppath, "wb");
+	if (!f) {
+		applog(LOG_DEBUG, "Unable to create file %s", tmppath);
+		return;
+	}
+
+	if (unlikely(fwrite(data, 1, size, f) != size)) {
+		applog(LOG_ERR, "Unable to fwrite to %s", tmppath);
+		fclose(f);
+		unlink(tmppath);
+		return;
+	}
+	if (unlikely(fclose(f))) {
+		applog(LOG_ERR, "Unable to write %s", tmppath);
+		unlink(tmppath);
+		return;
+	}
+
+	/* Can only fail on Windows if someone else got there first, in which
+	 * case their copy is just as good */
+	if (rename(tmppath, path)) {
+		applog(LOG_DEBUG, "Unable to rename %s to %s", tmppath, path);
+		unlink(tmppath);
+		return;
+	}
+	applog(LOG_DEBUG, "Saved binary image %s", path);
+}
+
+/* Returns the in-memory entry for a cache key. If it has no data yet, the
+ * caller is responsible for building it and must kernel_binary_publish()
+ * the result (or failure); other callers wait for that meanwhile. */
+static struct kernel_binary *kernel_binary_claim(const char *key)
+{
+	struct kernel_binary *kb;
+
+	mutex_lock(&kernel_cache_lock);
+	for (kb = kernel_binaries; kb; kb = kb->next)
+		if (!strcmp(kb->key, key))
+			break;
+	if (kb) {
+		while (kb->building)
+			pthread_cond_wait(&kernel_cache_cond, &kernel_cache_lock);
+	} else {
+		kb = calloc(1, sizeof(*kb));
+		if (unlikely(!kb))
+			quit(1, "Failed to calloc kernel_binary");
+		strcpy(kb->key, key);
+		kb->next = kernel_binaries;
+		kernel_binaries = kb;
+	}
+	if (!kb->size)
+		kb->building = true;
+	mutex_unlock(&kernel_cache_lock);
+
+	return kb;
+}
+
+static void kernel_binary_publish(struct kernel_binary *kb,
+				  const unsigned char *data, size_t size)
+{
+	mutex_lock(&kernel_cache_lock);
+	if (data && !kb->size) {
+		kb->data = malloc(size);
+		if (likely(kb->data)) {
+			memcpy(kb->data, data, size);
+			kb->size = size;
+		}
+	}
+	kb->building = false;
+	pthread_cond_broadcast(&kernel_cache_cond);
+	mutex_unlock(&kernel_cache_lock);
+}
+
+/* Describes a device well enough to tell whether tuning results measured
+ * on one apply to another: same model, size and driver */
+bool clDeviceIdent(unsigned int gpu, char *buf, size_t bufsz)
+{
+	cl_platform_id *platforms;
+	cl_device_id *devices;
+	cl_uint numPlatforms, numDevices, cus = 0;
+	cl_ulong mem = 0;
+	char devname[256] = "", drvver[256] = "";
+	cl_int status;
+
+	status = clGetPlatformIDs(0, NULL, &numPlatforms);
+	if (status != CL_SUCCESS || opt_platform_id < 0 || opt_platform_id >= (int)numPlatforms)
+		return false;
+	platforms = (cl_platform_id *)alloca(numPlatforms*sizeof(cl_platform_id));
+	status = clGetPlatformIDs(numPlatforms, platforms, NULL);
+	if (status != CL_SUCCESS)
+		return false;
+
+	status = clGetDeviceIDs(platforms[opt_platform_id], OCL_DEVICE_TYPE, 0, NULL, &numDevices);
+	if (status != CL_SUCCESS || gpu >= numDevices)
+		return false;
+	devices = (cl_device_id *)alloca(numDevices*sizeof(cl_device_id));
+	status = clGetDeviceIDs(platforms[opt_platform_id], OCL_DEVICE_TYPE, numDevices, devices, NULL);
+	if (status != CL_SUCCESS)
+		return false;
+
+	clGetDeviceInfo(devices[gpu], CL_DEVICE_NAME, sizeof(devname) - 1, devname, NULL);
+	clGetDeviceInfo(devices[gpu], CL_DRIVER_VERSION, sizeof(drvver) - 1, drvver, NULL);
+	clGetDeviceInfo(devices[gpu], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cus), &cus, NULL);
+	clGetDeviceInfo(devices[gpu], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(mem), &mem, NULL);
+
+	snprintf(buf, bufsz, "%s/%ucu/%luMB/%s", devname, (uint)cus,
+		 (unsigned long)(mem >> 20), drvver);
+	return true;
+}
+
+/* Releases everything initCl() created */
+void freeCl(_clState *clState)
+{
+	uint i;
+
+	if (!clState)
+		return;
+
+	for (i = 0; i < OCL_PIPELINE_DEPTH; i++)
+		if (clState->outputBuffers[i])
+			clReleaseMemObject(clState->outputBuffers[i]);
+#if defined(USE_NEOSCRYPT) || defined(USE_SCRYPT)
+	if (clState->CLbuffer0)
+		clReleaseMemObject(clState->CLbuffer0);
+	if (clState->padbuffer8)
+		clReleaseMemObject(clState->padbuffer8);
+#endif
+	if (clState->kernel)
+		clReleaseKernel(clState->kernel);
+	if (clState->program)
+		clReleaseProgram(clState->program);
+	if (clState->commandQueue)
+		clReleaseCommandQueue(clState->commandQueue);
+	if (clState->context)
+		clReleaseContext(clState->context);
+	free(clState);
+}
+
 _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 {
 	_clState *clState = calloc(1, sizeof(_clState));
-	bool patchbfi = false, prog_built = false;
+	bool patchbfi = false;
 	struct cgpu_info *cgpu = &gpus[gpu];
 	cl_platform_id platform = NULL;
 	char pbuff[256], vbuff[255];
@@ -464,7 +767,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
     if(status == CL_SUCCESS)
       applog(LOG_INFO, "OpenCL platform version: %s", vbuff);
 
-	status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, NULL, &numDevices);
+	status = clGetDeviceIDs(platform, OCL_DEVICE_TYPE, 0, NULL, &numDevices);
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Getting Device IDs (num)", status);
 		return NULL;
@@ -475,7 +778,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 
 		/* Now, get the device list data */
 
-		status = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, numDevices, devices, NULL);
+		status = clGetDeviceIDs(platform, OCL_DEVICE_TYPE, numDevices, devices, NULL);
 		if (status != CL_SUCCESS) {
 			applog(LOG_ERR, "Error %d: Getting Device IDs (list)", status);
 			return NULL;
@@ -503,6 +806,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 
 			applog(LOG_INFO, "Selected %i: %s", gpu, pbuff);
 			strncpy(name, pbuff, nameSize);
+			clState->device = devices[gpu];
 		} else {
 			applog(LOG_ERR, "Invalid GPU %i", gpu);
 			return NULL;
@@ -510,6 +814,7 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 
 	} else return NULL;
 
+    mutex_lock(&mgmt_lock);
 #ifdef HAVE_ADL
     if(amd_platform && !opt_noadl && !adl_active) {
         init_adl(nDevs);
@@ -532,10 +837,11 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
         }
     }
 #endif
+    mutex_unlock(&mgmt_lock);
 
 	cl_context_properties cps[3] = { CL_CONTEXT_PLATFORM, (cl_context_properties)platform, 0 };
 
-	clState->context = clCreateContextFromType(cps, CL_DEVICE_TYPE_GPU, NULL, NULL, &status);
+	clState->context = clCreateContextFromType(cps, OCL_DEVICE_TYPE, NULL, NULL, &status);
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Creating Context. (clCreateContextFromType)", status);
 		return NULL;
@@ -544,10 +850,10 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	/////////////////////////////////////////////////////////////////
 	// Create an OpenCL command queue
 	/////////////////////////////////////////////////////////////////
+	/* In order, since opencl_scanhash relies on each batch's kernel,
+	 * result read and buffer clear running in the order they are queued */
 	clState->commandQueue = clCreateCommandQueue(clState->context, devices[gpu],
-						     CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &status);
-	if (status != CL_SUCCESS) /* Try again without OOE enable */
-		clState->commandQueue = clCreateCommandQueue(clState->context, devices[gpu], 0 , &status);
+		opt_opencl_profile ? CL_QUEUE_PROFILING_ENABLE : 0, &status);
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Creating Command Queue. (clCreateCommandQueue)", status);
 		return NULL;
@@ -602,16 +908,10 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	}
 	applog(LOG_DEBUG, "Max mem alloc size is %lu", (unsigned long)cgpu->max_alloc);
 
-	/* Create binary filename based on parameters passed to opencl
-	 * compiler to ensure we only load a binary that matches what would
-	 * have otherwise created. The filename is:
-	 * kernelname + name +/- g(offset) + v + vectors + w + work_size + l + sizeof(long) + p + platform version + .bin
-	 * For scrypt the filename is:
-	 * kernelname + name + g + lg + lookup_gap + tc + thread_concurrency + w + work_size + l + sizeof(long) + p + platform version + .bin
-	 */
-	char binaryfilename[255];
+	/* Compiled binaries are cached under the kernel name plus a hash of
+	 * everything that goes into the build, see kernel_cache_key() */
+	char binaryfilename[255] = "";
 	char filename[255];
-	char numbuf[32];
 
    if(cgpu->kernel == KL_VOID) {
 #ifdef USE_NEOSCRYPT
@@ -770,9 +1070,13 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	}
 #endif
 
-	FILE *binaryfile;
 	size_t *binary_sizes;
 	char **binaries;
+	const unsigned char *binary = NULL;
+	size_t binary_size = 0;
+	char cachekey[SHA256_HEX_LEN + 1];
+	char cachefile[PATH_MAX];
+	struct kernel_binary *kb;
 	int pl;
 	char *source = file_contents(filename, &pl);
 	size_t sourceSize[] = {(size_t)pl};
@@ -794,76 +1098,81 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 		return NULL;
 	}
 
-	strcat(binaryfilename, name);
-	if (clState->goffset)
-		strcat(binaryfilename, "g");
+	char *CompilerOptions = calloc(1, 256);
 
 #ifdef USE_NEOSCRYPT
     if(opt_neoscrypt) {
-        /* Nothing here */
+        sprintf(CompilerOptions, "-D WORKSIZE=%d", (int)clState->wsize);
     } else
 #endif
 #ifdef USE_SCRYPT
     if(opt_scrypt) {
-        sprintf(numbuf, "lg%utc%u", cgpu->lookup_gap, (uint)cgpu->thread_concurrency);
-        strcat(binaryfilename, numbuf);
+        sprintf(CompilerOptions, "-D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%d -D WORKSIZE=%d",
+          cgpu->lookup_gap, (uint)cgpu->thread_concurrency, (int)clState->wsize);
     } else
 #endif
 #ifdef USE_SHA256D
     if(opt_sha256d) {
-        sprintf(numbuf, "v%d", clState->vwidth);
-        strcat(binaryfilename, numbuf);
+        sprintf(CompilerOptions, "-D WORKSIZE=%d -D VECTORS%d -D WORKVEC=%d",
+          (int)clState->wsize, clState->vwidth, (int)clState->wsize * clState->vwidth);
     } else
 #endif
     { }
 
-	sprintf(numbuf, "w%d", (int)clState->wsize);
-	strcat(binaryfilename, numbuf);
-	sprintf(numbuf, "l%d", (int)sizeof(long));
-	strcat(binaryfilename, numbuf);
-	sanestr(binaryfilename, binaryfilename);
-	strcat(binaryfilename, ".bin");
+    applog(LOG_DEBUG, "Setting work size to %d", (int)clState->wsize);
 
-	binaryfile = fopen(binaryfilename, "rb");
-	if (!binaryfile) {
-		applog(LOG_DEBUG, "No binary found, generating from source");
-	} else {
-		struct stat binary_stat;
+	if (clState->vwidth > 1)
+		applog(LOG_DEBUG, "Patched source to suit %d vectors", clState->vwidth);
 
-		if (unlikely(stat(binaryfilename, &binary_stat))) {
-			applog(LOG_DEBUG, "Unable to stat binary, generating from source");
-			fclose(binaryfile);
-			goto build;
-		}
-		if (!binary_stat.st_size)
-			goto build;
+	if (clState->hasBitAlign) {
+		strcat(CompilerOptions, " -D BITALIGN");
+		applog(LOG_DEBUG, "cl_amd_media_ops found, setting BITALIGN");
+	} else
+		applog(LOG_DEBUG, "cl_amd_media_ops not found, will not set BITALIGN");
 
-		binary_sizes[slot] = binary_stat.st_size;
-		binaries[slot] = (char *)calloc(binary_sizes[slot], 1);
-		if (unlikely(!binaries[slot])) {
-			applog(LOG_ERR, "Unable to calloc binaries");
-			fclose(binaryfile);
-			return NULL;
-		}
+	if (clState->goffset)
+		strcat(CompilerOptions, " -D GOFFSET");
 
-		if (fread(binaries[slot], 1, binary_sizes[slot], binaryfile) != binary_sizes[slot]) {
-			applog(LOG_ERR, "Unable to fread binaries");
-			fclose(binaryfile);
-			free(binaries[slot]);
-			goto build;
-		}
+	if (!clState->hasOpenCL11plus)
+		strcat(CompilerOptions, " -D OCL1");
+
+	applog(LOG_DEBUG, "CompilerOptions: %s", CompilerOptions);
 
-		clState->program = clCreateProgramWithBinary(clState->context, 1, &devices[gpu], &binary_sizes[slot], (const unsigned char **)binaries, &status, NULL);
+	kernel_cache_key(cachekey, source, pl, CompilerOptions, devices[gpu], name, vbuff);
+	if (!kernel_cache_path(cachefile, sizeof(cachefile), binaryfilename, cachekey))
+		cachefile[0] = '\0';
+
+	/* Identical devices with identical settings share one build; if
+	 * another thread is building this one, this waits for it */
+	kb = kernel_binary_claim(cachekey);
+	if (kb->size) {
+		binary = kb->data;
+		binary_size = kb->size;
+		applog(LOG_DEBUG, "Using binary image %s built for another device", cachekey);
+	} else if (cachefile[0]) {
+		binaries[0] = kernel_cache_read(cachefile, &binary_sizes[0]);
+		binary = (unsigned char *)binaries[0];
+		binary_size = binary_sizes[0];
+		if (!binary)
+			applog(LOG_DEBUG, "No binary found, generating from source");
+	}
+
+	if (binary) {
+		clState->program = clCreateProgramWithBinary(clState->context, 1, &devices[gpu], &binary_size, &binary, &status, NULL);
 		if (status != CL_SUCCESS) {
 			applog(LOG_ERR, "Error %d: Loading Binary into cl_program (clCreateProgramWithBinary)", status);
-			fclose(binaryfile);
-			free(binaries[slot]);
 			goto build;
 		}
 
-		fclose(binaryfile);
-		applog(LOG_DEBUG, "Loaded binary image %s", binaryfilename);
+		/* create a cl program executable for all the devices specified */
+		status = clBuildProgram(clState->program, 1, &devices[gpu], NULL, NULL, NULL);
+		if (status != CL_SUCCESS) {
+			applog(LOG_WARNING, "Error %d: Cached binary %s unusable, rebuilding from source", status, cachefile);
+			clReleaseProgram(clState->program);
+			goto build;
+		}
 
+		applog(LOG_DEBUG, "Loaded binary image %s", cachefile[0] ? cachefile : cachekey);
 		goto built;
 	}
 
@@ -872,54 +1181,19 @@ _clState *initCl(unsigned int gpu, char *name, size_t nameSize)
 	/////////////////////////////////////////////////////////////////
 
 build:
+	free(binaries[0]);
+	binaries[0] = NULL;
+	binary = NULL;
+	binary_size = 0;
+
 	clState->program = clCreateProgramWithSource(clState->context, 1, (const char **)&source, sourceSize, &status);
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Loading Binary into cl_program (clCreateProgramWithSource)", status);
-		return NULL;
+		goto fail;
 	}
 
 	/* create a cl program executable for all the devices specified */
-	char *CompilerOptions = calloc(1, 256);
-
-#ifdef USE_NEOSCRYPT
-    if(opt_neoscrypt) {
-        sprintf(CompilerOptions, "-D WORKSIZE=%d", (int)clState->wsize);
-    } else
-#endif
-#ifdef USE_SCRYPT
-    if(opt_scrypt) {
-        sprintf(CompilerOptions, "-D LOOKUP_GAP=%d -D CONCURRENT_THREADS=%d -D WORKSIZE=%d",
-          cgpu->lookup_gap, (uint)cgpu->thread_concurrency, (int)clState->wsize);
-    } else
-#endif
-#ifdef USE_SHA256D
-    if(opt_sha256d) {
-        sprintf(CompilerOptions, "-D WORKSIZE=%d -D VECTORS%d -D WORKVEC=%d",
-          (int)clState->wsize, clState->vwidth, (int)clState->wsize * clState->vwidth);
-    } else
-#endif
-    { }
-
-    applog(LOG_DEBUG, "Setting work size to %d", (int)clState->wsize);
-
-	if (clState->vwidth > 1)
-		applog(LOG_DEBUG, "Patched source to suit %d vectors", clState->vwidth);
-
-	if (clState->hasBitAlign) {
-		strcat(CompilerOptions, " -D BITALIGN");
-		applog(LOG_DEBUG, "cl_amd_media_ops found, setting BITALIGN");
-	} else
-		applog(LOG_DEBUG, "cl_amd_media_ops not found, will not set BITALIGN");
-
-	if (clState->goffset)
-		strcat(CompilerOptions, " -D GOFFSET");
-
-	if (!clState->hasOpenCL11plus)
-		strcat(CompilerOptions, " -D OCL1");
-
-	applog(LOG_DEBUG, "CompilerOptions: %s", CompilerOptions);
 	status = clBuildProgram(clState->program, 1, &devices[gpu], CompilerOptions , NULL, NULL);
-	free(CompilerOptions);
 
 	if (status != CL_SUCCESS) {
 		applog(LOG_ERR, "Error %d: Building Program (clBuildProgram)", status);
@@ -929,21 +1203,19 @@ build:
 		char *log = malloc(logSize);
 		status = clGetProgramBuildInfo(clState->program, devices[gpu], CL_PROGRAM_BUILD_LOG, logSize, log, NULL);
 		applog(LOG_ERR, "%s", log);
-		return NULL;
+		goto fail;
 	}
 
-	prog_built = true;
-
 	status = clGetProgramInfo(clState->program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &cpnd, NULL);
 	if (unlikely(status != CL_SUCCESS)) {
 		applog(LOG_ERR, "Error %d: Getting program info CL_PROGRAM_NUM_DEVICES. (clGetProgramInfo)", status);
-		return NULL;
+		goto fail;
 	}
 
 	status = clGetProgramInfo(clState->program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t)*cpnd, binary_sizes, NULL);
 	if (unlikely(status != CL_SUCCESS)) {
 		applog(LOG_ERR, "Error %d: Getting program info CL_PROGRAM_BINARY_SIZES. (clGetProgramInfo)", status);
-		return NULL;
+		goto fail;
 	}
 
 	/* The actual compiled binary ends up in a RANDOM slot! Grr, so we have
@@ -958,53 +1230,33 @@ build:
 	       gpu, (unsigned)slot, (int64_t)binary_sizes[slot]);
 	if (!binary_sizes[slot]) {
 		applog(LOG_ERR, "OpenCL compiler generated a zero sized binary, FAIL!");
-		return NULL;
+		goto fail;
 	}
 	binaries[slot] = calloc(sizeof(char) * binary_sizes[slot], 1);
 	status = clGetProgramInfo(clState->program, CL_PROGRAM_BINARIES, sizeof(char *) * cpnd, binaries, NULL );
 	if (unlikely(status != CL_SUCCESS)) {
 		applog(LOG_ERR, "Error %d: Getting program info. CL_PROGRAM_BINARIES (clGetProgramInfo)", status);
-		return NULL;
+		goto fail;
 	}
+	binary = (unsigned char *)binaries[slot];
+	binary_size = binary_sizes[slot];
 
-	free(source);
+	/* Save the binary to be loaded next time; not a fatal problem if
+	 * this fails, it just means we build it again next time */
+	if (cachefile[0])
+		kernel_cache_write(cachefile, binary, binary_size);
 
-	/* Save the binary to be loaded next time */
-	binaryfile = fopen(binaryfilename, "wb");
-	if (!binaryfile) {
-		/* Not a fatal problem, just means we build it again next time */
-		applog(LOG_DEBUG, "Unable to create file %s", binaryfilename);
-	} else {
-		if (unlikely(fwrite(binaries[slot], 1, binary_sizes[slot], binaryfile) != binary_sizes[slot])) {
-			applog(LOG_ERR, "Unable to fwrite to binaryfile");
-			return NULL;
-		}
-		fclose(binaryfile);
-	}
 built:
-	if (binaries[slot])
-		free(binaries[slot]);
+	kernel_binary_publish(kb, binary, binary_size);
+	free(binaries[slot]);
 	free(binaries);
 	free(binary_sizes);
+	free(CompilerOptions);
+	free(source);
 
 	applog(LOG_INFO, "Initialising kernel %s with%s bitalign, %"PRId64" vectors and worksize %"PRIu64,
 	       filename, clState->hasBitAlign ? "" : "out", (int64_t)clState->vwidth, (uint64_t)clState->wsize);
 
-	if (!prog_built) {
-		/* create a cl program executable for all the devices specified */
-		status = clBuildProgram(clState->program, 1, &devices[gpu], NULL, NULL, NULL);
-		if (status != CL_SUCCESS) {
-			applog(LOG_ERR, "Error %d: Building Program (clBuildProgram)", status);
-			size_t logSize;
-			status = clGetProgramBuildInfo(clState->program, devices[gpu], CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
-
-			char *log = malloc(logSize);
-			status = clGetProgramBuildInfo(clState->program, devices[gpu], CL_PROGRAM_BUILD_LOG, logSize, log, NULL);
-			applog(LOG_ERR, "%s", log);
-			return NULL;
-		}
-	}
-
 	/* get a kernel object handle for a kernel with the given name */
 	clState->kernel = clCreateKernel(clState->program, "search", &status);
 	if (status != CL_SUCCESS) {
@@ -1072,15 +1324,24 @@ built:
 #endif
     { }
 
-    clState->outputBuffer = clCreateBuffer(clState->context, CL_MEM_WRITE_ONLY,
-      BUFFERSIZE, NULL, &status);
+    /* In host memory, so that mapping the results of a batch copies nothing */
+    for(uint i = 0; i < OCL_PIPELINE_DEPTH; i++) {
+        clState->outputBuffers[i] = clCreateBuffer(clState->context,
+          CL_MEM_WRITE_ONLY | CL_MEM_ALLOC_HOST_PTR, BUFFERSIZE, NULL, &status);
 
-    if(status != CL_SUCCESS) {
-        applog(LOG_ERR, "Error %d in clCreateBuffer (output)", status);
-        return(NULL);
+        if(status != CL_SUCCESS) {
+            applog(LOG_ERR, "Error %d in clCreateBuffer (output)", status);
+            return(NULL);
+        }
     }
+    clState->outputBuffer = clState->outputBuffers[0];
 
     return(clState);
+
+fail:
+	/* Let anyone waiting on this build try for themselves */
+	kernel_binary_publish(kb, NULL, 0);
+	return NULL;
 }
 
 #endif /* HAVE_OPENCL */
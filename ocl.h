@@ -9,17 +9,27 @@
 
 #include "miner.h"
 
+/* Number of kernel batches each GPU thread keeps queued, each with its own
+ * output buffer */
+#define OCL_PIPELINE_DEPTH 2
+
 typedef struct {
 	cl_context context;
 	cl_kernel kernel;
 	cl_command_queue commandQueue;
 	cl_program program;
+	cl_device_id device;
+	/* outputBuffer is whichever of outputBuffers the next batch uses */
 	cl_mem outputBuffer;
+	cl_mem outputBuffers[OCL_PIPELINE_DEPTH];
 #if defined(USE_NEOSCRYPT) || defined(USE_SCRYPT)
 	cl_mem CLbuffer0;
 	cl_mem padbuffer8;
 	size_t padbufsize;
-	void * cldata;
+	/* Header and target the kernel arguments were last set up for */
+	unsigned char hdr[80];
+	cl_uint hdr_target;
+	bool hdr_valid;
 #endif
 	bool hasBitAlign;
 	bool hasOpenCL11plus;
@@ -32,6 +42,8 @@ typedef struct {
 
 extern char *file_contents(const char *filename, int *length);
 extern int clDevicesNum(void);
+extern bool clDeviceIdent(unsigned int gpu, char *buf, size_t bufsz);
 extern _clState *initCl(unsigned int gpu, char *name, size_t nameSize);
+extern void freeCl(_clState *clState);
 #endif /* HAVE_OPENCL */
 #endif /* __OCL_H__ */
@@ -0,0 +1,550 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* A small stand-alone stratum pool for load testing the miner's pool-facing
+ * code on a machine with no network. It sends a synthetic or recorded stream
+ * of mining.notify and mining.set_difficulty messages at a fixed rate and
+ * answers share submissions after a configurable delay, accepting them,
+ * rejecting every Nth one, or calling them stale when they are for a job
+ * made obsolete by a later clean notify. Counts are printed on SIGINT. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#ifndef WIN32
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_CLIENTS 64
+#define MAX_PENDING 4096
+#define MAX_REPLAY 65536
+#define MAX_JOBS 64
+#define LINE_MAX_LEN 65536
+
+struct reply {
+	uint64_t due;
+	char *line;
+};
+
+struct client {
+	int fd;
+	char *buf;
+	size_t len;
+	struct reply pending[MAX_PENDING];
+	unsigned int head, tail;
+};
+
+static int opt_port = 3333;
+static double opt_rate = 1.0 / 30;
+static int opt_merkles = 12;
+static double opt_diff = 1;
+static int opt_diff_every;
+static int opt_clean_every = 10;
+static int opt_latency;
+static int opt_reject_every;
+static char *opt_nonce1 = "08000002";
+static int opt_n2size = 4;
+static char *opt_replay;
+
+static struct client clients[MAX_CLIENTS];
+static int nclients;
+
+static char **replay;
+static int nreplay, replay_pos;
+
+static char jobs[MAX_JOBS][64];
+static int njobs;
+
+static unsigned long notifies, submits, accepted, rejected, stale, connections;
+static volatile sig_atomic_t done;
+
+static uint64_t now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void quit_sig(int __attribute__((unused)) sig)
+{
+	done = 1;
+}
+
+/* Copies the string value following "key": in a json line */
+static bool json_str(const char *line, const char *key, char *out, size_t size)
+{
+	const char *p = strstr(line, key), *end;
+
+	if (!p)
+		return false;
+	p = strchr(p + strlen(key), ':');
+	if (!p)
+		return false;
+	p += strspn(p + 1, " ") + 1;
+	if (*p != '"')
+		return false;
+	end = strchr(++p, '"');
+	if (!end || (size_t)(end - p) >= size)
+		return false;
+	memcpy(out, p, end - p);
+	out[end - p] = '\0';
+	return true;
+}
+
+/* Copies the raw id value, string or number, of a json request */
+static bool json_id(const char *line, char *out, size_t size)
+{
+	const char *p = strstr(line, "\"id\""), *end;
+
+	if (!p)
+		return false;
+	p = strchr(p + 4, ':');
+	if (!p)
+		return false;
+	p += strspn(p + 1, " ") + 1;
+	if (*p == '"') {
+		end = strchr(p + 1, '"');
+		if (!end)
+			return false;
+		end++;
+	} else
+		end = p + strcspn(p, ",} ");
+	if (end <= p || (size_t)(end - p) >= size)
+		return false;
+	memcpy(out, p, end - p);
+	out[end - p] = '\0';
+	return true;
+}
+
+/* Copies the nth string in the params array: the job id is the first of a
+ * notify and the second of a submit */
+static bool json_param(const char *line, int which, char *out, size_t size)
+{
+	const char *p = strstr(line, "\"params\""), *end = NULL;
+	int i;
+
+	if (!p || !(p = strchr(p, '[')))
+		return false;
+	for (i = 0; i <= which; i++) {
+		p = strchr(p, '"');
+		if (!p || !(end = strchr(++p, '"')))
+			return false;
+		if (i < which)
+			p = end + 1;
+	}
+	if ((size_t)(end - p) >= size)
+		return false;
+	memcpy(out, p, end - p);
+	out[end - p] = '\0';
+	return true;
+}
+
+static void send_line(struct client *c, const char *line)
+{
+	size_t len = strlen(line), sent = 0;
+
+	/* Blocking writes keep this simple; the miner reads promptly */
+	while (sent < len) {
+		ssize_t n = send(c->fd, line + sent, len - sent, MSG_NOSIGNAL);
+
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return;
+		}
+		sent += n;
+	}
+}
+
+static void broadcast(const char *line)
+{
+	int i;
+
+	for (i = 0; i < nclients; i++)
+		send_line(&clients[i], line);
+}
+
+static void queue_reply(struct client *c, uint64_t due, const char *line)
+{
+	struct reply *r;
+
+	if (c->tail - c->head >= MAX_PENDING) {
+		fprintf(stderr, "Too many replies pending, dropping one\n");
+		return;
+	}
+	r = &c->pending[c->tail++ % MAX_PENDING];
+	r->due = due;
+	r->line = strdup(line);
+}
+
+static void note_job(const char *line)
+{
+	char job_id[64];
+
+	if (!json_param(line, 0, job_id, sizeof(job_id)))
+		return;
+	/* A clean notify makes every earlier job stale */
+	if (strstr(line, "true]") || strstr(line, "true ]"))
+		njobs = 0;
+	if (njobs == MAX_JOBS) {
+		memmove(jobs[0], jobs[1], sizeof(jobs[0]) * (MAX_JOBS - 1));
+		njobs--;
+	}
+	strcpy(jobs[njobs++], job_id);
+}
+
+static bool job_valid(const char *job_id)
+{
+	int i;
+
+	for (i = 0; i < njobs; i++) {
+		if (!strcmp(jobs[i], job_id))
+			return true;
+	}
+	return false;
+}
+
+static void make_notify(char *line, size_t size, unsigned long n)
+{
+	static unsigned long block;
+	char *p = line;
+	bool clean;
+	int i;
+
+	clean = !n || (opt_clean_every && !(n % opt_clean_every));
+	if (clean)
+		block++;
+
+	p += snprintf(p, size, "{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"%lx\", \"%064lx\", "
+		      "\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\", "
+		      "\"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\", [",
+		      n, block);
+	for (i = 0; i < opt_merkles; i++)
+		p += sprintf(p, "%s\"%056lx%08x\"", i ? ", " : "", n, i);
+	sprintf(p, "], \"00000002\", \"1c2ac4af\", \"%08x\", %s]}\n", (unsigned int)time(NULL), clean ? "true" : "false");
+}
+
+static void send_diff(void)
+{
+	char line[256];
+
+	sprintf(line, "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%g]}\n", opt_diff);
+	broadcast(line);
+}
+
+/* Sends the next job, from the recording if there is one, to everybody */
+static void send_notify(char *line)
+{
+	if (replay) {
+		/* Recorded difficulty changes go out in their place too */
+		do {
+			strcpy(line, replay[replay_pos]);
+			replay_pos = (replay_pos + 1) % nreplay;
+			if (!strstr(line, "mining.set_difficulty"))
+				break;
+			broadcast(line);
+		} while (42);
+	} else {
+		if (opt_diff_every && notifies && !(notifies % opt_diff_every))
+			send_diff();
+		make_notify(line, LINE_MAX_LEN, notifies);
+	}
+	note_job(line);
+	broadcast(line);
+	notifies++;
+}
+
+static void handle_line(struct client *c, const char *line, const char *last_notify)
+{
+	char method[64], id[64], job_id[64], reply[256];
+	uint64_t now = now_ms();
+
+	if (!json_str(line, "\"method\"", method, sizeof(method)) || !json_id(line, id, sizeof(id)))
+		return;
+
+	if (!strcmp(method, "mining.subscribe")) {
+		sprintf(reply, "{\"id\": %s, \"result\": [[\"mining.notify\", \"%08x\"], \"%s\", %d], \"error\": null}\n",
+			id, (unsigned int)(c - clients), opt_nonce1, opt_n2size);
+		send_line(c, reply);
+	} else if (!strcmp(method, "mining.authorize")) {
+		sprintf(reply, "{\"id\": %s, \"result\": true, \"error\": null}\n", id);
+		send_line(c, reply);
+		sprintf(reply, "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%g]}\n", opt_diff);
+		if (!replay)
+			send_line(c, reply);
+		if (*last_notify)
+			send_line(c, last_notify);
+	} else if (!strcmp(method, "mining.submit")) {
+		submits++;
+		if (!json_param(line, 1, job_id, sizeof(job_id)) || !job_valid(job_id)) {
+			stale++;
+			sprintf(reply, "{\"id\": %s, \"result\": null, \"error\": [21, \"Job not found\", null]}\n", id);
+		} else if (opt_reject_every && !(submits % opt_reject_every)) {
+			rejected++;
+			sprintf(reply, "{\"id\": %s, \"result\": null, \"error\": [23, \"Low difficulty share\", null]}\n", id);
+		} else {
+			accepted++;
+			sprintf(reply, "{\"id\": %s, \"result\": true, \"error\": null}\n", id);
+		}
+		queue_reply(c, now + opt_latency, reply);
+	} else if (!strcmp(method, "mining.get_transactions")) {
+		sprintf(reply, "{\"id\": %s, \"result\": [], \"error\": null}\n", id);
+		send_line(c, reply);
+	} else {
+		sprintf(reply, "{\"id\": %s, \"result\": true, \"error\": null}\n", id);
+		send_line(c, reply);
+	}
+}
+
+static void drop_client(int i)
+{
+	struct client *c = &clients[i];
+
+	close(c->fd);
+	free(c->buf);
+	while (c->head != c->tail)
+		free(c->pending[c->head++ % MAX_PENDING].line);
+	clients[i] = clients[--nclients];
+}
+
+static bool read_client(struct client *c, const char *last_notify)
+{
+	ssize_t n;
+	char *eol, *start;
+
+	n = recv(c->fd, c->buf + c->len, LINE_MAX_LEN - c->len - 1, 0);
+	if (n <= 0)
+		return false;
+	c->len += n;
+	c->buf[c->len] = '\0';
+
+	start = c->buf;
+	while ((eol = strchr(start, '\n'))) {
+		*eol = '\0';
+		handle_line(c, start, last_notify);
+		start = eol + 1;
+	}
+	c->len -= start - c->buf;
+	memmove(c->buf, start, c->len);
+	if (c->len == LINE_MAX_LEN - 1)
+		return false;
+	return true;
+}
+
+/* Returns the end of the json object starting at s, or NULL if the line
+ * was cut short, as log lines sometimes are when interleaved */
+static char *json_end(char *s)
+{
+	bool quoted = false;
+	int depth = 0;
+
+	for (; *s; s++) {
+		if (quoted) {
+			if (*s == '\\' && s[1])
+				s++;
+			else if (*s == '"')
+				quoted = false;
+		} else if (*s == '"')
+			quoted = true;
+		else if (*s == '{' || *s == '[')
+			depth++;
+		else if ((*s == '}' || *s == ']') && !--depth)
+			return s + 1;
+	}
+	return NULL;
+}
+
+static void load_replay(const char *path)
+{
+	char *line = malloc(LINE_MAX_LEN + 1);
+	FILE *f = fopen(path, "r");
+	bool have_notify = false;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	replay = calloc(MAX_REPLAY, sizeof(*replay));
+	while (nreplay < MAX_REPLAY && fgets(line, LINE_MAX_LEN, f)) {
+		/* Take the pool's messages out of a protocol dump or a raw
+		 * capture alike */
+		char *json = strchr(line, '{'), *end, method[64];
+
+		if (!json || !(end = json_end(json)))
+			continue;
+		strcpy(end, "\n");
+		if (!json_str(json, "\"method\"", method, sizeof(method)) ||
+		    (strcmp(method, "mining.notify") && strcmp(method, "mining.set_difficulty")))
+			continue;
+		have_notify |= !strcmp(method, "mining.notify");
+		replay[nreplay++] = strdup(json);
+	}
+	fclose(f);
+	free(line);
+	if (!have_notify) {
+		fprintf(stderr, "No mining.notify found in %s\n", path);
+		exit(1);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -p <port>     Port to listen on (default: 3333)\n"
+		"  -r <rate>     Notifies per second (default: 1/30)\n"
+		"  -m <n>        Merkle branches per synthetic notify (default: 12)\n"
+		"  -d <diff>     Share difficulty (default: 1)\n"
+		"  -D <n>        Resend the difficulty before every nth notify (default: never)\n"
+		"  -c <n>        Make every nth synthetic notify clean (default: 10, 0 only the first)\n"
+		"  -l <ms>       Delay before answering a submit (default: 0)\n"
+		"  -R <n>        Reject every nth submit (default: never)\n"
+		"  -e <hex>      Extranonce1 (default: 08000002)\n"
+		"  -z <n>        Extranonce2 size (default: 4)\n"
+		"  -f <file>     Replay notify and set_difficulty messages from a capture or\n"
+		"                --protocol-dump log instead of generating them\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in addr;
+	struct pollfd fds[MAX_CLIENTS + 1];
+	char *last_notify;
+	uint64_t next_notify;
+	int listenfd, opt, i, one = 1;
+
+	while ((opt = getopt(argc, argv, "p:r:m:d:D:c:l:R:e:z:f:h")) != -1) {
+		switch (opt) {
+			case 'p': opt_port = atoi(optarg); break;
+			case 'r': opt_rate = atof(optarg); break;
+			case 'm': opt_merkles = atoi(optarg); break;
+			case 'd': opt_diff = atof(optarg); break;
+			case 'D': opt_diff_every = atoi(optarg); break;
+			case 'c': opt_clean_every = atoi(optarg); break;
+			case 'l': opt_latency = atoi(optarg); break;
+			case 'R': opt_reject_every = atoi(optarg); break;
+			case 'e': opt_nonce1 = optarg; break;
+			case 'z': opt_n2size = atoi(optarg); break;
+			case 'f': opt_replay = optarg; break;
+			default: usage(argv[0]);
+		}
+	}
+	if (opt_rate <= 0 || opt_merkles < 0 || opt_merkles > 32 || opt_latency < 0)
+		usage(argv[0]);
+	if (opt_replay)
+		load_replay(opt_replay);
+
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(opt_port);
+	if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(listenfd, 16)) {
+		perror("bind");
+		return 1;
+	}
+
+	signal(SIGINT, quit_sig);
+	signal(SIGTERM, quit_sig);
+	signal(SIGPIPE, SIG_IGN);
+
+	last_notify = calloc(LINE_MAX_LEN, 1);
+	next_notify = now_ms();
+	fprintf(stderr, "Listening on 127.0.0.1:%d\n", opt_port);
+
+	while (!done) {
+		uint64_t now = now_ms();
+		int timeout;
+
+		if (now >= next_notify) {
+			send_notify(last_notify);
+			next_notify += 1000 / opt_rate;
+			if (next_notify < now)
+				next_notify = now;
+		}
+
+		/* Answer submits whose delay is up */
+		timeout = next_notify - now;
+		for (i = 0; i < nclients; i++) {
+			struct client *c = &clients[i];
+
+			while (c->head != c->tail && c->pending[c->head % MAX_PENDING].due <= now) {
+				struct reply *r = &c->pending[c->head++ % MAX_PENDING];
+
+				send_line(c, r->line);
+				free(r->line);
+			}
+			if (c->head != c->tail && (int)(c->pending[c->head % MAX_PENDING].due - now) < timeout)
+				timeout = c->pending[c->head % MAX_PENDING].due - now;
+		}
+
+		fds[0].fd = listenfd;
+		fds[0].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+		if (poll(fds, nclients + 1, timeout) <= 0)
+			continue;
+
+		for (i = nclients - 1; i >= 0; i--) {
+			if ((fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) &&
+			    !read_client(&clients[i], last_notify))
+				drop_client(i);
+		}
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(listenfd, NULL, NULL);
+
+			if (fd < 0)
+				continue;
+			if (nclients == MAX_CLIENTS) {
+				close(fd);
+				continue;
+			}
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			memset(&clients[nclients], 0, sizeof(clients[nclients]));
+			clients[nclients].fd = fd;
+			clients[nclients].buf = malloc(LINE_MAX_LEN);
+			nclients++;
+			connections++;
+		}
+	}
+
+	fprintf(stderr, "Connections: %lu\n", connections);
+	fprintf(stderr, "Notifies sent: %lu\n", notifies);
+	fprintf(stderr, "Submits: %lu (accepted %lu, rejected %lu, stale %lu)\n",
+		submits, accepted, rejected, stale);
+	if (submits)
+		fprintf(stderr, "Stale rate: %.2f%%\n", stale * 100.0 / submits);
+	return 0;
+}
+#else
+int main(void)
+{
+	fprintf(stderr, "The stratum mock server is not available on Windows\n");
+	return 1;
+}
+#endif
@@ -0,0 +1,769 @@
+/*
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Stratum server for downstream miners, so a farm can share one upstream
+ * connection. Each miner gets the current stratum pool's jobs with our
+ * extranonce1 followed by a two byte prefix of our extranonce2 space as its
+ * extranonce1, so nothing it finds can clash with our own work or another
+ * miner's. Shares are checked against the pool's difficulty here and the good
+ * ones go upstream through the normal submission path. */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <jansson.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#include "compat.h"
+#include "elist.h"
+#include "miner.h"
+#include "util.h"
+
+/* driver-cpu.c has its own idea of the const-ness of this */
+extern void submit_work_async(struct work *work_in, struct timeval *tv_work_found);
+
+#define SRV_MAX_CLIENTS 256
+#define SRV_JOBS 8
+#define SRV_LINE_MAX 16384
+#define SRV_QUEUE_MAX (1 << 20)
+
+struct srv_client {
+	struct list_head list;
+	SOCKETTYPE sock;
+	unsigned int prefix;
+	char addr[16];
+	char *inbuf;
+	size_t inlen;
+	char *outbuf;
+	size_t outlen, outsize;
+	bool subscribed;
+	bool authorised;
+	bool xnsub;
+	bool dead;
+	/* What the poller is watching the socket for */
+	bool want_write;
+	double diff;
+	int accepted, rejected;
+};
+
+static struct device_api stratumsrv_api = {
+	.dname = "stratumsrv",
+	.name = "SRV",
+};
+
+static struct cgpu_info stratumsrv_cgpu = {
+	.api = &stratumsrv_api,
+	.deven = DEV_ENABLED,
+};
+
+static notifier_t srv_notifier;
+static bool srv_running;
+static int srv_thr_id;
+
+static LIST_HEAD(srv_clients);
+static int srv_nclients;
+
+/* Like the stratum reactor, epoll where there is one, so that with all the
+ * pool and curl sockets in the process client fds can go past FD_SETSIZE */
+#ifdef HAVE_SYS_EPOLL_H
+static int srv_epfd;
+#endif
+
+/* What downstream miners are working on: the pool, the extranonce it gave
+ * us, and private copies of its jobs since the last clean one */
+static struct pool *srv_pool;
+static char *srv_nonce1;
+static int srv_n2size;
+static double srv_diff;
+static struct stratum_work srv_jobs[SRV_JOBS];
+static int srv_job_next;
+
+/* Shares already taken for each job, so a miner can't get the same one
+ * credited twice */
+struct srv_share {
+	UT_hash_handle hh;
+	char key[];
+};
+
+static struct srv_share *srv_shares[SRV_JOBS];
+
+/* Wakes the server to pass on a new job */
+void stratumsrv_update(void)
+{
+	if (srv_running)
+		notifier_wake(srv_notifier);
+}
+
+static void srv_send(struct srv_client *client, const char *s)
+{
+	size_t len = strlen(s);
+
+	if (client->dead)
+		return;
+	if (client->outlen + len + 1 > SRV_QUEUE_MAX) {
+		applog(LOG_WARNING, "Stratum server: %s is not reading, dropping it", client->addr);
+		client->dead = true;
+		return;
+	}
+	if (client->outlen + len + 1 > client->outsize) {
+		client->outsize = (client->outlen + len + 1) * 2;
+		client->outbuf = realloc(client->outbuf, client->outsize);
+		if (unlikely(!client->outbuf))
+			quit(1, "Failed to realloc outbuf in srv_send");
+	}
+	memcpy(client->outbuf + client->outlen, s, len);
+	client->outbuf[client->outlen + len] = '\n';
+	client->outlen += len + 1;
+}
+
+static void srv_flush(struct srv_client *client)
+{
+	while (client->outlen && !client->dead) {
+		ssize_t sent = send(client->sock, client->outbuf, client->outlen, 0);
+
+		if (SOCKETFAIL(sent)) {
+			if (!sock_blocks())
+				client->dead = true;
+			break;
+		}
+		client->outlen -= sent;
+		memmove(client->outbuf, client->outbuf + sent, client->outlen);
+	}
+}
+
+static void srv_reply(struct srv_client *client, const char *id, const char *result, const char *error)
+{
+	char *s = malloc(strlen(id) + strlen(result) + strlen(error) + 32);
+
+	if (unlikely(!s))
+		quit(1, "Failed to malloc in srv_reply");
+	sprintf(s, "{\"id\": %s, \"result\": %s, \"error\": %s}", id, result, error);
+	srv_send(client, s);
+	free(s);
+}
+
+static struct stratum_work *srv_last_job(void)
+{
+	struct stratum_work *swork = &srv_jobs[(srv_job_next + SRV_JOBS - 1) % SRV_JOBS];
+
+	return swork->job_id ? swork : NULL;
+}
+
+static struct stratum_work *srv_find_job(const char *job_id)
+{
+	int i;
+
+	for (i = 0; i < SRV_JOBS; i++) {
+		if (srv_jobs[i].job_id && !strcmp(srv_jobs[i].job_id, job_id))
+			return &srv_jobs[i];
+	}
+	return NULL;
+}
+
+static void srv_forget_job(int i)
+{
+	struct srv_share *share, *tmp;
+
+	if (srv_jobs[i].job_id)
+		stratum_work_clean(&srv_jobs[i]);
+	HASH_ITER(hh, srv_shares[i], share, tmp) {
+		HASH_DEL(srv_shares[i], share);
+		free(share);
+	}
+}
+
+static void srv_clear_jobs(void)
+{
+	int i;
+
+	for (i = 0; i < SRV_JOBS; i++)
+		srv_forget_job(i);
+}
+
+/* Returns an entry for the share, or NULL if it was already taken. The entry
+ * is only remembered with srv_keep_share once the share checks out */
+static struct srv_share *srv_new_share(struct stratum_work *swork, unsigned int prefix,
+				       const char *nonce2, const char *ntime, const char *nonce)
+{
+	struct srv_share *share, *old;
+	size_t len = 4 + strlen(nonce2) + 8 + 8;
+	char *p;
+
+	share = malloc(sizeof(*share) + len + 1);
+	if (unlikely(!share))
+		quit(1, "Failed to malloc share in srv_new_share");
+	sprintf(share->key, "%04x%s%s%s", prefix, nonce2, ntime, nonce);
+	/* The same hex in another case is the same share */
+	for (p = share->key; *p; p++)
+		*p = tolower(*p);
+
+	HASH_FIND(hh, srv_shares[swork - srv_jobs], share->key, len, old);
+	if (old) {
+		free(share);
+		return NULL;
+	}
+	return share;
+}
+
+static void srv_keep_share(struct stratum_work *swork, struct srv_share *share)
+{
+	HASH_ADD_KEYPTR(hh, srv_shares[swork - srv_jobs], share->key, strlen(share->key), share);
+}
+
+static void srv_send_diff(struct srv_client *client)
+{
+	char s[128];
+
+	if (client->diff == srv_diff)
+		return;
+	client->diff = srv_diff;
+	snprintf(s, sizeof(s), "{\"id\": null, \"method\": \"mining.set_difficulty\", \"params\": [%.17g]}", srv_diff);
+	srv_send(client, s);
+}
+
+static void srv_send_extranonce(struct srv_client *client)
+{
+	char s[256];
+
+	snprintf(s, sizeof(s), "{\"id\": null, \"method\": \"mining.set_extranonce\", \"params\": [\"%s%04x\", %d]}",
+		 srv_nonce1, client->prefix, srv_n2size - STRATUMSRV_N2_RESERVED);
+	srv_send(client, s);
+}
+
+/* Turns a job back into the notify it came in as */
+static char *srv_notify_line(const struct stratum_work *swork, bool clean)
+{
+	char *s, *p, prev_hash[65], bbversion[9], nbit[9];
+	size_t len;
+	int i;
+
+	len = 256 + strlen(swork->job_id) + strlen(swork->ntime) +
+	      (swork->cb1_len + swork->cb2_len) * 2 + swork->merkles * 68;
+	s = malloc(len);
+	if (unlikely(!s))
+		quit(1, "Failed to malloc in srv_notify_line");
+
+	_bin2hex(prev_hash, swork->prev_hash, 32);
+	_bin2hex(bbversion, swork->bbversion, 4);
+	_bin2hex(nbit, swork->nbit, 4);
+	p = s + sprintf(s, "{\"id\": null, \"method\": \"mining.notify\", \"params\": [\"%s\", \"%s\", \"",
+			swork->job_id, prev_hash);
+	_bin2hex(p, swork->coinbase1, swork->cb1_len);
+	p += swork->cb1_len * 2;
+	p += sprintf(p, "\", \"");
+	_bin2hex(p, swork->coinbase2, swork->cb2_len);
+	p += swork->cb2_len * 2;
+	p += sprintf(p, "\", [");
+	for (i = 0; i < swork->merkles; i++) {
+		p += sprintf(p, "%s\"", i ? ", " : "");
+		_bin2hex(p, swork->merkle + i * 32, 32);
+		p += 64;
+		*p++ = '"';
+	}
+	sprintf(p, "], \"%s\", \"%s\", \"%s\", %s]}", bbversion, nbit, swork->ntime, clean ? "true" : "false");
+	return s;
+}
+
+static void srv_send_job(struct srv_client *client, const struct stratum_work *swork, bool clean)
+{
+	char *s = srv_notify_line(swork, clean);
+
+	srv_send_diff(client);
+	srv_send(client, s);
+	free(s);
+}
+
+/* Sends everybody away when the current pool has no jobs we can share,
+ * until there is one again */
+static void srv_stop_serving(struct pool *pool)
+{
+	struct srv_client *client;
+
+	if (pool->has_stratum && pool->nonce1 && !stratumsrv_n2_reserved(pool))
+		applog(LOG_WARNING, "Stratum server: pool %d's extranonce2 is too small to share", pool->pool_no);
+	else
+		applog(LOG_WARNING, "Stratum server: no stratum job to serve from pool %d", pool->pool_no);
+	srv_clear_jobs();
+	free(srv_nonce1);
+	srv_nonce1 = NULL;
+	srv_pool = NULL;
+	list_for_each_entry(client, &srv_clients, list)
+		client->dead = true;
+}
+
+/* Picks up the current pool's latest job and difficulty, and passes any
+ * change on to everybody */
+static void srv_update_job(void)
+{
+	struct pool *pool = current_pool();
+	struct srv_client *client;
+	struct stratum_work swork, *last = srv_last_job();
+	bool newpool, clean, newjob;
+	char *nonce1;
+	int n2size;
+	double diff;
+
+	mutex_lock(&pool->pool_lock);
+	if (!pool->has_stratum || !pool->swork.job_id || !pool->nonce1 || !stratumsrv_n2_reserved(pool)) {
+		mutex_unlock(&pool->pool_lock);
+		if (srv_nonce1)
+			srv_stop_serving(pool);
+		return;
+	}
+	newpool = pool != srv_pool || !srv_nonce1 || strcmp(pool->nonce1, srv_nonce1) || pool->n2size != srv_n2size;
+	newjob = newpool || !last || strcmp(pool->swork.job_id, last->job_id);
+	diff = pool->swork.diff;
+	if (!newjob) {
+		mutex_unlock(&pool->pool_lock);
+		if (diff != srv_diff) {
+			/* Shares on jobs already out are judged by the new
+			 * difficulty too, as the pool will */
+			int i;
+
+			srv_diff = diff;
+			for (i = 0; i < SRV_JOBS; i++)
+				srv_jobs[i].diff = diff;
+			list_for_each_entry(client, &srv_clients, list) {
+				if (client->authorised)
+					srv_send_diff(client);
+			}
+		}
+		return;
+	}
+	stratum_work_cpy(&swork, &pool->swork);
+	clean = !pool->submit_old;
+	nonce1 = strdup(pool->nonce1);
+	n2size = pool->n2size;
+	mutex_unlock(&pool->pool_lock);
+
+	if (newpool || clean)
+		srv_clear_jobs();
+	if (newpool) {
+		if (pool != srv_pool)
+			applog(LOG_NOTICE, "Stratum server: serving jobs from pool %d", pool->pool_no);
+		free(srv_nonce1);
+		srv_nonce1 = nonce1;
+		srv_n2size = n2size;
+		srv_pool = pool;
+
+		/* Everybody needs the new extranonce; those who can't be told
+		 * will reconnect for it */
+		list_for_each_entry(client, &srv_clients, list) {
+			if (!client->subscribed)
+				continue;
+			if (client->xnsub)
+				srv_send_extranonce(client);
+			else
+				client->dead = true;
+		}
+	} else
+		free(nonce1);
+
+	srv_forget_job(srv_job_next);
+	srv_jobs[srv_job_next] = swork;
+	srv_job_next = (srv_job_next + 1) % SRV_JOBS;
+	srv_diff = diff;
+
+	list_for_each_entry(client, &srv_clients, list) {
+		if (client->authorised && client->subscribed)
+			srv_send_job(client, &swork, clean || newpool);
+	}
+}
+
+static unsigned int srv_new_prefix(void)
+{
+	static unsigned int next;
+	struct srv_client *client;
+	bool used;
+
+	/* Prefix 0 is ours */
+	do {
+		next = next % 0xffff + 1;
+		used = false;
+		list_for_each_entry(client, &srv_clients, list) {
+			if (client->prefix == next) {
+				used = true;
+				break;
+			}
+		}
+	} while (used);
+	return next;
+}
+
+static const char *srv_submit(struct srv_client *client, json_t *params)
+{
+	const char *job_id, *nonce2, *ntime, *nonce;
+	struct stratum_work *swork;
+	enum test_nonce2_result res;
+	struct srv_share *share;
+	struct work *work;
+	char *n2;
+
+	if (!client->authorised)
+		return "[24, \"Unauthorized worker\", null]";
+	job_id = json_string_value(json_array_get(params, 1));
+	nonce2 = json_string_value(json_array_get(params, 2));
+	ntime = json_string_value(json_array_get(params, 3));
+	nonce = json_string_value(json_array_get(params, 4));
+	if (!job_id || !nonce2 || !ntime || !nonce)
+		return "[20, \"Malformed share\", null]";
+	if (!srv_nonce1 || !(swork = srv_find_job(job_id)))
+		return "[21, \"Job not found\", null]";
+	if (strlen(nonce2) != (size_t)(srv_n2size - STRATUMSRV_N2_RESERVED) * 2 ||
+	    strlen(ntime) != 8 || strlen(nonce) != 8)
+		return "[20, \"Malformed share\", null]";
+	if (!(share = srv_new_share(swork, client->prefix, nonce2, ntime, nonce)))
+		return "[22, \"Duplicate share\", null]";
+
+	n2 = malloc(strlen(nonce2) + 5);
+	if (unlikely(!n2))
+		quit(1, "Failed to malloc in srv_submit");
+	sprintf(n2, "%04x%s", client->prefix, nonce2);
+	work = stratumsrv_work(srv_pool, swork, srv_nonce1, n2, ntime, nonce);
+	free(n2);
+	if (!work) {
+		free(share);
+		return "[20, \"Malformed share\", null]";
+	}
+
+	work->thr_id = srv_thr_id;
+	res = test_nonce2(work, le32toh(((uint32_t *)work->data)[19]));
+	if (res == TNR_GOOD)
+		submit_work_async(work, NULL);
+	free_work(work);
+	if (res != TNR_GOOD) {
+		free(share);
+		return "[23, \"Low difficulty share\", null]";
+	}
+	srv_keep_share(swork, share);
+	return NULL;
+}
+
+static void srv_handle_line(struct srv_client *client, char *line)
+{
+	const char *method, *error;
+	json_t *val, *params;
+	json_error_t err;
+	char *id, s[256];
+
+	val = JSON_LOADS(line, &err);
+	if (!val) {
+		applog(LOG_INFO, "Stratum server: bad JSON from %s: %s", client->addr, line);
+		return;
+	}
+	method = json_string_value(json_object_get(val, "method"));
+	params = json_object_get(val, "params");
+	if (!method)
+		goto out;
+	if (json_object_get(val, "id"))
+		id = json_dumps_ANY(json_object_get(val, "id"), 0);
+	else
+		id = strdup("null");
+
+	if (!strcmp(method, "mining.subscribe")) {
+		if (!srv_nonce1) {
+			srv_reply(client, id, "null", "[20, \"No stratum pool to serve\", null]");
+			client->dead = true;
+		} else {
+			if (!client->prefix)
+				client->prefix = srv_new_prefix();
+			snprintf(s, sizeof(s), "[[[\"mining.set_difficulty\", \"%x\"], [\"mining.notify\", \"%x\"]], \"%s%04x\", %d]",
+				 client->prefix, client->prefix, srv_nonce1, client->prefix,
+				 srv_n2size - STRATUMSRV_N2_RESERVED);
+			srv_reply(client, id, s, "null");
+			client->subscribed = true;
+		}
+	} else if (!strcmp(method, "mining.authorize")) {
+		const char *user = json_string_value(json_array_get(params, 0));
+
+		srv_reply(client, id, "true", "null");
+		if (!client->authorised)
+			applog(LOG_NOTICE, "Stratum server: %s authorised as %s", client->addr, user ? user : "");
+		client->authorised = true;
+		if (client->subscribed && srv_last_job())
+			srv_send_job(client, srv_last_job(), true);
+	} else if (!strcmp(method, "mining.extranonce.subscribe")) {
+		client->xnsub = true;
+		srv_reply(client, id, "true", "null");
+	} else if (!strcmp(method, "mining.submit")) {
+		error = srv_submit(client, params);
+		if (error) {
+			client->rejected++;
+			applog(LOG_INFO, "Stratum server: share from %s rejected: %s", client->addr, error);
+			srv_reply(client, id, "null", error);
+		} else {
+			client->accepted++;
+			srv_reply(client, id, "true", "null");
+		}
+	} else if (!strcmp(method, "mining.suggest_difficulty")) {
+		/* The pool decides the difficulty for everybody */
+		srv_reply(client, id, "false", "null");
+	} else if (!strcmp(method, "mining.get_transactions"))
+		srv_reply(client, id, "[]", "null");
+	else
+		srv_reply(client, id, "null", "[20, \"Method not supported\", null]");
+	free(id);
+out:
+	json_decref(val);
+}
+
+static void srv_read(struct srv_client *client)
+{
+	ssize_t n;
+	char *eol, *start;
+
+	n = recv(client->sock, client->inbuf + client->inlen, SRV_LINE_MAX - client->inlen - 1, 0);
+	if (SOCKETFAIL(n) || !n) {
+		if (!n || !sock_blocks())
+			client->dead = true;
+		return;
+	}
+	client->inlen += n;
+	client->inbuf[client->inlen] = '\0';
+
+	start = client->inbuf;
+	while ((eol = strchr(start, '\n'))) {
+		*eol = '\0';
+		if (eol > start && eol[-1] == '\r')
+			eol[-1] = '\0';
+		if (*start)
+			srv_handle_line(client, start);
+		start = eol + 1;
+	}
+	client->inlen -= start - client->inbuf;
+	memmove(client->inbuf, start, client->inlen);
+	if (client->inlen == SRV_LINE_MAX - 1) {
+		applog(LOG_INFO, "Stratum server: line too long from %s", client->addr);
+		client->dead = true;
+	}
+}
+
+static void srv_accept(SOCKETTYPE listener)
+{
+	struct sockaddr_in cli;
+	socklen_t clisiz = sizeof(cli);
+	struct srv_client *client;
+	SOCKETTYPE sock;
+#ifndef WIN32
+	const int one = 1;
+#else
+	const char one = 1;
+	u_long nonblock = 1;
+#endif
+
+	sock = accept(listener, (struct sockaddr *)&cli, &clisiz);
+	if (sock == INVSOCK)
+		return;
+	if (srv_nclients >= SRV_MAX_CLIENTS) {
+		applog(LOG_WARNING, "Stratum server: too many miners, refusing %s", inet_ntoa(cli.sin_addr));
+		CLOSESOCKET(sock);
+		return;
+	}
+#if !defined(HAVE_SYS_EPOLL_H) && !defined(WIN32)
+	/* select() can't watch it */
+	if (sock >= FD_SETSIZE) {
+		applog(LOG_WARNING, "Stratum server: out of file descriptors, refusing %s", inet_ntoa(cli.sin_addr));
+		CLOSESOCKET(sock);
+		return;
+	}
+#endif
+#ifndef WIN32
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#else
+	ioctlsocket(sock, FIONBIO, &nonblock);
+#endif
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	client = calloc(1, sizeof(*client));
+	if (unlikely(!client))
+		quit(1, "Failed to calloc client in srv_accept");
+	client->inbuf = malloc(SRV_LINE_MAX);
+	if (unlikely(!client->inbuf))
+		quit(1, "Failed to malloc inbuf in srv_accept");
+	client->sock = sock;
+	client->diff = -1;
+	snprintf(client->addr, sizeof(client->addr), "%s", inet_ntoa(cli.sin_addr));
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = client,
+	};
+
+	if (unlikely(epoll_ctl(srv_epfd, EPOLL_CTL_ADD, sock, &ev))) {
+		applog(LOG_WARNING, "Stratum server: failed to watch %s, dropping it", client->addr);
+		CLOSESOCKET(sock);
+		free(client->inbuf);
+		free(client);
+		return;
+	}
+#endif
+	list_add_tail(&client->list, &srv_clients);
+	srv_nclients++;
+	applog(LOG_NOTICE, "Stratum server: %s connected", client->addr);
+}
+
+static void srv_drop(struct srv_client *client)
+{
+	applog(LOG_NOTICE, "Stratum server: %s disconnected (%d shares accepted, %d rejected)",
+	       client->addr, client->accepted, client->rejected);
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_ctl(srv_epfd, EPOLL_CTL_DEL, client->sock, NULL);
+#endif
+	CLOSESOCKET(client->sock);
+	list_del(&client->list);
+	srv_nclients--;
+	free(client->inbuf);
+	free(client->outbuf);
+	free(client);
+}
+
+void *stratumsrv_thread(void *userdata)
+{
+	struct thr_info *mythr = userdata;
+	struct srv_client *client, *tmp;
+	struct sockaddr_in serv;
+	SOCKETTYPE listener;
+#ifndef WIN32
+	int optval = 1;
+#endif
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+	RenameThread("stratumsrv");
+
+	/* Downstream shares are credited to a device of their own */
+	srv_thr_id = mythr->id;
+	mythr->cgpu = &stratumsrv_cgpu;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener == INVSOCK) {
+		applog(LOG_ERR, "Stratum server socket failed (%s)", SOCKERRMSG);
+		return NULL;
+	}
+#ifndef WIN32
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (void *)&optval, sizeof(optval));
+#endif
+	memset(&serv, 0, sizeof(serv));
+	serv.sin_family = AF_INET;
+	serv.sin_addr.s_addr = htonl(INADDR_ANY);
+	serv.sin_port = htons(opt_stratum_port);
+	if (SOCKETFAIL(bind(listener, (struct sockaddr *)&serv, sizeof(serv))) ||
+	    SOCKETFAIL(listen(listener, 16))) {
+		applog(LOG_ERR, "Stratum server bind to port %d failed (%s)", opt_stratum_port, SOCKERRMSG);
+		CLOSESOCKET(listener);
+		return NULL;
+	}
+	notifier_init(srv_notifier);
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+
+	srv_epfd = epoll_create(16);
+	if (unlikely(srv_epfd < 0))
+		quit(1, "Failed to epoll_create in stratumsrv_thread");
+	if (unlikely(epoll_ctl(srv_epfd, EPOLL_CTL_ADD, srv_notifier[0], &ev)))
+		quit(1, "Failed to epoll_ctl in stratumsrv_thread");
+	ev.data.ptr = &listener;
+	if (unlikely(epoll_ctl(srv_epfd, EPOLL_CTL_ADD, listener, &ev)))
+		quit(1, "Failed to epoll_ctl in stratumsrv_thread");
+#endif
+	srv_running = true;
+	applog(LOG_WARNING, "Stratum server listening on port %d", opt_stratum_port);
+
+	while (42) {
+#ifdef HAVE_SYS_EPOLL_H
+		struct epoll_event evs[16];
+		int i, n;
+#else
+		struct timeval timeout = {1, 0};
+		fd_set rfds, wfds;
+		SOCKETTYPE maxfd;
+#endif
+
+		/* Pool switches are picked up here within a second; new jobs
+		 * wake us straight away */
+		srv_update_job();
+
+#ifdef HAVE_SYS_EPOLL_H
+		list_for_each_entry_safe(client, tmp, &srv_clients, list) {
+			srv_flush(client);
+			if (client->dead) {
+				srv_drop(client);
+				continue;
+			}
+			if (client->want_write != !!client->outlen) {
+				struct epoll_event cev = {
+					.events = EPOLLIN | (client->outlen ? EPOLLOUT : 0),
+					.data.ptr = client,
+				};
+
+				client->want_write = !!client->outlen;
+				epoll_ctl(srv_epfd, EPOLL_CTL_MOD, client->sock, &cev);
+			}
+		}
+
+		n = epoll_wait(srv_epfd, evs, sizeof(evs) / sizeof(evs[0]), 1000);
+		for (i = 0; i < n; i++) {
+			void *ptr = evs[i].data.ptr;
+
+			if (!ptr)
+				notifier_read(srv_notifier);
+			else if (ptr == &listener)
+				srv_accept(listener);
+			else if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				srv_read(ptr);
+		}
+#else
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		FD_SET(listener, &rfds);
+		FD_SET(srv_notifier[0], &rfds);
+		maxfd = listener > srv_notifier[0] ? listener : srv_notifier[0];
+		list_for_each_entry_safe(client, tmp, &srv_clients, list) {
+			srv_flush(client);
+			if (client->dead) {
+				srv_drop(client);
+				continue;
+			}
+			FD_SET(client->sock, &rfds);
+			if (client->outlen)
+				FD_SET(client->sock, &wfds);
+			if (client->sock > maxfd)
+				maxfd = client->sock;
+		}
+
+		if (select(maxfd + 1, &rfds, &wfds, NULL, &timeout) < 1)
+			continue;
+
+		if (FD_ISSET(srv_notifier[0], &rfds))
+			notifier_read(srv_notifier);
+		list_for_each_entry(client, &srv_clients, list) {
+			if (FD_ISSET(client->sock, &rfds))
+				srv_read(client);
+		}
+		if (FD_ISSET(listener, &rfds))
+			srv_accept(listener);
+#endif
+	}
+
+	return NULL;
+}
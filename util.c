@@ -40,6 +40,8 @@
 # ifdef __linux
 #  include <sys/prctl.h>
 # endif
+# include <fcntl.h>
+# include <poll.h>
 # include <sys/socket.h>
 # include <netinet/in.h>
 # include <netinet/tcp.h>
@@ -656,36 +658,39 @@ void _bin2hex(char *s, const uchar *p, size_t len) {
 }
 
 /* Does the reverse of bin2hex but does not allocate any ram */
-bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
+static inline int hex_nibble(char c)
 {
-	bool ret = false;
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
 
+bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
+{
 	while (*hexstr && len) {
-		char hex_byte[4];
-		unsigned int v;
+		int hi, lo;
 
 		if (unlikely(!hexstr[1])) {
 			applog(LOG_ERR, "hex2bin str truncated");
-			return ret;
+			return false;
 		}
 
-		memset(hex_byte, 0, 4);
-		hex_byte[0] = hexstr[0];
-		hex_byte[1] = hexstr[1];
-
-		if (unlikely(sscanf(hex_byte, "%x", &v) != 1)) {
-			applog(LOG_ERR, "hex2bin sscanf '%s' failed", hex_byte);
-			return ret;
+		hi = hex_nibble(hexstr[0]);
+		lo = hex_nibble(hexstr[1]);
+		if (unlikely(hi < 0 || lo < 0)) {
+			applog(LOG_ERR, "hex2bin invalid hex '%.2s'", hexstr);
+			return false;
 		}
 
-		*p = (unsigned char) v;
-
-		p++;
+		*p++ = (hi << 4) | lo;
 		hexstr += 2;
 		len--;
 	}
 
-    return(!len) ? true : false;
+	return !len;
 }
 
 void hash_data(unsigned char *out_hash, const unsigned char *data)
@@ -968,6 +973,73 @@ double tdiff(struct timeval *end, struct timeval *start)
 	return end->tv_sec - start->tv_sec + (end->tv_usec - start->tv_usec) / 1000000.0;
 }
 
+/* Returns the CPU time in microseconds used so far by the calling thread,
+ * falling back to wall time where there is no per thread clock */
+double thread_cputime(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+#endif
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000.0 + tv.tv_usec;
+}
+
+const char *latency_names[LATENCY_MAX] = {
+	"Job to Hash",
+	"Found to Submit",
+	"Submit to Reply",
+};
+
+void latency_add(struct latency_hist *hist, struct timeval *start, struct timeval *end)
+{
+	double us = us_tdiff(end, start);
+
+	latency_add_us(hist, us > 0 ? us : 0);
+}
+
+void latency_add_us(struct latency_hist *hist, uint64_t v)
+{
+	int bucket = 0;
+
+	while (bucket < LATENCY_BUCKETS - 1 && v >> (bucket + 1))
+		bucket++;
+
+	hist->samples++;
+	hist->total_us += v;
+	if (v > hist->max_us)
+		hist->max_us = v;
+	hist->buckets[bucket]++;
+}
+
+/* Returns the upper bound in milliseconds of the bucket holding the pct
+ * percentile sample, which is as close as a log2 histogram gets */
+double latency_pct(struct latency_hist *hist, double pct)
+{
+	uint64_t want, seen = 0;
+	int i;
+
+	if (!hist->samples)
+		return 0;
+
+	want = hist->samples * pct / 100;
+	if (want < 1)
+		want = 1;
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		seen += hist->buckets[i];
+		if (seen >= want)
+			break;
+	}
+	if (i == LATENCY_BUCKETS - 1 || (2ULL << i) > hist->max_us)
+		return hist->max_us / 1000.0;
+
+	return (double)(2ULL << i) / 1000.0;
+}
+
 bool extract_sockaddr(struct pool *pool, char *url)
 {
 	char *url_begin, *url_end, *ipv6_begin, *ipv6_end, *port_start = NULL;
@@ -1021,6 +1093,53 @@ enum send_ret {
 	SEND_INACTIVE
 };
 
+/* Waits up to msecs for a socket to become readable or writable. Uses poll
+ * where we have it so that descriptors beyond FD_SETSIZE work too */
+static bool sock_wait(SOCKETTYPE sock, bool writable, int msecs)
+{
+#ifndef WIN32
+	struct pollfd pfd = {
+		.fd = sock,
+		.events = writable ? POLLOUT : POLLIN,
+	};
+
+	return poll(&pfd, 1, msecs) > 0;
+#else
+	struct timeval timeout;
+	fd_set fds;
+
+	FD_ZERO(&fds);
+	FD_SET(sock, &fds);
+	timeout.tv_sec = msecs / 1000;
+	timeout.tv_usec = (msecs % 1000) * 1000;
+	if (writable)
+		return select(sock + 1, NULL, &fds, NULL, &timeout) > 0;
+	return select(sock + 1, &fds, NULL, NULL, &timeout) > 0;
+#endif
+}
+
+/* Appends a line to the pool's outgoing buffer. Must hold stratum_lock */
+static void sendbuf_add(struct pool *pool, const char *s, size_t len)
+{
+	size_t need = pool->sendbuf_len + len + 1;
+
+	if (need > pool->sendbuf_size) {
+		size_t newsize = pool->sendbuf_size ? pool->sendbuf_size : RBUFSIZE;
+		char *newbuf;
+
+		while (newsize < need)
+			newsize <<= 1;
+		newbuf = realloc(pool->sendbuf, newsize);
+		if (!newbuf)
+			quit(1, "Failed to realloc pool sendbuf in sendbuf_add");
+		pool->sendbuf = newbuf;
+		pool->sendbuf_size = newsize;
+	}
+	memcpy(pool->sendbuf + pool->sendbuf_len, s, len);
+	pool->sendbuf[pool->sendbuf_len + len] = '\n';
+	pool->sendbuf_len += len + 1;
+}
+
 /* Send a single command across a socket, appending \n to it. This should all
  * be done under stratum lock except when first establishing the socket */
 static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
@@ -1028,17 +1147,21 @@ static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 	SOCKETTYPE sock = pool->sock;
 	ssize_t ssent = 0;
 
+	/* Anything still waiting in the outgoing buffer has to go first */
+	if (pool->sendbuf_len) {
+		sendbuf_add(pool, s, len);
+		return SEND_OK;
+	}
+
 	strcat(s, "\n");
 	len++;
 
 	while (len > 0 ) {
-		struct timeval timeout = {0, 0};
 		ssize_t sent;
-		fd_set wd;
 
-		FD_ZERO(&wd);
-		FD_SET(sock, &wd);
-		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1)
+		/* Once part of a line has gone out, give the send buffer a
+		 * moment to drain rather than leave half a line behind */
+		if (!sock_wait(sock, true, ssent ? 1000 : 0))
 			return SEND_SELECTFAIL;
 		sent = send(pool->sock, s + ssent, len, 0);
 		if (sent < 0) {
@@ -1087,30 +1210,86 @@ bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force)
 	return (ret == SEND_OK);
 }
 
+/* Queues a line for the pool without touching the socket, so that any number
+ * of lines can be written out together by the next stratum_flush */
+void stratum_queue_line(struct pool *pool, const char *s, size_t len)
+{
+	if (opt_protocol)
+		applog(LOG_DEBUG, "Pool %u: QUEUE: %s", pool->pool_no, s);
+
+	mutex_lock(&pool->stratum_lock);
+	sendbuf_add(pool, s, len);
+	mutex_unlock(&pool->stratum_lock);
+}
+
+/* Writes out as much of the pool's outgoing buffer as the socket will take
+ * without blocking, in a single send where possible. Whatever is left stays
+ * queued for when the socket is next writable. Returns false only if the
+ * connection has failed */
+bool stratum_flush(struct pool *pool)
+{
+	ssize_t ssent = 0;
+	bool ret = true;
+
+	mutex_lock(&pool->stratum_lock);
+	while ((size_t)ssent < pool->sendbuf_len) {
+		ssize_t sent = send(pool->sock, pool->sendbuf + ssent, pool->sendbuf_len - ssent, 0);
+
+		if (sent < 0) {
+			if (!sock_blocks())
+				ret = false;
+			break;
+		}
+		ssent += sent;
+	}
+	if (ssent) {
+		pool->sendbuf_len -= ssent;
+		if (pool->sendbuf_len)
+			memmove(pool->sendbuf, pool->sendbuf + ssent, pool->sendbuf_len);
+		pool->cgminer_pool_stats.times_sent++;
+		pool->cgminer_pool_stats.bytes_sent += ssent;
+		total_bytes_xfer += ssent;
+		pool->cgminer_pool_stats.net_bytes_sent += ssent;
+	}
+	mutex_unlock(&pool->stratum_lock);
+
+	if (!ret)
+		applog(LOG_DEBUG, "Failed to flush stratum send buffer on pool %d", pool->pool_no);
+	return ret;
+}
+
 static bool socket_full(struct pool *pool, int wait)
 {
 	SOCKETTYPE sock = pool->sock;
-	struct timeval timeout;
-	fd_set rd;
 
 	if (sock == INVSOCK)
 		return true;
 	
 	if (unlikely(wait < 0))
 		wait = 0;
-	FD_ZERO(&rd);
-	FD_SET(sock, &rd);
-	timeout.tv_usec = 0;
-	timeout.tv_sec = wait;
-	if (select(sock + 1, &rd, NULL, NULL, &timeout) > 0)
-		return true;
-	return false;
+	return sock_wait(sock, false, wait * 1000);
+}
+
+/* The pool sockbuf is used as a ring of received data: unconsumed bytes live
+ * between sockbuf_head and sockbuf_tail, and sockbuf_scan marks how far we
+ * have already searched for a line ending so that no byte is examined twice.
+ * Lines are never wrapped around the end of the buffer; instead the pending
+ * tail is slid back to the start when there is no room left behind it, which
+ * happens at most once per buffer full of data. */
+static void reset_sockbuf(struct pool *pool)
+{
+	pool->sockbuf_head = pool->sockbuf_tail = pool->sockbuf_scan = 0;
+}
+
+static inline size_t sockbuf_pending(struct pool *pool)
+{
+	return pool->sockbuf_tail - pool->sockbuf_head;
 }
 
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (sockbuf_pending(pool))
 		return true;
 
 	return (socket_full(pool, 0));
@@ -1122,47 +1301,136 @@ static void clear_sock(struct pool *pool)
 
 	mutex_lock(&pool->stratum_lock);
 	do
-		n = recv(pool->sock, pool->sockbuf, RECVSIZE, 0);
+		n = recv(pool->sock, pool->sockbuf, pool->sockbuf_size, 0);
 	while (n > 0);
+	reset_sockbuf(pool);
 	mutex_unlock(&pool->stratum_lock);
-	strcpy(pool->sockbuf, "");
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Make sure there is room for at least half a RBUFSIZE after the tail of the
+ * pool sockbuf, first by sliding the pending data back to the start of the
+ * buffer and, if a single line is larger than that, by growing the buffer to
+ * cope with any coinbase size in multiples of RBUFSIZE */
+static void recalloc_sock(struct pool *pool)
 {
-	size_t old, new;
+	size_t pending, new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (pool->sockbuf_size - pool->sockbuf_tail > RBUFSIZE / 2)
 		return;
+
+	pending = sockbuf_pending(pool);
+	if (pool->sockbuf_head) {
+		memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_head, pending);
+		pool->sockbuf_scan -= pool->sockbuf_head;
+		pool->sockbuf_head = 0;
+		pool->sockbuf_tail = pending;
+		if (pool->sockbuf_size - pending > RBUFSIZE / 2)
+			return;
+	}
+
+	new = pending + RBUFSIZE;
 	new = new + (RBUFSIZE - (new % RBUFSIZE));
-	applog(LOG_DEBUG, "Recallocing pool sockbuf to %lu", (unsigned long)new);
+	applog(LOG_DEBUG, "Reallocing pool sockbuf to %lu", (unsigned long)new);
 	pool->sockbuf = realloc(pool->sockbuf, new);
 	if (!pool->sockbuf)
 		quit(1, "Failed to realloc pool sockbuf in recalloc_sock");
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
+/* Look for the next complete line in the pool sockbuf, skipping empty ones.
+ * Returns a \0 terminated view into the buffer, or NULL if no end of line has
+ * been received yet */
+static char *sockbuf_line(struct pool *pool, size_t *len)
+{
+	char *buf = pool->sockbuf, *eol;
+
+	while (pool->sockbuf_head < pool->sockbuf_tail && buf[pool->sockbuf_head] == '\n')
+		pool->sockbuf_head++;
+	if (pool->sockbuf_scan < pool->sockbuf_head)
+		pool->sockbuf_scan = pool->sockbuf_head;
+
+	eol = memchr(buf + pool->sockbuf_scan, '\n', pool->sockbuf_tail - pool->sockbuf_scan);
+	if (!eol) {
+		pool->sockbuf_scan = pool->sockbuf_tail;
+		return NULL;
+	}
+
+	*eol = '\0';
+	*len = eol - (buf + pool->sockbuf_head);
+	buf += pool->sockbuf_head;
+	pool->sockbuf_head = pool->sockbuf_scan = eol + 1 - pool->sockbuf;
+	if (pool->sockbuf_head == pool->sockbuf_tail)
+		reset_sockbuf(pool);
+
+	return buf;
+}
+
+/* Reads whatever has already arrived on the stratum socket into the pool
+ * sockbuf without waiting. Returns false once the connection has been closed
+ * or has failed */
+bool sock_fill(struct pool *pool)
+{
+	int uninitialised_var(socket_recv_errno);
+	ssize_t n;
+
+	mutex_lock(&pool->stratum_lock);
+	recalloc_sock(pool);
+	n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+		 pool->sockbuf_size - pool->sockbuf_tail - 1, 0);
+	if (n > 0)
+		pool->sockbuf_tail += n;
+	else
+		socket_recv_errno = errno;
+	mutex_unlock(&pool->stratum_lock);
+
+	if (!n) {
+		applog(LOG_DEBUG, "Socket closed in sock_fill");
+		return false;
+	}
+	if (n < 0 && !sock_blocks()) {
+		applog(LOG_DEBUG, "Failed to recv sock in sock_fill: %d", socket_recv_errno);
+		return false;
+	}
+	return true;
+}
+
+/* Returns the next complete line already received by sock_fill, if any. The
+ * line is a view into the pool sockbuf just like the one recv_line returns */
+char *next_line(struct pool *pool)
+{
+	size_t len;
+	char *s;
+
+	s = sockbuf_line(pool, &len);
+	if (!s)
+		return NULL;
+
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += len;
+	total_bytes_xfer += len;
+	pool->cgminer_pool_stats.net_bytes_received += len;
+	if (opt_protocol)
+		applog(LOG_DEBUG, "Pool %u: RECV: %s", pool->pool_no, s);
+	return s;
+}
+
 enum recv_ret {
 	RECV_OK,
 	RECV_CLOSED,
 	RECV_RECVFAIL
 };
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
+/* Waits for the first end of line on the socket and returns that line as a
+ * \0 terminated view into the pool sockbuf. The view is only valid until the
+ * pool sockbuf is next read into or reset and must not be freed */
 char *recv_line(struct pool *pool)
 {
-	char *tok, *sret = NULL;
-	ssize_t len, buflen;
+	char *sret = NULL;
+	size_t len = 0;
 	int waited = 0;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	sret = sockbuf_line(pool, &len);
+	if (!sret) {
 		enum recv_ret ret = RECV_OK;
 		struct timeval rstart, now;
 		int uninitialised_var(socket_recv_errno);
@@ -1175,12 +1443,11 @@ char *recv_line(struct pool *pool)
 
 		mutex_lock(&pool->stratum_lock);
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
+			recalloc_sock(pool);
+			n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+				 pool->sockbuf_size - pool->sockbuf_tail - 1, 0);
 			if (!n) {
 				ret = RECV_CLOSED;
 				break;
@@ -1194,11 +1461,10 @@ char *recv_line(struct pool *pool)
 					break;
 				}
 			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
+				pool->sockbuf_tail += n;
+				sret = sockbuf_line(pool, &len);
 			}
-		} while (waited < DEFAULT_SOCKWAIT && !strstr(pool->sockbuf, "\n"));
+		} while (waited < DEFAULT_SOCKWAIT && !sret);
 		mutex_unlock(&pool->stratum_lock);
 
 		switch (ret) {
@@ -1212,24 +1478,12 @@ char *recv_line(struct pool *pool)
 				applog(LOG_DEBUG, "Failed to recv sock in recv_line: %d", socket_recv_errno);
 				goto out;
 		}
+		if (!sret) {
+			applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
+			goto out;
+		}
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
 	pool->cgminer_pool_stats.times_received++;
 	pool->cgminer_pool_stats.bytes_received += len;
 	total_bytes_xfer += len;
@@ -1317,6 +1571,196 @@ static char *json_array_string(json_t *val, unsigned int entry)
 	return NULL;
 }
 
+/* Minimal json scanning used by the stratum fast path. These only ever locate
+ * values within a line; anything unusual makes the caller fall back to the
+ * full jansson parse */
+static const char *json_skip_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* Skips a string starting at its opening quote, returning the character past
+ * the closing quote */
+static const char *json_skip_string(const char *p)
+{
+	for (p++; *p != '"'; p++) {
+		if (!*p)
+			return NULL;
+		if (*p == '\\' && !*++p)
+			return NULL;
+	}
+	return p + 1;
+}
+
+static const char *json_skip_value(const char *p, int depth)
+{
+	char close;
+
+	switch (*p) {
+		case '"':
+			return json_skip_string(p);
+		case '[':
+		case '{':
+			if (unlikely(depth > 16))
+				return NULL;
+			close = *p == '[' ? ']' : '}';
+			p = json_skip_ws(p + 1);
+			if (*p == close)
+				return p + 1;
+			while (42) {
+				if (close == '}') {
+					if (*p != '"' || !(p = json_skip_string(p)))
+						return NULL;
+					p = json_skip_ws(p);
+					if (*p != ':')
+						return NULL;
+					p = json_skip_ws(p + 1);
+				}
+				p = json_skip_value(p, depth + 1);
+				if (!p)
+					return NULL;
+				p = json_skip_ws(p);
+				if (*p == close)
+					return p + 1;
+				if (*p != ',')
+					return NULL;
+				p = json_skip_ws(p + 1);
+			}
+		default:
+			if (!*p || strchr(",:]}", *p))
+				return NULL;
+			while (*p && !strchr(" \t\r\n,:]}", *p))
+				p++;
+			return p;
+	}
+}
+
+/* True if the raw value at p is exactly the json literal lit */
+bool json_literal(const char *p, const char *lit)
+{
+	size_t len = strlen(lit);
+
+	if (!p || strncmp(p, lit, len))
+		return false;
+	p += len;
+	return !*p || strchr(" \t\r\n,]}", *p);
+}
+
+/* Finds the members of a stratum line we care about in one pass over the
+ * text. Returns false if the line is not a single well formed json object */
+bool stratum_scan(const char *s, struct stratum_msg *msg)
+{
+	const char *p = json_skip_ws(s);
+
+	memset(msg, 0, sizeof(*msg));
+	if (*p != '{')
+		return false;
+	p = json_skip_ws(p + 1);
+	if (*p == '}')
+		goto out;
+	while (42) {
+		const char *key = p + 1, *keyend, *val;
+		size_t keylen;
+
+		if (*p != '"' || !(keyend = json_skip_string(p)))
+			return false;
+		keylen = keyend - key - 1;
+		p = json_skip_ws(keyend);
+		if (*p != ':')
+			return false;
+		val = p = json_skip_ws(p + 1);
+		p = json_skip_value(p, 0);
+		if (!p)
+			return false;
+
+		if (keylen == 6 && !strncmp(key, "method", 6)) {
+			if (*val == '"') {
+				msg->method = val + 1;
+				msg->method_len = p - val - 2;
+			}
+		} else if (keylen == 2 && !strncmp(key, "id", 2))
+			msg->id = val;
+		else if (keylen == 6 && !strncmp(key, "params", 6))
+			msg->params = val;
+		else if (keylen == 6 && !strncmp(key, "result", 6))
+			msg->result = val;
+		else if (keylen == 5 && !strncmp(key, "error", 5))
+			msg->error = val;
+
+		p = json_skip_ws(p);
+		if (*p == '}')
+			break;
+		if (*p != ',')
+			return false;
+		p = json_skip_ws(p + 1);
+	}
+out:
+	return !*json_skip_ws(p + 1);
+}
+
+/* A view of a string held in some other buffer, usually the receive buffer */
+struct strview {
+	const char *s;
+	size_t len;
+};
+
+/* Reads a json string at p without unescaping it. Hex and job ids never need
+ * escapes so one that has them is left to jansson */
+static const char *json_strview(const char *p, struct strview *sv)
+{
+	const char *end;
+
+	p = json_skip_ws(p);
+	if (*p != '"')
+		return NULL;
+	end = strpbrk(p + 1, "\"\\");
+	if (!end || *end != '"')
+		return NULL;
+	sv->s = p + 1;
+	sv->len = end - sv->s;
+	return json_skip_ws(end + 1);
+}
+
+static void json_strview_get(json_t *val, unsigned int entry, struct strview *sv)
+{
+	sv->s = __json_array_string(val, entry);
+	sv->len = sv->s ? strlen(sv->s) : 0;
+}
+
+static char *strview_dup(const struct strview *sv)
+{
+	char *ret = malloc(sv->len + 1);
+
+	if (unlikely(!ret))
+		quit(1, "Failed to malloc strview_dup");
+	memcpy(ret, sv->s, sv->len);
+	ret[sv->len] = '\0';
+	return ret;
+}
+
+/* The fields of a mining.notify as they arrived on the wire */
+struct stratum_notify {
+	struct strview job_id;
+	struct strview prev_hash;
+	struct strview coinbase1;
+	struct strview coinbase2;
+	struct strview *merkle;
+	int merkles;
+	struct strview bbversion;
+	struct strview nbit;
+	struct strview ntime;
+	bool clean;
+};
+
+static bool hexview2bin(unsigned char *p, const struct strview *sv, size_t len)
+{
+	if (sv->len != len * 2)
+		return false;
+	return hex2bin(p, sv->s, len);
+}
+
 void stratum_probe_transparency(struct pool *pool)
 {
 	// Request transaction data to discourage pools from doing anything shady
@@ -1331,122 +1775,209 @@ void stratum_probe_transparency(struct pool *pool)
 	pool->swork.transparency_probed = true;
 }
 
-static bool parse_notify(struct pool *pool, json_t *val)
+/* Decodes a notify straight into a new binary job and swaps it in, so the
+ * pool lock is only held for the pointer exchange */
+static bool stratum_set_notify(struct pool *pool, struct stratum_notify *sn)
 {
-	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
-	bool clean, ret = false;
-	int merkles, i;
-	json_t *arr;
+	unsigned char prev_hash[32], bbversion[4], nbit[4], ntime_bin[4];
+	unsigned char *coinbase1 = NULL, *coinbase2 = NULL, *merkle = NULL, *old;
+	size_t cb1_len, cb2_len;
+	char *job_id, *ntime, *nonce1 = NULL;
+	struct timeval tv_notify;
+	bool ret = false;
+	int i;
 
-	arr = json_array_get(val, 4);
-	if (!arr || !json_is_array(arr))
+	gettimeofday(&tv_notify, NULL);
+
+	if (!sn->job_id.s || !sn->prev_hash.s || !sn->coinbase1.s || !sn->coinbase2.s ||
+	    !sn->bbversion.s || !sn->nbit.s || !sn->ntime.s)
+		goto out;
+	if (!hexview2bin(prev_hash, &sn->prev_hash, 32) ||
+	    !hexview2bin(bbversion, &sn->bbversion, 4) ||
+	    !hexview2bin(nbit, &sn->nbit, 4) ||
+	    !hexview2bin(ntime_bin, &sn->ntime, 4))
 		goto out;
 
-	merkles = json_array_size(arr);
-
-	job_id = json_array_string(val, 0);
-	prev_hash = json_array_string(val, 1);
-	coinbase1 = json_array_string(val, 2);
-	coinbase2 = json_array_string(val, 3);
-	bbversion = json_array_string(val, 5);
-	nbit = json_array_string(val, 6);
-	ntime = json_array_string(val, 7);
-	clean = json_is_true(json_array_get(val, 8));
-
-	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime) {
-		/* Annoying but we must not leak memory */
-		if (job_id)
-			free(job_id);
-		if (prev_hash)
-			free(prev_hash);
-		if (coinbase1)
-			free(coinbase1);
-		if (coinbase2)
-			free(coinbase2);
-		if (bbversion)
-			free(bbversion);
-		if (nbit)
-			free(nbit);
-		if (ntime)
-			free(ntime);
+	cb1_len = sn->coinbase1.len / 2;
+	cb2_len = sn->coinbase2.len / 2;
+	coinbase1 = malloc(cb1_len + 1);
+	coinbase2 = malloc(cb2_len + 1);
+	if (sn->merkles)
+		merkle = malloc(sn->merkles * 32);
+	if (unlikely(!coinbase1 || !coinbase2 || (sn->merkles && !merkle)))
+		quit(1, "Failed to malloc stratum job in stratum_set_notify");
+	if (!hexview2bin(coinbase1, &sn->coinbase1, cb1_len) ||
+	    !hexview2bin(coinbase2, &sn->coinbase2, cb2_len))
 		goto out;
+	for (i = 0; i < sn->merkles; i++) {
+		if (!hexview2bin(merkle + i * 32, &sn->merkle[i], 32))
+			goto out;
 	}
 
+	job_id = strview_dup(&sn->job_id);
+	ntime = strview_dup(&sn->ntime);
+
 	mutex_lock(&pool->pool_lock);
 	free(pool->swork.job_id);
-	free(pool->swork.prev_hash);
-	free(pool->swork.coinbase1);
-	free(pool->swork.coinbase2);
-	free(pool->swork.bbversion);
-	free(pool->swork.nbit);
 	free(pool->swork.ntime);
 	pool->swork.job_id = job_id;
-	pool->swork.prev_hash = prev_hash;
+	pool->swork.ntime = ntime;
+	old = pool->swork.coinbase1;
 	pool->swork.coinbase1 = coinbase1;
-	pool->swork.cb1_len = strlen(coinbase1) / 2;
+	coinbase1 = old;
+	old = pool->swork.coinbase2;
 	pool->swork.coinbase2 = coinbase2;
-	pool->swork.cb2_len = strlen(coinbase2) / 2;
-	pool->swork.bbversion = bbversion;
-	pool->swork.nbit = nbit;
-	pool->swork.ntime = ntime;
-	pool->submit_old = !clean;
+	coinbase2 = old;
+	old = pool->swork.merkle;
+	pool->swork.merkle = merkle;
+	merkle = old;
+	pool->swork.cb1_len = cb1_len;
+	pool->swork.cb2_len = cb2_len;
+	pool->swork.merkles = sn->merkles;
+	memcpy(pool->swork.prev_hash, prev_hash, 32);
+	memcpy(pool->swork.bbversion, bbversion, 4);
+	memcpy(pool->swork.nbit, nbit, 4);
+	memcpy(pool->swork.ntime_bin, ntime_bin, 4);
+	pool->submit_old = !sn->clean;
 	pool->swork.clean = true;
-	pool->swork.cb_len = pool->swork.cb1_len + pool->n1_len + pool->n2size + pool->swork.cb2_len;
-
-	for (i = 0; i < pool->swork.merkles; i++)
-		free(pool->swork.merkle[i]);
-	if (merkles) {
-		pool->swork.merkle = realloc(pool->swork.merkle, sizeof(char *) * merkles + 1);
-		for (i = 0; i < merkles; i++)
-			pool->swork.merkle[i] = json_array_string(arr, i);
-	}
-	pool->swork.merkles = merkles;
-	if (clean)
+	pool->swork.tv_notify = tv_notify;
+	pool->swork.hashed = false;
+	if (sn->clean)
 		pool->nonce2 = 0;
-	pool->swork.header_len = strlen(pool->swork.bbversion) +
-				 strlen(pool->swork.prev_hash) +
-				 strlen(pool->swork.ntime) +
-				 strlen(pool->swork.nbit) +
-	/* merkle_hash */	 32 +
-	/* nonce */		 8 +
-	/* workpadding */	 96;
-	pool->swork.header_len = pool->swork.header_len * 2 + 1;
-	align_len(&pool->swork.header_len);
+	/* A new extranonce applies from the first job notified after it */
+	if (pool->nonce1_next) {
+		nonce1 = pool->nonce1;
+		pool->nonce1 = pool->nonce1_next;
+		pool->nonce1_next = NULL;
+		pool->n1_len = strlen(pool->nonce1) / 2;
+		pool->n2size = pool->n2size_next;
+		pool->nonce2 = 0;
+	}
 	mutex_unlock(&pool->pool_lock);
+	free(nonce1);
 
 	applog(LOG_DEBUG, "Received stratum notify from pool %u with job_id=%s",
 	       pool->pool_no, job_id);
 	if (opt_protocol) {
 		applog(LOG_DEBUG, "job_id: %s", job_id);
-		applog(LOG_DEBUG, "prev_hash: %s", prev_hash);
-		applog(LOG_DEBUG, "coinbase1: %s", coinbase1);
-		applog(LOG_DEBUG, "coinbase2: %s", coinbase2);
-		for (i = 0; i < merkles; i++)
-			applog(LOG_DEBUG, "merkle%d: %s", i, pool->swork.merkle[i]);
-		applog(LOG_DEBUG, "bbversion: %s", bbversion);
-		applog(LOG_DEBUG, "nbit: %s", nbit);
+		applog(LOG_DEBUG, "prev_hash: %.*s", (int)sn->prev_hash.len, sn->prev_hash.s);
+		applog(LOG_DEBUG, "coinbase1: %.*s", (int)sn->coinbase1.len, sn->coinbase1.s);
+		applog(LOG_DEBUG, "coinbase2: %.*s", (int)sn->coinbase2.len, sn->coinbase2.s);
+		for (i = 0; i < sn->merkles; i++)
+			applog(LOG_DEBUG, "merkle%d: %.*s", i, (int)sn->merkle[i].len, sn->merkle[i].s);
+		applog(LOG_DEBUG, "bbversion: %.*s", (int)sn->bbversion.len, sn->bbversion.s);
+		applog(LOG_DEBUG, "nbit: %.*s", (int)sn->nbit.len, sn->nbit.s);
 		applog(LOG_DEBUG, "ntime: %s", ntime);
-		applog(LOG_DEBUG, "clean: %s", clean ? "yes" : "no");
+		applog(LOG_DEBUG, "clean: %s", sn->clean ? "yes" : "no");
 	}
 
 	/* A notify message is the closest stratum gets to a getwork */
 	pool->getwork_requested++;
 	total_getworks++;
 
-	if ((merkles && (!pool->swork.transparency_probed || rand() <= RAND_MAX / (opt_skip_checks + 1))) || pool->swork.transparency_time != (time_t)-1)
+	if ((sn->merkles && (!pool->swork.transparency_probed || rand() <= RAND_MAX / (opt_skip_checks + 1))) || pool->swork.transparency_time != (time_t)-1)
 		if (pool->stratum_auth)
 			stratum_probe_transparency(pool);
 
 	ret = true;
 out:
+	/* After a successful swap these hold the previous job */
+	free(coinbase1);
+	free(coinbase2);
+	free(merkle);
 	return ret;
 }
 
-static bool parse_diff(struct pool *pool, json_t *val)
+/* Notifies with more merkle branches than this go through jansson */
+#define FAST_MERKLES 64
+
+/* Picks the notify params apart in place: [job_id, prev_hash, coinbase1,
+ * coinbase2, [merkle, ...], version, nbits, ntime, clean] */
+static bool parse_notify_fast(struct pool *pool, const char *p)
 {
-	double diff;
+	struct strview merkle[FAST_MERKLES];
+	struct stratum_notify sn;
+
+	memset(&sn, 0, sizeof(sn));
+	sn.merkle = merkle;
+
+	if (!p || *p != '[')
+		return false;
+	if (!(p = json_strview(p + 1, &sn.job_id)) || *p++ != ',' ||
+	    !(p = json_strview(p, &sn.prev_hash)) || *p++ != ',' ||
+	    !(p = json_strview(p, &sn.coinbase1)) || *p++ != ',' ||
+	    !(p = json_strview(p, &sn.coinbase2)) || *p++ != ',')
+		return false;
+
+	p = json_skip_ws(p);
+	if (*p++ != '[')
+		return false;
+	p = json_skip_ws(p);
+	if (*p == ']')
+		p++;
+	else while (42) {
+		if (sn.merkles >= FAST_MERKLES)
+			return false;
+		if (!(p = json_strview(p, &merkle[sn.merkles++])))
+			return false;
+		if (*p == ']') {
+			p++;
+			break;
+		}
+		if (*p++ != ',')
+			return false;
+	}
+	p = json_skip_ws(p);
+
+	if (*p++ != ',' ||
+	    !(p = json_strview(p, &sn.bbversion)) || *p++ != ',' ||
+	    !(p = json_strview(p, &sn.nbit)) || *p++ != ',' ||
+	    !(p = json_strview(p, &sn.ntime)))
+		return false;
+	if (*p == ',')
+		sn.clean = json_literal(json_skip_ws(p + 1), "true");
+
+	return stratum_set_notify(pool, &sn);
+}
+
+static bool parse_notify(struct pool *pool, json_t *val)
+{
+	struct stratum_notify sn;
+	bool ret = false;
+	json_t *arr;
+	int i;
+
+	arr = json_array_get(val, 4);
+	if (!arr || !json_is_array(arr))
+		goto out;
+
+	memset(&sn, 0, sizeof(sn));
+	sn.merkles = json_array_size(arr);
+	if (sn.merkles) {
+		sn.merkle = calloc(sn.merkles, sizeof(struct strview));
+		if (unlikely(!sn.merkle))
+			quit(1, "Failed to calloc merkle views in parse_notify");
+	}
+	for (i = 0; i < sn.merkles; i++)
+		json_strview_get(arr, i, &sn.merkle[i]);
+
+	json_strview_get(val, 0, &sn.job_id);
+	json_strview_get(val, 1, &sn.prev_hash);
+	json_strview_get(val, 2, &sn.coinbase1);
+	json_strview_get(val, 3, &sn.coinbase2);
+	json_strview_get(val, 5, &sn.bbversion);
+	json_strview_get(val, 6, &sn.nbit);
+	json_strview_get(val, 7, &sn.ntime);
+	sn.clean = json_is_true(json_array_get(val, 8));
+
+	ret = stratum_set_notify(pool, &sn);
+	free(sn.merkle);
+out:
+	return ret;
+}
 
-	diff = json_number_value(json_array_get(val, 0));
+static bool set_diff(struct pool *pool, double diff)
+{
 	if (diff == 0)
 		return false;
 
@@ -1459,6 +1990,46 @@ static bool parse_diff(struct pool *pool, json_t *val)
 	return true;
 }
 
+static bool parse_diff(struct pool *pool, json_t *val)
+{
+	return set_diff(pool, json_number_value(json_array_get(val, 0)));
+}
+
+static bool parse_diff_fast(struct pool *pool, const char *p)
+{
+	char *end;
+	double diff;
+
+	if (!p || *p != '[')
+		return false;
+	p = json_skip_ws(p + 1);
+	diff = strtod(p, &end);
+	if (end == p || *json_skip_ws(end) != ']')
+		return false;
+
+	return set_diff(pool, diff);
+}
+
+/* Handles the methods that arrive often enough to matter straight from the
+ * scanned line. Returns false to leave the line to parse_method */
+bool parse_method_fast(struct pool *pool, struct stratum_msg *msg)
+{
+	if (!msg->method || (msg->error && !json_literal(msg->error, "null")))
+		return false;
+
+	if (msg->method_len == 13 && !strncasecmp(msg->method, "mining.notify", 13)) {
+		if (!parse_notify_fast(pool, msg->params))
+			return false;
+		pool->stratum_notify = true;
+		return true;
+	}
+
+	if (msg->method_len == 21 && !strncasecmp(msg->method, "mining.set_difficulty", 21))
+		return parse_diff_fast(pool, msg->params);
+
+	return false;
+}
+
 static bool parse_reconnect(struct pool *pool, json_t *val)
 {
 	char *url, *port, address[256];
@@ -1481,8 +2052,42 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 
 	applog(LOG_NOTICE, "Reconnect requested from pool %d to %s", pool->pool_no, address);
 
-	if (!initiate_stratum(pool) || !auth_stratum(pool))
+	/* The stratum reactor drops the current connection and dials the new
+	 * address as soon as it sees this */
+	pool->stratum_reconnect = true;
+
+	return true;
+}
+
+/* Handles mining.set_extranonce. Work already out there was built with the
+ * old extranonce and stays valid until the next notify, so the new one is
+ * only swapped in along with that job */
+static bool parse_extranonce(struct pool *pool, json_t *val)
+{
+	const char *nonce1 = json_string_value(json_array_get(val, 0));
+	int n2size = json_integer_value(json_array_get(val, 1));
+	char *old;
+	size_t i, len;
+
+	if (!nonce1 || n2size < 1 || n2size > 16)
 		return false;
+	len = strlen(nonce1);
+	if (len % 2)
+		return false;
+	for (i = 0; i < len; i++) {
+		if (hex_nibble(nonce1[i]) < 0)
+			return false;
+	}
+
+	mutex_lock(&pool->pool_lock);
+	old = pool->nonce1_next;
+	pool->nonce1_next = strdup(nonce1);
+	pool->n2size_next = n2size;
+	mutex_unlock(&pool->pool_lock);
+	free(old);
+
+	applog(LOG_INFO, "Pool %d set extranonce1 %s extranonce2 size %d",
+	       pool->pool_no, nonce1, n2size);
 
 	return true;
 }
@@ -1558,6 +2163,11 @@ bool parse_method(struct pool *pool, char *s)
 		goto out;
 	}
 
+	if (!strncasecmp(buf, "mining.set_extranonce", 21) && parse_extranonce(pool, params)) {
+		ret = true;
+		goto out;
+	}
+
 	if (!strncasecmp(buf, "client.reconnect", 16) && parse_reconnect(pool, params)) {
 		ret = true;
 		goto out;
@@ -1576,32 +2186,47 @@ out:
 
 extern bool parse_stratum_response(struct pool *, char *s);
 
-bool auth_stratum(struct pool *pool)
+bool send_auth(struct pool *pool)
 {
-	json_t *val = NULL, *res_val, *err_val;
-	char s[RBUFSIZE], *sret = NULL;
-	json_error_t err;
-	bool ret = false;
+	char s[RBUFSIZE];
 
 	sprintf(s, "{\"id\": \"auth\", \"method\": \"mining.authorize\", \"params\": [\"%s\", \"%s\"]}",
 	        pool->rpc_user, pool->rpc_pass);
 
-	if (!stratum_send(pool, s, strlen(s)))
-		goto out;
+	return stratum_send(pool, s, strlen(s));
+}
 
-	/* Parse all data in the queue and anything left should be auth */
-	while (42) {
-		sret = recv_line(pool);
-		if (!sret)
-			goto out;
-		if (parse_method(pool, sret))
-			free(sret);
-		else
-			break;
-	}
+/* Asks the pool for a share difficulty. The reply, if any, is picked up by
+ * parse_stratum_response */
+bool stratum_suggest_diff(struct pool *pool, double diff)
+{
+	char s[RBUFSIZE];
+
+	sprintf(s, "{\"id\": \"suggest\", \"method\": \"mining.suggest_difficulty\", \"params\": [%g]}",
+	        diff);
+
+	return stratum_send(pool, s, strlen(s));
+}
+
+/* Asks the pool to send mining.set_extranonce instead of dropping us when it
+ * wants to change our extranonce */
+static bool send_extranonce_subscribe(struct pool *pool)
+{
+	char s[RBUFSIZE];
+
+	sprintf(s, "{\"id\": \"xnsub\", \"method\": \"mining.extranonce.subscribe\", \"params\": []}");
+
+	return stratum_send(pool, s, strlen(s));
+}
+
+/* Checks the response to mining.authorize sent by send_auth */
+bool stratum_authorised(struct pool *pool, char *s)
+{
+	json_t *val = NULL, *res_val, *err_val;
+	json_error_t err;
+	bool ret = false;
 
-	val = JSON_LOADS(sret, &err);
-	free(sret);
+	val = JSON_LOADS(s, &err);
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -1623,6 +2248,8 @@ bool auth_stratum(struct pool *pool)
 	pool->probed = true;
 	pool->stratum_auth = true;
 	successful_connect = true;
+	if (opt_extranonce_subscribe)
+		send_extranonce_subscribe(pool);
 out:
 	if (val)
 		json_decref(val);
@@ -1633,6 +2260,30 @@ out:
 	return ret;
 }
 
+bool auth_stratum(struct pool *pool)
+{
+	char *sret = NULL;
+
+	if (!send_auth(pool))
+		goto out;
+
+	/* Parse all data in the queue and anything left should be auth */
+	while (42) {
+		sret = recv_line(pool);
+		if (!sret)
+			goto out;
+		if (!parse_method(pool, sret))
+			break;
+	}
+
+	return stratum_authorised(pool, sret);
+out:
+	if (pool->stratum_notify)
+		stratum_probe_transparency(pool);
+
+	return false;
+}
+
 curl_socket_t grab_socket_opensocket_cb(void *clientp, __maybe_unused curlsocktype purpose, struct curl_sockaddr *addr)
 {
 	struct pool *pool = clientp;
@@ -1641,37 +2292,43 @@ curl_socket_t grab_socket_opensocket_cb(void *clientp, __maybe_unused curlsockty
 	return sck;
 }
 
-bool initiate_stratum(struct pool *pool)
+/* Forget everything about the previous stratum session before connecting */
+static void reset_stratum(struct pool *pool)
 {
-	json_t *val = NULL, *res_val, *err_val;
-	char curl_err_str[CURL_ERROR_SIZE];
-	char s[RBUFSIZE], *sret = NULL;
-	CURL *curl = NULL;
-	json_error_t err;
-	bool ret = false;
-
-	applog(LOG_DEBUG, "initiate_stratum with sockbuf=%p", pool->sockbuf);
-	mutex_lock(&pool->stratum_lock);
 	pool->swork.transparency_time = (time_t)-1;
 	pool->stratum_active = false;
 	pool->stratum_auth = false;
 	pool->stratum_notify = false;
 	pool->swork.transparency_probed = false;
-	if (!pool->stratum_curl) {
-		pool->stratum_curl = curl_easy_init();
-		if (unlikely(!pool->stratum_curl))
-			quit(1, "Failed to curl_easy_init in initiate_stratum");
-	}
-	if (pool->sockbuf)
-		pool->sockbuf[0] = '\0';
-	curl = pool->stratum_curl;
 
 	if (!pool->sockbuf) {
-		pool->sockbuf = calloc(RBUFSIZE, 1);
+		pool->sockbuf = malloc(RBUFSIZE);
 		if (!pool->sockbuf)
-			quit(1, "Failed to calloc pool sockbuf in initiate_stratum");
+			quit(1, "Failed to malloc pool sockbuf in reset_stratum");
 		pool->sockbuf_size = RBUFSIZE;
 	}
+	reset_sockbuf(pool);
+}
+
+/* Connects to the pool's stratum port through curl, which takes care of any
+ * proxy in between. The socket remains owned by pool->stratum_curl. Blocks
+ * for up to 30 seconds */
+bool connect_stratum_curl(struct pool *pool)
+{
+	char curl_err_str[CURL_ERROR_SIZE];
+	char s[RBUFSIZE];
+	CURL *curl = NULL;
+	bool ret = false;
+
+	applog(LOG_DEBUG, "connect_stratum_curl with sockbuf=%p", pool->sockbuf);
+	mutex_lock(&pool->stratum_lock);
+	reset_stratum(pool);
+	if (!pool->stratum_curl) {
+		pool->stratum_curl = curl_easy_init();
+		if (unlikely(!pool->stratum_curl))
+			quit(1, "Failed to curl_easy_init in connect_stratum_curl");
+	}
+	curl = pool->stratum_curl;
 
 	/* Create a http url for use with curl */
 	memset(s, 0, RBUFSIZE);
@@ -1705,7 +2362,6 @@ bool initiate_stratum(struct pool *pool)
 	pool->sock = INVSOCK;
 	if (curl_easy_perform(curl)) {
 		applog(LOG_INFO, "Stratum connect failed to pool %d: %s", pool->pool_no, curl_err_str);
-		mutex_unlock(&pool->stratum_lock);
 		goto out;
 	}
 	if (pool->sock == INVSOCK)
@@ -1713,34 +2369,164 @@ bool initiate_stratum(struct pool *pool)
 		pool->stratum_curl = NULL;
 		curl_easy_cleanup(curl);
 		applog(LOG_ERR, "Stratum connect succeeded, but technical problem extracting socket (pool %u)", pool->pool_no);
-		mutex_unlock(&pool->stratum_lock);
 		goto out;
 	}
 	keep_sockalive(pool->sock);
 
 	pool->cgminer_pool_stats.times_sent++;
 	pool->cgminer_pool_stats.times_received++;
+	ret = true;
+out:
+	mutex_unlock(&pool->stratum_lock);
+	return ret;
+}
+
+/* Looks up the pool's stratum address. This blocks for as long as the
+ * resolver takes, so the stratum reactor leaves it to a helper thread. The
+ * result is for connect_stratum_start and freeaddrinfo */
+struct addrinfo *resolve_stratum(struct pool *pool)
+{
+	struct addrinfo hints, *res;
+	int ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(pool->sockaddr_url, pool->stratum_port, &hints, &res);
+	if (ret) {
+		applog(LOG_INFO, "Failed to resolve stratum address of pool %d: %s",
+		       pool->pool_no, gai_strerror(ret));
+		return NULL;
+	}
+	return res;
+}
 
+/* Starts a non-blocking connection to the pool's stratum port, at an address
+ * from resolve_stratum, without curl, for pools that do not need a proxy.
+ * Returns false if no attempt could be started, otherwise the socket becomes
+ * writable once the connection is established or has failed, see
+ * connect_stratum_done. The socket is owned by the pool itself rather than by
+ * pool->stratum_curl */
+bool connect_stratum_start(struct pool *pool, struct addrinfo *res)
+{
+	struct addrinfo *ai;
+	SOCKETTYPE sock = INVSOCK;
+	int ret;
+
+	mutex_lock(&pool->stratum_lock);
+	reset_stratum(pool);
+	if (pool->stratum_curl) {
+		curl_easy_cleanup(pool->stratum_curl);
+		pool->stratum_curl = NULL;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+#ifndef WIN32
+		const int one = 1;
+#else
+		const char one = 1;
+		u_long nonblock = 1;
+#endif
+
+		sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (sock == INVSOCK)
+			continue;
+#ifndef WIN32
+		fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+#else
+		ioctlsocket(sock, FIONBIO, &nonblock);
+#endif
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		keep_sockalive(sock);
+
+		ret = connect(sock, ai->ai_addr, ai->ai_addrlen);
+#ifndef WIN32
+		if (!ret || errno == EINPROGRESS)
+#else
+		if (!ret || WSAGetLastError() == WSAEWOULDBLOCK)
+#endif
+			break;
+		CLOSESOCKET(sock);
+		sock = INVSOCK;
+	}
+	pool->sock = sock;
 	mutex_unlock(&pool->stratum_lock);
-	
-	sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", swork_id++);
 
-	if (!_stratum_send(pool, s, strlen(s), true)) {
-		applog(LOG_DEBUG, "Failed to send s in initiate_stratum");
-		goto out;
+	if (sock == INVSOCK) {
+		applog(LOG_INFO, "Stratum connect failed to pool %d: %s", pool->pool_no, SOCKERRMSG);
+		return false;
 	}
+	return true;
+}
 
-	if (!socket_full(pool, DEFAULT_SOCKWAIT)) {
-		applog(LOG_DEBUG, "Timed out waiting for response in initiate_stratum");
-		goto out;
+/* Checks the outcome of a connection started by connect_stratum_start once
+ * its socket has become writable */
+bool connect_stratum_done(struct pool *pool)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(pool->sock, SOL_SOCKET, SO_ERROR, (void *)&err, &len) || err) {
+		applog(LOG_INFO, "Stratum connect failed to pool %d: %s",
+		       pool->pool_no, err ? strerror(err) : SOCKERRMSG);
+		return false;
 	}
 
-	sret = recv_line(pool);
-	if (!sret)
-		goto out;
+	pool->cgminer_pool_stats.times_sent++;
+	pool->cgminer_pool_stats.times_received++;
+	return true;
+}
+
+/* Asks to resume the previous session when we have one, which the pool
+ * grants by handing back the same extranonce1 */
+bool send_subscribe(struct pool *pool)
+{
+	char s[RBUFSIZE];
+
+	if (pool->sessionid)
+		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION"\", \"%s\"]}",
+		        swork_id++, pool->sessionid);
+	else
+		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", swork_id++);
+
+	return _stratum_send(pool, s, strlen(s), true);
+}
+
+/* Finds the mining.notify subscription id, which is what identifies the
+ * session, in either [name, id] or [[name, id], ...] form */
+static char *subscribe_sessionid(json_t *subs)
+{
+	size_t i;
+
+	if (!json_is_array(subs))
+		return NULL;
+	if (json_is_string(json_array_get(subs, 0))) {
+		const char *name = json_string_value(json_array_get(subs, 0));
+		const char *id = json_string_value(json_array_get(subs, 1));
+
+		if (id && !strcasecmp(name, "mining.notify"))
+			return strdup(id);
+		return NULL;
+	}
+	for (i = 0; i < json_array_size(subs); i++) {
+		char *id = subscribe_sessionid(json_array_get(subs, i));
+
+		if (id)
+			return id;
+	}
+	return NULL;
+}
+
+/* Checks the response to mining.subscribe sent by send_subscribe and takes
+ * the session's extranonce from it */
+bool stratum_subscribed(struct pool *pool, char *s)
+{
+	json_t *val = NULL, *res_val, *err_val;
+	json_error_t err;
+	bool ret = false;
+	char *nonce1;
+	int n2size;
 
-	val = JSON_LOADS(sret, &err);
-	free(sret);
+	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -1765,38 +2551,72 @@ bool initiate_stratum(struct pool *pool)
 		goto out;
 	}
 
-	free(pool->nonce1);
-	pool->nonce1 = json_array_string(res_val, 1);
-	if (!pool->nonce1) {
-		applog(LOG_INFO, "Failed to get nonce1 in initiate_stratum");
+	nonce1 = json_array_string(res_val, 1);
+	if (!nonce1) {
+		applog(LOG_INFO, "Failed to get nonce1 in stratum_subscribed");
 		goto out;
 	}
+	n2size = json_integer_value(json_array_get(res_val, 2));
+	/* Only the same extranonce1 and extranonce2 size leave the shares and
+	 * work of the old session valid */
+	pool->session_resumed = pool->sessionid && pool->nonce1 && !strcmp(pool->nonce1, nonce1) &&
+				n2size == pool->n2size;
+	free(pool->sessionid);
+	pool->sessionid = subscribe_sessionid(json_array_get(res_val, 0));
+	free(pool->nonce1);
+	free(pool->nonce1_next);
+	pool->nonce1_next = NULL;
+	pool->nonce1 = nonce1;
 	pool->n1_len = strlen(pool->nonce1) / 2;
-	pool->n2size = json_integer_value(json_array_get(res_val, 2));
+	pool->n2size = n2size;
 	if (!pool->n2size) {
-		applog(LOG_INFO, "Failed to get n2size in initiate_stratum");
+		applog(LOG_INFO, "Failed to get n2size in stratum_subscribed");
 		goto out;
 	}
 
 	ret = true;
+	if (!pool->stratum_url)
+		pool->stratum_url = pool->sockaddr_url;
+	pool->stratum_active = true;
+	/* A resumed session carries on at the difficulty it had */
+	if (!pool->session_resumed)
+		pool->swork.diff = 1;
+	if (opt_protocol) {
+		applog(LOG_DEBUG, "Pool %d confirmed mining.subscribe with extranonce1 %s extran2size %d",
+		       pool->pool_no, pool->nonce1, pool->n2size);
+	}
 out:
 	if (val)
-	{
 		json_decref(val);
-		val = NULL;
+
+	return ret;
+}
+
+bool initiate_stratum(struct pool *pool)
+{
+	char *sret = NULL;
+	bool ret = false;
+
+	if (!connect_stratum_curl(pool))
+		goto out;
+
+	if (!send_subscribe(pool)) {
+		applog(LOG_DEBUG, "Failed to send s in initiate_stratum");
+		goto out;
 	}
 
-	if (ret) {
-		if (!pool->stratum_url)
-			pool->stratum_url = pool->sockaddr_url;
-		pool->stratum_active = true;
-		pool->swork.diff = 1;
-		if (opt_protocol) {
-			applog(LOG_DEBUG, "Pool %d confirmed mining.subscribe with extranonce1 %s extran2size %d",
-			       pool->pool_no, pool->nonce1, pool->n2size);
-		}
-	} else
-	{
+	if (!socket_full(pool, DEFAULT_SOCKWAIT)) {
+		applog(LOG_DEBUG, "Timed out waiting for response in initiate_stratum");
+		goto out;
+	}
+
+	sret = recv_line(pool);
+	if (!sret)
+		goto out;
+
+	ret = stratum_subscribed(pool, sret);
+out:
+	if (!ret) {
 		applog(LOG_DEBUG, "Initiate stratum failed");
 		if (pool->sock != INVSOCK) {
 			shutdown(pool->sock, SHUT_RDWR);
@@ -1807,14 +2627,19 @@ out:
 	return ret;
 }
 
+/* Closes the stratum socket, whether it belongs to curl or to the pool */
 void suspend_stratum(struct pool *pool)
 {
 	applog(LOG_INFO, "Closing socket for stratum pool %d", pool->pool_no);
 	mutex_lock(&pool->stratum_lock);
 	pool->stratum_active = false;
 	pool->stratum_auth = false;
-	curl_easy_cleanup(pool->stratum_curl);
-	pool->stratum_curl = NULL;
+	pool->sendbuf_len = 0;
+	if (pool->stratum_curl) {
+		curl_easy_cleanup(pool->stratum_curl);
+		pool->stratum_curl = NULL;
+	} else if (pool->sock != INVSOCK)
+		CLOSESOCKET(pool->sock);
 	pool->sock = INVSOCK;
 	mutex_unlock(&pool->stratum_lock);
 }
@@ -71,6 +71,7 @@ extern char *json_dumps_ANY(json_t *, size_t flags);
 struct pool;
 enum dev_reason;
 struct cgpu_info;
+struct addrinfo;
 
 extern void json_rpc_call_async(CURL *, const char *url, const char *userpass, const char *rpc_req, bool longpoll, struct pool *pool, bool share, void *priv);
 extern json_t *json_rpc_call_completed(CURL *, int rc, bool probe, int *rolltime, void *out_priv);
@@ -83,11 +84,39 @@ extern bool hash_target_check_v(const unsigned char *hash, const unsigned char *
 
 bool _stratum_send(struct pool *pool, char *s, ssize_t len, bool force);
 #define stratum_send(pool, s, len)  _stratum_send(pool, s, len, false)
+void stratum_queue_line(struct pool *pool, const char *s, size_t len);
+bool stratum_flush(struct pool *pool);
 bool sock_full(struct pool *pool);
+bool sock_fill(struct pool *pool);
+char *next_line(struct pool *pool);
 char *recv_line(struct pool *pool);
+
+/* Top level members of a stratum line located without building a json tree.
+ * Each points at the start of the raw value within the line, or is NULL */
+struct stratum_msg {
+	const char *method;
+	size_t method_len;
+	const char *id;
+	const char *params;
+	const char *result;
+	const char *error;
+};
+
+bool stratum_scan(const char *s, struct stratum_msg *msg);
+bool json_literal(const char *p, const char *lit);
+bool parse_method_fast(struct pool *pool, struct stratum_msg *msg);
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(struct pool *pool, char *url);
+bool send_auth(struct pool *pool);
+bool stratum_suggest_diff(struct pool *pool, double diff);
+bool stratum_authorised(struct pool *pool, char *s);
 bool auth_stratum(struct pool *pool);
+bool connect_stratum_curl(struct pool *pool);
+struct addrinfo *resolve_stratum(struct pool *pool);
+bool connect_stratum_start(struct pool *pool, struct addrinfo *res);
+bool connect_stratum_done(struct pool *pool);
+bool send_subscribe(struct pool *pool);
+bool stratum_subscribed(struct pool *pool, char *s);
 bool initiate_stratum(struct pool *pool);
 void suspend_stratum(struct pool *pool);
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);